@@ -0,0 +1,460 @@
+#include "benchmark.hpp"
+
+#include "lodbuilder.hpp"
+#include "types.hpp"
+#include "../urhoextras/meshoptimizer.hpp"
+#include "../urhoextras/modelcombiner.hpp"
+#include "../urhoextras/random.hpp"
+
+#include <Urho3D/Container/Sort.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Core/WorkQueue.h>
+#include <Urho3D/Graphics/Geometry.h>
+#include <Urho3D/Graphics/IndexBuffer.h>
+#include <Urho3D/Graphics/Material.h>
+#include <Urho3D/Graphics/Model.h>
+#include <Urho3D/Graphics/VertexBuffer.h>
+#include <Urho3D/IO/Log.h>
+
+#include <map>
+
+namespace BigWorld
+{
+
+namespace
+{
+
+// Creates a flat square of 2x2 quads. Its edge vertices are at the same
+// positions as the ones of its neighbours, when squares are in a grid.
+Urho3D::SharedPtr<Urho3D::Model> createTileModel(Urho3D::Context* context)
+{
+	Urho3D::PODVector<float> vrts;
+	for (unsigned y = 0; y <= 2; ++ y) {
+		for (unsigned x = 0; x <= 2; ++ x) {
+			vrts.Push(x * 0.5);
+			vrts.Push(0);
+			vrts.Push(y * 0.5);
+			vrts.Push(0);
+			vrts.Push(1);
+			vrts.Push(0);
+		}
+	}
+	Urho3D::PODVector<unsigned short> idxs;
+	for (unsigned y = 0; y < 2; ++ y) {
+		for (unsigned x = 0; x < 2; ++ x) {
+			unsigned short sw = y * 3 + x;
+			idxs.Push(sw);
+			idxs.Push(sw + 3);
+			idxs.Push(sw + 1);
+			idxs.Push(sw + 1);
+			idxs.Push(sw + 3);
+			idxs.Push(sw + 4);
+		}
+	}
+
+	Urho3D::PODVector<Urho3D::VertexElement> elems;
+	elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_POSITION));
+	elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_NORMAL));
+
+	Urho3D::SharedPtr<Urho3D::VertexBuffer> vbuf(new Urho3D::VertexBuffer(context));
+	vbuf->SetShadowed(true);
+	vbuf->SetSize(vrts.Size() / 6, elems);
+	vbuf->SetData(vrts.Buffer());
+
+	Urho3D::SharedPtr<Urho3D::IndexBuffer> ibuf(new Urho3D::IndexBuffer(context));
+	ibuf->SetShadowed(true);
+	ibuf->SetSize(idxs.Size(), false);
+	ibuf->SetData(idxs.Buffer());
+
+	Urho3D::SharedPtr<Urho3D::Geometry> geom(new Urho3D::Geometry(context));
+	geom->SetVertexBuffer(0, vbuf);
+	geom->SetIndexBuffer(ibuf);
+	geom->SetDrawRange(Urho3D::TRIANGLE_LIST, 0, idxs.Size());
+
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::VertexBuffer> > vbufs;
+	vbufs.Push(vbuf);
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::IndexBuffer> > ibufs;
+	ibufs.Push(ibuf);
+
+	Urho3D::SharedPtr<Urho3D::Model> model(new Urho3D::Model(context));
+	model->SetVertexBuffers(vbufs, Urho3D::PODVector<unsigned>(), Urho3D::PODVector<unsigned>());
+	model->SetIndexBuffers(ibufs);
+	model->SetNumGeometries(1);
+	model->SetGeometry(0, 0, geom);
+	model->SetBoundingBox(Urho3D::BoundingBox(Urho3D::Vector3::ZERO, Urho3D::Vector3(1, 0, 1)));
+	return model;
+}
+
+// Combines a grid of tiles and returns the combined Model
+Urho3D::SharedPtr<Urho3D::Model> combineTiles(Urho3D::Context* context, Urho3D::Model const* tile, Urho3D::Material* mat, unsigned grid_width, bool welding, bool optimize_mesh)
+{
+	Urho3D::SharedPtr<UrhoExtras::ModelCombiner> combiner(new UrhoExtras::ModelCombiner(context));
+	combiner->SetWeldingEnabled(welding);
+	combiner->SetMeshOptimizationEnabled(optimize_mesh);
+	for (unsigned y = 0; y < grid_width; ++ y) {
+		for (unsigned x = 0; x < grid_width; ++ x) {
+			combiner->AddModel(tile, mat, Urho3D::Vector3(x, 0, y), Urho3D::Quaternion::IDENTITY);
+		}
+	}
+	combiner->FinalizeNow();
+	return Urho3D::SharedPtr<Urho3D::Model>(combiner->GetModel());
+}
+
+unsigned getVertexCount(Urho3D::Model const* model)
+{
+	if (!model) {
+		return 0;
+	}
+	unsigned result = 0;
+	for (unsigned i = 0; i < model->GetVertexBuffers().Size(); ++ i) {
+		result += model->GetVertexBuffers()[i]->GetVertexCount();
+	}
+	return result;
+}
+
+// Returns average cache miss ratio of the full detail level of Model
+float getAcmr(Urho3D::Model const* model)
+{
+	if (!model) {
+		return 0;
+	}
+	float acmr_sum = 0;
+	unsigned tris = 0;
+	Urho3D::PODVector<unsigned> idxs;
+	for (unsigned geom_i = 0; geom_i < model->GetNumGeometries(); ++ geom_i) {
+		Urho3D::Geometry const* geom = model->GetGeometry(geom_i, 0);
+		Urho3D::IndexBuffer const* ibuf = geom->GetIndexBuffer();
+		unsigned char const* ibuf_data = ibuf->GetShadowData();
+		idxs.Clear();
+		for (unsigned i = geom->GetIndexStart(); i < geom->GetIndexStart() + geom->GetIndexCount(); ++ i) {
+			if (ibuf->GetIndexSize() == 4) {
+				idxs.Push(((unsigned const*)ibuf_data)[i]);
+			} else {
+				idxs.Push(((unsigned short const*)ibuf_data)[i]);
+			}
+		}
+		unsigned vrts_size = geom->GetVertexBuffer(0)->GetVertexCount();
+		acmr_sum += UrhoExtras::calculateAcmr(idxs.Buffer(), idxs.Size(), vrts_size) * idxs.Size() / 3;
+		tris += idxs.Size() / 3;
+	}
+	return tris ? acmr_sum / tris : 0;
+}
+
+// Creates corners of a Chunk, with some hills and a few terraintypes
+void createRandomCorners(Corners& result, unsigned chunk_width, unsigned ttypes_size, UrhoExtras::Random& rnd)
+{
+	unsigned const CHUNK_W3 = chunk_width + 3;
+	result.Clear();
+	result.Reserve(CHUNK_W3 * CHUNK_W3);
+	for (unsigned y = 0; y < CHUNK_W3; ++ y) {
+		for (unsigned x = 0; x < CHUNK_W3; ++ x) {
+			Corner corner;
+			corner.height = 1000 + 200 * Urho3D::Sin(x * 11.0f) * Urho3D::Cos(y * 7.0f) + rnd.randomUnsigned(20);
+			unsigned corner_ttypes_size = 1 + rnd.randomUnsigned(3);
+			for (unsigned i = 0; i < corner_ttypes_size; ++ i) {
+				corner.ttypes.setByte(rnd.randomUnsigned(ttypes_size), 1 + rnd.randomUnsigned(255));
+			}
+			result.Push(corner);
+		}
+	}
+}
+
+// The original way of calculating terraintype image, using floats, Colors
+// and HashMap. This is kept for comparing speed and results.
+Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImageWithColors(TTypes& result_used_ttypes, Urho3D::Context* context, Corners const& corners, unsigned chunk_width)
+{
+	unsigned const CHUNK_W1 = chunk_width + 1;
+	unsigned const CHUNK_W3 = chunk_width + 3;
+
+	Urho3D::HashMap<uint8_t, float> used_ttypes;
+	for (unsigned y = 0; y < CHUNK_W1; ++ y) {
+		unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
+		for (unsigned x = 0; x < CHUNK_W1; ++ x) {
+			Corner const& corner = corners[ofs];
+			for (unsigned ttypes_i = 0; ttypes_i < corner.ttypes.size(); ++ ttypes_i) {
+				uint8_t ttype = corner.ttypes.getKey(ttypes_i);
+				float weight = corner.ttypes.getValue(ttypes_i);
+				if (weight > 0) {
+					if (!used_ttypes.Contains(ttype)) {
+						used_ttypes[ttype] = 0;
+					}
+					used_ttypes[ttype] += weight;
+				}
+			}
+			++ ofs;
+		}
+	}
+	while (used_ttypes.Size() > 4) {
+		float lowest_usage = 9999999;
+		unsigned lowest_usage_ttype = 0;
+		for (Urho3D::HashMap<uint8_t, float>::Iterator it = used_ttypes.Begin(); it != used_ttypes.End(); ++ it) {
+			if (it->second_ < lowest_usage) {
+				lowest_usage = it->second_;
+				lowest_usage_ttype = it->first_;
+			}
+		}
+		used_ttypes.Erase(lowest_usage_ttype);
+	}
+	for (Urho3D::HashMap<uint8_t, float>::Iterator i = used_ttypes.Begin(); i != used_ttypes.End(); ++ i) {
+		result_used_ttypes.Push(i->first_);
+	}
+	Urho3D::Sort(result_used_ttypes.Begin(), result_used_ttypes.End());
+
+	if (result_used_ttypes.Size() == 1) {
+		return Urho3D::SharedPtr<Urho3D::Image> ();
+	}
+
+	Urho3D::SharedPtr<Urho3D::Image> img(new Urho3D::Image(context));
+	img->SetSize(CHUNK_W1, CHUNK_W1, result_used_ttypes.Size() == 4 ? 4 : 3);
+	for (unsigned y = 0; y < CHUNK_W1; ++ y) {
+		unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
+		for (unsigned x = 0; x < CHUNK_W1; ++ x) {
+			TTypesByWeight const& ttypes = corners[ofs].ttypes;
+			float w[4] = { 0, 0, 0, 0 };
+			float total = 0;
+			for (unsigned i = 0; i < result_used_ttypes.Size(); ++ i) {
+				w[i] = ttypes[result_used_ttypes[i]];
+				total += w[i];
+			}
+			if (total == 0) {
+				w[0] = 1;
+				total = 1;
+			}
+			img->SetPixel(x, y, Urho3D::Color(w[0] / total, w[1] / total, w[2] / total, w[3] / total));
+			++ ofs;
+		}
+	}
+
+	return img;
+}
+
+void benchmarkTerraintypeImage(Urho3D::Context* context)
+{
+	unsigned const CHUNK_WIDTH = 64;
+	unsigned const ROUNDS = 200;
+
+	// More terraintypes than fit to image, so some must be dropped
+	UrhoExtras::Random rnd(1);
+	Urho3D::Vector<Corners> chunks_corners(ROUNDS);
+	for (unsigned i = 0; i < ROUNDS; ++ i) {
+		createRandomCorners(chunks_corners[i], CHUNK_WIDTH, 6, rnd);
+	}
+
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Image> > imgs_bytes(ROUNDS);
+	Urho3D::Vector<TTypes> used_ttypes_bytes(ROUNDS);
+	Urho3D::HiresTimer timer;
+	for (unsigned i = 0; i < ROUNDS; ++ i) {
+		imgs_bytes[i] = calculateTerraintypeImage(used_ttypes_bytes[i], context, chunks_corners[i], CHUNK_WIDTH);
+	}
+	long long usec_bytes = timer.GetUSec(true);
+
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Image> > imgs_colors(ROUNDS);
+	Urho3D::Vector<TTypes> used_ttypes_colors(ROUNDS);
+	for (unsigned i = 0; i < ROUNDS; ++ i) {
+		imgs_colors[i] = calculateTerraintypeImageWithColors(used_ttypes_colors[i], context, chunks_corners[i], CHUNK_WIDTH);
+	}
+	long long usec_colors = timer.GetUSec(false);
+
+	// Results may differ by rounding only
+	unsigned palette_mismatches = 0;
+	int max_diff = 0;
+	for (unsigned i = 0; i < ROUNDS; ++ i) {
+		if (used_ttypes_bytes[i] != used_ttypes_colors[i]) {
+			++ palette_mismatches;
+			continue;
+		}
+		if (imgs_bytes[i].Null() || imgs_colors[i].Null()) {
+			continue;
+		}
+		unsigned data_size = imgs_bytes[i]->GetWidth() * imgs_bytes[i]->GetHeight() * imgs_bytes[i]->GetComponents();
+		for (unsigned j = 0; j < data_size; ++ j) {
+			max_diff = Urho3D::Max(max_diff, Urho3D::Abs(int(imgs_bytes[i]->GetData()[j]) - int(imgs_colors[i]->GetData()[j])));
+		}
+	}
+
+	URHO3D_LOGINFOF("Terraintype image, %u chunks of width %u: %.2f ms with bytes, %.2f ms with Colors",
+	                ROUNDS, CHUNK_WIDTH, usec_bytes / 1000.0, usec_colors / 1000.0);
+	URHO3D_LOGINFOF("Terraintype image, %u palette mismatches, maximum channel difference %d",
+	                palette_mismatches, max_diff);
+}
+
+// The original way of blending terraintypes of two corners, using std::map.
+// This is kept for comparing speed to TTypesBlend.
+TTypesByWeight averageOfTwoWithMap(TTypesByWeight const& a, TTypesByWeight const& b)
+{
+	// For better precision, store both first to map
+	std::map<uint8_t, uint16_t> temp;
+	for (unsigned i = 0; i < a.size(); ++ i) {
+		uint8_t v = a.getValueByte(i);
+		if (v > 0) {
+			temp[a.getKey(i)] = v;
+		}
+	}
+	for (unsigned i = 0; i < b.size(); ++ i) {
+		uint8_t v = b.getValueByte(i);
+		if (v > 0) {
+			uint8_t k = b.getKey(i);
+			std::map<uint8_t, uint16_t>::iterator temp_find = temp.find(k);
+			if (temp_find != temp.end()) {
+				temp_find->second += v;
+			} else {
+				temp[k] = v;
+			}
+		}
+	}
+	// Construct result
+	TTypesByWeight result;
+	for (std::map<uint8_t, uint16_t>::iterator i = temp.begin(); i != temp.end(); ++ i) {
+		uint8_t v = i->second / 2;
+		if (v > 0) {
+			result.setByte(i->first, v);
+		}
+	}
+	return result;
+}
+
+// Selects terraintype of every square from its four corners, like undergrowth
+// placement does, first with the original map based averaging and then with
+// TTypesBlend. Selections are not expected to be identical, because averaging
+// rounds weights down and the order of terraintypes differs.
+void benchmarkTTypesBlend()
+{
+	unsigned const CHUNK_WIDTH = 64;
+	unsigned const CHUNK_W3 = CHUNK_WIDTH + 3;
+	unsigned const ROUNDS = 200;
+
+	UrhoExtras::Random rnd(1);
+	Urho3D::Vector<Corners> chunks_corners(ROUNDS);
+	for (unsigned i = 0; i < ROUNDS; ++ i) {
+		createRandomCorners(chunks_corners[i], CHUNK_WIDTH, 6, rnd);
+	}
+
+	unsigned checksum_map = 0;
+	UrhoExtras::Random rnd_map(2);
+	Urho3D::HiresTimer timer;
+	for (unsigned i = 0; i < ROUNDS; ++ i) {
+		Corners const& corners = chunks_corners[i];
+		for (unsigned y = 0; y < CHUNK_W3 - 1; ++ y) {
+			for (unsigned x = 0; x < CHUNK_W3 - 1; ++ x) {
+				unsigned ofs_sw = x + y * CHUNK_W3;
+				TTypesByWeight const& sw = corners[ofs_sw].ttypes;
+				TTypesByWeight const& se = corners[ofs_sw + 1].ttypes;
+				TTypesByWeight const& nw = corners[ofs_sw + CHUNK_W3].ttypes;
+				TTypesByWeight const& ne = corners[ofs_sw + CHUNK_W3 + 1].ttypes;
+				TTypesByWeight ttypes = averageOfTwoWithMap(averageOfTwoWithMap(sw, se), averageOfTwoWithMap(nw, ne));
+				unsigned total_weight = ttypes.getTotalWeight();
+				if (total_weight == 0) {
+					continue;
+				}
+				unsigned selection_weight = rnd_map.randomUnsigned() % total_weight;
+				unsigned selection_idx = 0;
+				while (selection_weight >= ttypes.getValueByte(selection_idx)) {
+					selection_weight -= ttypes.getValueByte(selection_idx);
+					++ selection_idx;
+				}
+				checksum_map += ttypes.getKey(selection_idx);
+			}
+		}
+	}
+	long long usec_map = timer.GetUSec(true);
+
+	unsigned checksum_blend = 0;
+	UrhoExtras::Random rnd_blend(2);
+	TTypesBlend blend;
+	for (unsigned i = 0; i < ROUNDS; ++ i) {
+		Corners const& corners = chunks_corners[i];
+		for (unsigned y = 0; y < CHUNK_W3 - 1; ++ y) {
+			for (unsigned x = 0; x < CHUNK_W3 - 1; ++ x) {
+				unsigned ofs_sw = x + y * CHUNK_W3;
+				blend.clear();
+				blend.add(corners[ofs_sw].ttypes);
+				blend.add(corners[ofs_sw + 1].ttypes);
+				blend.add(corners[ofs_sw + CHUNK_W3].ttypes);
+				blend.add(corners[ofs_sw + CHUNK_W3 + 1].ttypes);
+				if (blend.size() == 0) {
+					continue;
+				}
+				checksum_blend += blend.select(rnd_blend.randomUnsigned());
+			}
+		}
+	}
+	long long usec_blend = timer.GetUSec(false);
+
+	URHO3D_LOGINFOF("Terraintype blending, %u chunks of width %u: %.2f ms with std::map, %.2f ms with TTypesBlend",
+	                ROUNDS, CHUNK_WIDTH, usec_map / 1000.0, usec_blend / 1000.0);
+	URHO3D_LOGINFOF("Terraintype blending, selection checksums %u with std::map, %u with TTypesBlend",
+	                checksum_map, checksum_blend);
+}
+
+void benchmarkTerrainLod(Urho3D::Context* context)
+{
+	unsigned const CHUNK_WIDTH = 64;
+
+	UrhoExtras::Random rnd(1);
+	Corners corners;
+	createRandomCorners(corners, CHUNK_WIDTH, 4, rnd);
+
+	for (unsigned optimize_mesh = 0; optimize_mesh < 2; ++ optimize_mesh) {
+		Urho3D::SharedPtr<LodBuildingTaskData> data(new LodBuildingTaskData);
+		data->context = context;
+		data->lod = 0;
+		data->corners = corners;
+		data->baseheight = 1000;
+		data->calculate_ttype_image = false;
+		data->texture_array_mode = false;
+		data->dominant_ttype_only = false;
+		data->chunk_width = CHUNK_WIDTH;
+		data->sqr_width = 2;
+		data->heightstep = 0.1;
+		data->terrain_texture_repeats = 1;
+		data->optimize_mesh = optimize_mesh;
+
+		Urho3D::WorkItem item;
+		item.aux_ = data;
+		Urho3D::HiresTimer timer;
+		buildLod(&item, 0);
+		long long usec = timer.GetUSec(false);
+
+		unsigned vrts_size = data->vrts_data.Size() / Urho3D::VertexBuffer::GetVertexSize(data->vrts_elems);
+		float acmr = UrhoExtras::calculateAcmr(data->idxs_data.Buffer(), data->idxs_data.Size(), vrts_size);
+		URHO3D_LOGINFOF("Terrain LOD, width %u, mesh optimization %s: %.2f ms, ACMR %.3f",
+		                CHUNK_WIDTH, optimize_mesh ? "on" : "off", usec / 1000.0, acmr);
+	}
+}
+
+void benchmarkModelCombiner(Urho3D::Context* context)
+{
+	unsigned const GRID_WIDTH = 100;
+
+	Urho3D::SharedPtr<Urho3D::Model> tile = createTileModel(context);
+	Urho3D::SharedPtr<Urho3D::Material> mat(new Urho3D::Material(context));
+
+	for (unsigned welding = 0; welding < 2; ++ welding) {
+		Urho3D::HiresTimer timer;
+		Urho3D::SharedPtr<Urho3D::Model> model = combineTiles(context, tile, mat, GRID_WIDTH, welding, false);
+		long long usec = timer.GetUSec(false);
+		URHO3D_LOGINFOF("ModelCombiner, %u models, welding %s: %.2f ms, %u vertices",
+		                GRID_WIDTH * GRID_WIDTH, welding ? "on" : "off", usec / 1000.0, getVertexCount(model));
+	}
+
+	// Cache efficiency of welded result, before and after optimization
+	for (unsigned optimize_mesh = 0; optimize_mesh < 2; ++ optimize_mesh) {
+		Urho3D::HiresTimer timer;
+		Urho3D::SharedPtr<Urho3D::Model> model = combineTiles(context, tile, mat, GRID_WIDTH, true, optimize_mesh);
+		long long usec = timer.GetUSec(false);
+		URHO3D_LOGINFOF("ModelCombiner, %u models, mesh optimization %s: %.2f ms, ACMR %.3f",
+		                GRID_WIDTH * GRID_WIDTH, optimize_mesh ? "on" : "off", usec / 1000.0, getAcmr(model));
+	}
+}
+
+}
+
+void runBenchmarks(Urho3D::Context* context)
+{
+	benchmarkModelCombiner(context);
+	benchmarkTerrainLod(context);
+	benchmarkTerraintypeImage(context);
+	benchmarkTTypesBlend();
+}
+
+}
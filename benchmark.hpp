@@ -0,0 +1,14 @@
+#ifndef BIGWORLD_BENCHMARK_HPP
+#define BIGWORLD_BENCHMARK_HPP
+
+#include <Urho3D/Core/Context.h>
+
+namespace BigWorld
+{
+
+// Measures speed of mesh generation and logs the results.
+void runBenchmarks(Urho3D::Context* context);
+
+}
+
+#endif
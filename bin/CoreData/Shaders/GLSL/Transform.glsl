@@ -177,6 +177,8 @@ vec3 GetWorldNormal(mat4 modelMatrix)
         return GetTrailNormal(iPos);
     #elif defined(TRAILBONE)
         return GetTrailNormal(iPos, iTangent.xyz, iNormal);
+    #elif defined(PACKEDNORMAL)
+        return normalize((iNormal * 2.0 - 1.0) * GetNormalMatrix(modelMatrix));
     #else
         return normalize(iNormal * GetNormalMatrix(modelMatrix));
     #endif
@@ -188,6 +190,8 @@ vec4 GetWorldTangent(mat4 modelMatrix)
         return vec4(normalize(vec3(1.0, 0.0, 0.0) * cBillboardRot), 1.0);
     #elif defined(DIRBILLBOARD)
         return vec4(normalize(vec3(1.0, 0.0, 0.0) * GetNormalMatrix(modelMatrix)), 1.0);
+    #elif defined(PACKEDNORMAL)
+        return vec4(normalize((iTangent.xyz * 2.0 - 1.0) * GetNormalMatrix(modelMatrix)), iTangent.w * 2.0 - 1.0);
     #else
         return vec4(normalize(iTangent.xyz * GetNormalMatrix(modelMatrix)), iTangent.w);
     #endif
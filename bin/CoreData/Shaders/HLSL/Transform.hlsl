@@ -133,6 +133,8 @@ float3 GetTrailNormal(float4 iPos, float3 iParentPos, float3 iForward)
     #define GetWorldNormal(modelMatrix) GetTrailNormal(iPos)
 #elif defined(TRAILBONE)
     #define GetWorldNormal(modelMatrix) GetTrailNormal(iPos, iTangent.xyz, iNormal)
+#elif defined(PACKEDNORMAL)
+    #define GetWorldNormal(modelMatrix) normalize(mul(iNormal * 2.0 - 1.0, (float3x3)modelMatrix))
 #else
     #define GetWorldNormal(modelMatrix) normalize(mul(iNormal, (float3x3)modelMatrix))
 #endif
@@ -141,6 +143,8 @@ float3 GetTrailNormal(float4 iPos, float3 iParentPos, float3 iForward)
     #define GetWorldTangent(modelMatrix) float4(normalize(mul(float3(1.0, 0.0, 0.0), cBillboardRot)), 1.0)
 #elif defined(DIRBILLBOARD)
     #define GetWorldTangent(modelMatrix) float4(normalize(mul(float3(1.0, 0.0, 0.0), (float3x3)modelMatrix)), 1.0)
+#elif defined(PACKEDNORMAL)
+    #define GetWorldTangent(modelMatrix) float4(normalize(mul(iTangent.xyz * 2.0 - 1.0, (float3x3)modelMatrix)), iTangent.w * 2.0 - 1.0)
 #else
     #define GetWorldTangent(modelMatrix) float4(normalize(mul(iTangent.xyz, (float3x3)modelMatrix)), iTangent.w)
 #endif
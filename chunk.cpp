@@ -2,6 +2,8 @@
 
 #include "chunkworld.hpp"
 #include "lodbuilder.hpp"
+#include "../urhoextras/instancedmodel.hpp"
+#include "../urhoextras/procedural/md5rng.hpp"
 #include "../urhoextras/random.hpp"
 #include "../urhoextras/utils.hpp"
 
@@ -12,20 +14,99 @@
 #include <Urho3D/Graphics/Technique.h>
 #include <Urho3D/Graphics/Texture2D.h>
 #include <Urho3D/Graphics/VertexBuffer.h>
+#include <Urho3D/IO/File.h>
+#include <Urho3D/IO/FileSystem.h>
+#include <Urho3D/Math/MathDefs.h>
 #include <Urho3D/Resource/ResourceCache.h>
 #include <Urho3D/Scene/Scene.h>
 
+#ifdef URHO3D_SSE
+#include <xmmintrin.h>
+#endif
+
 #include <stdexcept>
 
 namespace BigWorld
 {
 
+void getUndergrowthTransforms(Urho3D::Matrix3x4* result, UndergrowthInstance const* instances, unsigned count)
+{
+	unsigned i = 0;
+#ifdef URHO3D_SSE
+	// Convert four instances at a time. Quaternions are not normalized,
+	// but scaling with 2 / |q|^2 gives proper rotation anyway.
+	__m128 const SNORM_SCALE = _mm_set1_ps(1.0f / 32767);
+	__m128 const ONE = _mm_set1_ps(1);
+	__m128 const TWO = _mm_set1_ps(2);
+	for (; i + 4 <= count; i += 4) {
+		UndergrowthInstance const* inst = instances + i;
+		__m128 qw = _mm_mul_ps(_mm_set_ps(inst[3].rot[0], inst[2].rot[0], inst[1].rot[0], inst[0].rot[0]), SNORM_SCALE);
+		__m128 qx = _mm_mul_ps(_mm_set_ps(inst[3].rot[1], inst[2].rot[1], inst[1].rot[1], inst[0].rot[1]), SNORM_SCALE);
+		__m128 qy = _mm_mul_ps(_mm_set_ps(inst[3].rot[2], inst[2].rot[2], inst[1].rot[2], inst[0].rot[2]), SNORM_SCALE);
+		__m128 qz = _mm_mul_ps(_mm_set_ps(inst[3].rot[3], inst[2].rot[3], inst[1].rot[3], inst[0].rot[3]), SNORM_SCALE);
+		__m128 scale = _mm_set_ps(inst[3].scale, inst[2].scale, inst[1].scale, inst[0].scale);
+
+		__m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qw, qw), _mm_mul_ps(qx, qx)), _mm_add_ps(_mm_mul_ps(qy, qy), _mm_mul_ps(qz, qz)));
+		__m128 s = _mm_div_ps(TWO, len2);
+
+		__m128 xs = _mm_mul_ps(qx, s);
+		__m128 ys = _mm_mul_ps(qy, s);
+		__m128 zs = _mm_mul_ps(qz, s);
+		__m128 xx = _mm_mul_ps(qx, xs);
+		__m128 yy = _mm_mul_ps(qy, ys);
+		__m128 zz = _mm_mul_ps(qz, zs);
+		__m128 xy = _mm_mul_ps(qx, ys);
+		__m128 xz = _mm_mul_ps(qx, zs);
+		__m128 yz = _mm_mul_ps(qy, zs);
+		__m128 wx = _mm_mul_ps(qw, xs);
+		__m128 wy = _mm_mul_ps(qw, ys);
+		__m128 wz = _mm_mul_ps(qw, zs);
+
+		float m[9][4];
+		_mm_storeu_ps(m[0], _mm_mul_ps(_mm_sub_ps(ONE, _mm_add_ps(yy, zz)), scale));
+		_mm_storeu_ps(m[1], _mm_mul_ps(_mm_sub_ps(xy, wz), scale));
+		_mm_storeu_ps(m[2], _mm_mul_ps(_mm_add_ps(xz, wy), scale));
+		_mm_storeu_ps(m[3], _mm_mul_ps(_mm_add_ps(xy, wz), scale));
+		_mm_storeu_ps(m[4], _mm_mul_ps(_mm_sub_ps(ONE, _mm_add_ps(xx, zz)), scale));
+		_mm_storeu_ps(m[5], _mm_mul_ps(_mm_sub_ps(yz, wx), scale));
+		_mm_storeu_ps(m[6], _mm_mul_ps(_mm_sub_ps(xz, wy), scale));
+		_mm_storeu_ps(m[7], _mm_mul_ps(_mm_add_ps(yz, wx), scale));
+		_mm_storeu_ps(m[8], _mm_mul_ps(_mm_sub_ps(ONE, _mm_add_ps(xx, yy)), scale));
+
+		for (unsigned lane = 0; lane < 4; ++ lane) {
+			Urho3D::Matrix3x4& transf = result[i + lane];
+			transf.m00_ = m[0][lane];
+			transf.m01_ = m[1][lane];
+			transf.m02_ = m[2][lane];
+			transf.m03_ = inst[lane].pos.x_;
+			transf.m10_ = m[3][lane];
+			transf.m11_ = m[4][lane];
+			transf.m12_ = m[5][lane];
+			transf.m13_ = inst[lane].pos.y_;
+			transf.m20_ = m[6][lane];
+			transf.m21_ = m[7][lane];
+			transf.m22_ = m[8][lane];
+			transf.m23_ = inst[lane].pos.z_;
+		}
+	}
+#endif
+	for (; i < count; ++ i) {
+		result[i] = instances[i].getTransform();
+	}
+}
+
 Chunk::Chunk(ChunkWorld* world, Urho3D::IntVector2 const& pos, Corners& corners) :
 Urho3D::Object(world->GetContext()),
 world(world),
 pos(pos),
 undergrowth_state(UGSTATE_NOT_INITIALIZED),
-undergrowth_node(NULL)
+undergrowth_node(NULL),
+undergrowth_cells_dirty(false),
+undergrowth_partial_rebuild(false),
+undergrowth_submit_cell(0),
+undergrowth_tier(0),
+undergrowth_old_node(NULL),
+undergrowth_checksum(0)
 {
 	if (corners.Size() != world->getChunkWidth() * world->getChunkWidth()) {
 		throw std::runtime_error("Array of corners has invalid size!");
@@ -146,8 +227,12 @@ bool Chunk::prepareForLod(uint8_t lod, Urho3D::IntVector2 const& pos)
 	task_data->sqr_width = world->getSquareWidth();
 	task_data->heightstep = world->getHeightstep();
 	task_data->terrain_texture_repeats = world->getTerrainTextureRepeats();
+	task_data->optimize_mesh = world->isMeshOptimizationUsed();
 	task_data->baseheight = baseheight;
-	task_data->calculate_ttype_image = matcache.Null();
+	// Far away LODs use simple material of the dominant terraintype
+	task_data->dominant_ttype_only = lod >= world->getMaterialLodLevel();
+	task_data->calculate_ttype_image = !task_data->dominant_ttype_only && matcache.Null();
+	task_data->texture_array_mode = !task_data->dominant_ttype_only && world->isTerrainTextureArrayUsed();
 	world->extractCornersData(task_data->corners, pos);
 	// Set up workitem
 	task_workitem = new Urho3D::WorkItem();
@@ -166,7 +251,8 @@ bool Chunk::prepareForLod(uint8_t lod, Urho3D::IntVector2 const& pos)
 void Chunk::show(Urho3D::IntVector2 const& rel_pos, unsigned origin_height, uint8_t lod)
 {
 	assert(lodcache.Contains(lod));
-	assert(!matcache.Null());
+	Urho3D::Material* mat = lod >= world->getMaterialLodLevel() ? matcache_far : matcache;
+	assert(mat);
 
 	node->SetPosition(Urho3D::Vector3(
 		rel_pos.x_ * world->getChunkWidthFloat(),
@@ -178,15 +264,15 @@ void Chunk::show(Urho3D::IntVector2 const& rel_pos, unsigned origin_height, uint
 	if (!active_model) {
 		active_model = node->CreateComponent<Urho3D::StaticModel>();
 		active_model->SetModel(lodcache[lod]);
-		active_model->SetMaterial(matcache);
+		active_model->SetMaterial(mat);
 		active_model->SetOcclusionLodLevel(lodcache[lod]->GetNumGeometryLodLevels(0) - 1);
 		active_model->SetOccludee(true);
 		active_model->SetOccluder(true);
 	}
 	// If there is active static model, but it has different properties
-	else if (active_model->GetModel() != lodcache[lod] || active_model->GetMaterial() != matcache) {
+	else if (active_model->GetModel() != lodcache[lod] || active_model->GetMaterial() != mat) {
 		active_model->SetModel(lodcache[lod]);
-		active_model->SetMaterial(matcache);
+		active_model->SetMaterial(mat);
 		active_model->SetOcclusionLodLevel(lodcache[lod]->GetNumGeometryLodLevels(0) - 1);
 		active_model->SetOccludee(true);
 		active_model->SetOccluder(true);
@@ -211,9 +297,13 @@ void Chunk::removeFromWorld(void)
 {
 	URHO3D_PROFILE(ChunkRemoveFromWorld);
 	node->Remove();
+	if (weightmap_slot.isValid()) {
+		world->getWeightMapAtlas()->release(weightmap_slot);
+	}
 	world = NULL;
 	lodcache.Clear();
 	matcache = NULL;
+	matcache_far = NULL;
 	node = NULL;
 }
 
@@ -293,8 +383,29 @@ bool Chunk::createUndergrowth()
 {
 	URHO3D_PROFILE(ChunkCreateUndergrowth);
 
+	uint8_t tier = world->getUndergrowthTier(pos);
+
 	if (undergrowth_state == UGSTATE_READY) {
-		return true;
+		// Distance tier has changed, so everything needs to be rebuilt
+		if (tier != undergrowth_tier) {
+			removeOldUndergrowth();
+			undergrowth_old_node = undergrowth_node;
+			undergrowth_node = NULL;
+			undergrowth_cells.Clear();
+			undergrowth_state = UGSTATE_NOT_INITIALIZED;
+		}
+		// Some cells need to be rebuilt
+		else if (undergrowth_cells_dirty) {
+			for (UndergrowthCell& cell : undergrowth_cells) {
+				cell.building = cell.dirty;
+				cell.dirty = false;
+			}
+			undergrowth_cells_dirty = false;
+			undergrowth_partial_rebuild = true;
+			undergrowth_state = UGSTATE_NOT_INITIALIZED;
+		} else {
+			return true;
+		}
 	}
 
 	if (undergrowth_state == UGSTATE_NOT_INITIALIZED) {
@@ -302,6 +413,27 @@ bool Chunk::createUndergrowth()
 		if (undergrowth_corners.Empty()) {
 			return false;
 		}
+		undergrowth_tier = tier;
+		undergrowth_checksum = calculateUndergrowthChecksum();
+		if (!undergrowth_partial_rebuild) {
+			undergrowth_cells.Resize(world->getUndergrowthCellsPerSide() * world->getUndergrowthCellsPerSide());
+			for (UndergrowthCell& cell : undergrowth_cells) {
+				cell.node = NULL;
+				cell.old_node = NULL;
+				cell.building = true;
+				cell.dirty = false;
+			}
+			// If this Chunk has been visited recently, placing can be skipped
+			if (world->getCachedUndergrowthPlacements(undergrowth_places, pos, undergrowth_checksum)) {
+				undergrowth_corners.Clear();
+				undergrowth_state = UGSTATE_LOADING_RESOURCES;
+				return false;
+			}
+			undergrowth_cache_file = world->getUndergrowthCacheFile(pos);
+		} else {
+			// Only part of the Chunk is placed, so it cannot be cached
+			undergrowth_cache_file.Clear();
+		}
 		undergrowth_state = UGSTATE_PLACING;
 		undergrowth_placer_wi = new Urho3D::WorkItem();
 		undergrowth_placer_wi->aux_ = this;
@@ -316,63 +448,112 @@ bool Chunk::createUndergrowth()
 			return false;
 		}
 		undergrowth_placer_wi = NULL;
+		undergrowth_corners.Clear();
+		if (!undergrowth_partial_rebuild) {
+			world->storeUndergrowthPlacementsToCache(pos, undergrowth_checksum, undergrowth_places);
+		}
 		undergrowth_state = UGSTATE_LOADING_RESOURCES;
 	}
 
 	if (undergrowth_state == UGSTATE_LOADING_RESOURCES) {
-		// Check if all models and materials are ready
-		bool resources_missing = false;
+		// ChunkWorld loads all models and materials in
+		// background. Wait until they are ready.
+		if (!world->areUndergrowthResourcesLoaded()) {
+			return false;
+		}
 		Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
-		for (StrNStr model_and_mat : undergrowth_places.Keys()) {
-			// Check model
-			Urho3D::String const& model_path = model_and_mat.first_;
-			if (!resources->GetExistingResource<Urho3D::Model>(model_path)) {
-				resources->BackgroundLoadResource<Urho3D::Model>(model_path);
-				resources_missing = true;
-			}
-			// Check material
-			Urho3D::String const& mat_path = model_and_mat.second_;
-			if (!resources->GetExistingResource<Urho3D::Material>(mat_path)) {
-				resources->BackgroundLoadResource<Urho3D::Material>(mat_path);
-				resources_missing = true;
+
+		// Resources are ready and models, positions and rotations
+		// are decided. Tier is applied only now, so simplified
+		// Models that failed to load are known and not used.
+		applyUndergrowthTier();
+		splitUndergrowthToCells();
+		if (!undergrowth_node) {
+			undergrowth_node = createChildNode();
+		}
+		for (UndergrowthCell& cell : undergrowth_cells) {
+			if (cell.building) {
+				cell.old_node = cell.node;
+				cell.node = undergrowth_node->CreateChild();
 			}
 		}
-		if (resources_missing) {
-			return false;
+
+		// If instancing is used, only the transforms need to be given to the
+		// shared Models and undergrowth is ready immediately.
+		if (world->isUndergrowthInstancingUsed()) {
+			Urho3D::PODVector<Urho3D::Matrix3x4> instances;
+			for (UndergrowthCell& cell : undergrowth_cells) {
+				if (!cell.building) {
+					continue;
+				}
+				for (UndergrowthPlacements::ConstIterator i = cell.places.Begin(); i != cell.places.End(); ++ i) {
+					instances.Resize(i->second_.Size());
+					getUndergrowthTransforms(instances.Buffer(), i->second_.Buffer(), i->second_.Size());
+					UrhoExtras::InstancedModel* imodel = new UrhoExtras::InstancedModel(context_);
+					cell.node->AddComponent(imodel, 0, Urho3D::LOCAL);
+					imodel->SetModel(resources->GetResource<Urho3D::Model>(i->first_.first_));
+					imodel->SetMaterial(resources->GetResource<Urho3D::Material>(i->first_.second_));
+					imodel->SetInstances(instances);
+					imodel->SetCastShadows(false);
+					imodel->SetDrawDistance(world->getUndergrowthDrawDistance());
+				}
+			}
+			finishUndergrowthCells();
+			return true;
 		}
 
-		// Resources are ready and models, positions and rotations are decided.
-		// Start combining one Model from them.
+		// Otherwise start combining one Model for every cell. Models
+		// are submitted to combiners in slices in the next state.
 		undergrowth_state = UGSTATE_COMBINING;
-		undergrowth_node = createChildNode();
-		undergrowth_combiner = new UrhoExtras::ModelCombiner(context_);
-		for (UndergrowthPlacements::ConstIterator i = undergrowth_places.Begin(); i != undergrowth_places.End(); ++ i) {
-			Urho3D::Model* model = resources->GetResource<Urho3D::Model>(i->first_.first_);
-			Urho3D::Material* mat = resources->GetResource<Urho3D::Material>(i->first_.second_);
-			for (Urho3D::Matrix4 const& transf : i->second_) {
-				undergrowth_combiner->AddModel(model, mat, transf);
+		for (UndergrowthCell& cell : undergrowth_cells) {
+			if (!cell.building) {
+				continue;
 			}
+			cell.combiner = new UrhoExtras::ModelCombiner(context_);
+			cell.combiner->SetUploadSliceSize(world->getUndergrowthUploadSliceSize());
+			// Separate instances never share vertices
+			cell.combiner->SetWeldingEnabled(false);
+			cell.combiner->SetPackedNormals(world->areUndergrowthNormalsPacked());
+			cell.combiner->SetMeshOptimizationEnabled(world->isMeshOptimizationUsed());
+			cell.combiner->SetCache(world->getUndergrowthModelCache());
+			for (UndergrowthLodLevel const& lod_level : world->getUndergrowthLodLevels()) {
+				cell.combiner->AddLodLevel(lod_level.distance, lod_level.tris_ratio);
+			}
+			cell.submit_group = cell.places.Begin();
+			cell.submit_instance = 0;
 		}
-
-		return false;
+		undergrowth_submit_cell = 0;
 	}
 
 	if (undergrowth_state == UGSTATE_COMBINING) {
-		if (undergrowth_combiner->Ready()) {
-			Urho3D::Model* model = undergrowth_combiner->GetModel();
+		if (!submitUndergrowthToCombiners()) {
+			return false;
+		}
+
+		bool all_ready = true;
+		for (UndergrowthCell& cell : undergrowth_cells) {
+			if (cell.combiner.Null()) {
+				continue;
+			}
+			if (!world->hasUndergrowthTimeLeft() || !cell.combiner->Ready()) {
+				all_ready = false;
+				continue;
+			}
+			Urho3D::Model* model = cell.combiner->GetModel();
 			if (model) {
-				Urho3D::StaticModel* smodel = undergrowth_node->CreateComponent<Urho3D::StaticModel>();
+				Urho3D::StaticModel* smodel = cell.node->CreateComponent<Urho3D::StaticModel>();
 				smodel->SetModel(model);
 				smodel->SetOccludee(true);
-				for (unsigned geom_i = 0; geom_i < undergrowth_combiner->GetModel()->GetNumGeometries(); ++ geom_i) {
-					smodel->SetMaterial(geom_i, undergrowth_combiner->GetMaterial(geom_i));
+				for (unsigned geom_i = 0; geom_i < model->GetNumGeometries(); ++ geom_i) {
+					smodel->SetMaterial(geom_i, cell.combiner->GetMaterial(geom_i));
 				}
 				smodel->SetCastShadows(false);
 				smodel->SetDrawDistance(world->getUndergrowthDrawDistance());
 			}
-			undergrowth_combiner = NULL;
-			undergrowth_places.Clear();
-			undergrowth_state = UGSTATE_READY;
+			cell.combiner = NULL;
+		}
+		if (all_ready) {
+			finishUndergrowthCells();
 			return true;
 		}
 		return false;
@@ -381,6 +562,15 @@ bool Chunk::createUndergrowth()
 	return false;
 }
 
+void Chunk::rebuildUndergrowthCell(Urho3D::Vector2 const& local_pos)
+{
+	if (undergrowth_cells.Empty()) {
+		return;
+	}
+	undergrowth_cells[getUndergrowthCell(local_pos)].dirty = true;
+	undergrowth_cells_dirty = true;
+}
+
 bool Chunk::destroyUndergrowth()
 {
 	URHO3D_PROFILE(ChunkDestroyUndergrowth);
@@ -394,24 +584,40 @@ bool Chunk::destroyUndergrowth()
 		undergrowth_placer_wi = NULL;
 	}
 	undergrowth_corners.Clear();
-	undergrowth_combiner = NULL;
 	undergrowth_places.Clear();
+	undergrowth_cells.Clear();
+	undergrowth_cells_dirty = false;
+	undergrowth_partial_rebuild = false;
 	if (undergrowth_node) {
 		undergrowth_node->Remove();
 		undergrowth_node = NULL;
 	}
+	removeOldUndergrowth();
 	undergrowth_state = UGSTATE_NOT_INITIALIZED;
 	return true;
 }
 
 bool Chunk::storeTaskResultsToLodCache()
 {
-	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
-
 	// Before constructing the Model, make sure material is loaded.
 	Urho3D::SharedPtr<Urho3D::Material> mat;
-	// First the easiest case, where existing material can be used.
-	if (!task_data->calculate_ttype_image) {
+	// Far away Chunks use the simple material of their dominant terraintype
+	if (task_data->dominant_ttype_only) {
+		assert(task_data->used_ttypes.Size() == 1);
+		mat = world->getSingleLayerTerrainMaterial(task_data->used_ttypes[0]);
+		if (mat.Null()) {
+			return false;
+		}
+	}
+	// In texture array mode, all Chunks share the same material
+	else if (task_data->texture_array_mode) {
+		mat = world->getTextureArrayTerrainMaterial();
+		if (mat.Null()) {
+			return false;
+		}
+	}
+	// Then the easiest case, where existing material can be used.
+	else if (!task_data->calculate_ttype_image) {
 		assert(task_mat.NotNull());
 		mat = task_mat;
 	}
@@ -426,43 +632,34 @@ bool Chunk::storeTaskResultsToLodCache()
 	}
 	// Most complex case. Material with multiple terraintypes
 	else {
-		// First make sure all textures are loaded
-		Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Texture2D> > texs;
-		for (unsigned i = 0; i < task_data->used_ttypes.Size(); ++ i) {
-			uint8_t ttype = task_data->used_ttypes[i];
-			Urho3D::String const& tex_name = world->getTerrainTextureName(ttype);
-			Urho3D::SharedPtr<Urho3D::Texture2D> tex(resources->GetExistingResource<Urho3D::Texture2D>(tex_name));
-			if (tex.Null()) {
-				// Texture was not loaded, so start loading it.
-				resources->BackgroundLoadResource<Urho3D::Texture2D>(tex_name);
-			} else {
-				texs.Push(tex);
-			}
-		}
-		// If some textures are missing, then give up for now
-		if (texs.Size() != task_data->used_ttypes.Size()) {
+		// Chunks with the same terraintypes share Technique, terrain
+		// textures and parameters. Only the weight texture differs.
+		Urho3D::Material* base_mat = world->getMultiLayerTerrainMaterial(task_data->used_ttypes);
+		if (!base_mat) {
 			return false;
 		}
-		// All textures are ready. Construct new material.
-		Urho3D::SharedPtr<Urho3D::Texture2D> blend_tex;
-		mat = new Urho3D::Material(context_);
-		if (texs.Size() == 4) {
-			Urho3D::Technique* tech = resources->GetResource<Urho3D::Technique>("Techniques/TerrainBlend4.xml");
-			mat->SetTechnique(0, tech);
-		} else {
-			Urho3D::Technique* tech = resources->GetResource<Urho3D::Technique>("Techniques/TerrainBlend3.xml");
-			mat->SetTechnique(0, tech);
-		}
-		mat->SetShaderParameter("DetailTiling", Urho3D::Variant(Urho3D::Vector2::ONE * world->getTerrainTextureRepeats()));
-		mat->SetShaderParameter("WeightMapWidth", Urho3D::Variant(world->getChunkWidth() + 1));
-		blend_tex = new Urho3D::Texture2D(context_);
-		blend_tex->SetAddressMode(Urho3D::COORD_U, Urho3D::ADDRESS_CLAMP);
-		blend_tex->SetAddressMode(Urho3D::COORD_V, Urho3D::ADDRESS_CLAMP);
+		mat = base_mat->Clone();
 		assert(task_data->ttype_image.NotNull());
-		blend_tex->SetData(task_data->ttype_image);
-		mat->SetTexture(Urho3D::TU_DIFFUSE, blend_tex);
-		for (unsigned layer = 0; layer < texs.Size(); ++ layer) {
-			mat->SetTexture((Urho3D::TextureUnit)(layer + 1), texs[layer]);
+		WeightMapAtlas* atlas = world->getWeightMapAtlas();
+		if (atlas) {
+			// Weight image is stored to a shared texture
+			assert(!weightmap_slot.isValid());
+			if (!atlas->store(weightmap_slot, task_data->ttype_image)) {
+				throw std::runtime_error("Unable to store weight image to atlas!");
+			}
+			mat->SetTexture(Urho3D::TU_DIFFUSE, atlas->getTexture(weightmap_slot));
+			// Terrain UVs start from one square in, instead of zero,
+			// so shift the offset back to keep them in the slot.
+			Urho3D::Vector2 uv_scale = atlas->getUvScale();
+			Urho3D::Vector2 uv_offset = atlas->getUvOffset(weightmap_slot) - uv_scale / world->getChunkWidth();
+			mat->SetShaderParameter("WeightMapOffset", Urho3D::Variant(uv_offset));
+			mat->SetShaderParameter("WeightMapScale", Urho3D::Variant(uv_scale));
+		} else {
+			Urho3D::SharedPtr<Urho3D::Texture2D> blend_tex(new Urho3D::Texture2D(context_));
+			blend_tex->SetAddressMode(Urho3D::COORD_U, Urho3D::ADDRESS_CLAMP);
+			blend_tex->SetAddressMode(Urho3D::COORD_V, Urho3D::ADDRESS_CLAMP);
+			blend_tex->SetData(task_data->ttype_image);
+			mat->SetTexture(Urho3D::TU_DIFFUSE, blend_tex);
 		}
 	}
 
@@ -549,7 +746,11 @@ bool Chunk::storeTaskResultsToLodCache()
 
 	// Store model and material to cache
 	lodcache[task_lod] = new_model;
-	matcache = mat;
+	if (task_data->dominant_ttype_only) {
+		matcache_far = mat;
+	} else {
+		matcache = mat;
+	}
 
 	// If cache grows too big, remove some elements from it.
 	unsigned const LODCACHE_MAX_SIZE = 2;
@@ -580,17 +781,218 @@ void Chunk::updateLowestHeight()
 	}
 }
 
+unsigned Chunk::calculateUndergrowthChecksum() const
+{
+	unsigned checksum = world->getUndergrowthChecksumBase();
+	checksum = Urho3D::SDBMHash(checksum, baseheight & 0xff);
+	checksum = Urho3D::SDBMHash(checksum, baseheight >> 8);
+	for (Corner const& corner : undergrowth_corners) {
+		checksum = Urho3D::SDBMHash(checksum, corner.height & 0xff);
+		checksum = Urho3D::SDBMHash(checksum, corner.height >> 8);
+		for (unsigned i = 0; i < corner.ttypes.size(); ++ i) {
+			checksum = Urho3D::SDBMHash(checksum, corner.ttypes.getKey(i));
+			checksum = Urho3D::SDBMHash(checksum, corner.ttypes.getValueByte(i));
+		}
+	}
+	return checksum;
+}
+
+void Chunk::applyUndergrowthTier()
+{
+	UndergrowthTier const& tier = world->getUndergrowthTierData(undergrowth_tier);
+	if (tier.density >= 1 && !tier.use_simplified_models) {
+		return;
+	}
+
+	UndergrowthPlacements thinned;
+	for (UndergrowthPlacements::ConstIterator i = undergrowth_places.Begin(); i != undergrowth_places.End(); ++ i) {
+		Urho3D::String model = i->first_.first_;
+		if (tier.use_simplified_models) {
+			model = world->getUndergrowthSimplifiedModel(model);
+		}
+		UndergrowthInstances* thinned_instances = NULL;
+		for (UndergrowthInstance const& instance : i->second_) {
+			if (tier.density >= 1 || instance.rank < tier.density) {
+				if (!thinned_instances) {
+					thinned_instances = &thinned[StrNStr(model, i->first_.second_)];
+				}
+				thinned_instances->Push(instance);
+			}
+		}
+	}
+	undergrowth_places = thinned;
+}
+
+unsigned Chunk::getUndergrowthCell(Urho3D::Vector2 const& local_pos) const
+{
+	unsigned const CELLS = world->getUndergrowthCellsPerSide();
+	float const CHUNK_WIDTH_F = world->getChunkWidthFloat();
+	int cell_x = Urho3D::Clamp<int>(Urho3D::FloorToInt((local_pos.x_ / CHUNK_WIDTH_F + 0.5) * CELLS), 0, CELLS - 1);
+	int cell_y = Urho3D::Clamp<int>(Urho3D::FloorToInt((local_pos.y_ / CHUNK_WIDTH_F + 0.5) * CELLS), 0, CELLS - 1);
+	return cell_x + cell_y * CELLS;
+}
+
+void Chunk::splitUndergrowthToCells()
+{
+	for (UndergrowthPlacements::ConstIterator i = undergrowth_places.Begin(); i != undergrowth_places.End(); ++ i) {
+		// Skip instances whose resources failed to load
+		if (world->isUndergrowthResourceFailed(i->first_.first_) || world->isUndergrowthResourceFailed(i->first_.second_)) {
+			continue;
+		}
+		for (UndergrowthInstance const& instance : i->second_) {
+			UndergrowthCell& cell = undergrowth_cells[getUndergrowthCell(Urho3D::Vector2(instance.pos.x_, instance.pos.z_))];
+			if (cell.building) {
+				cell.places[i->first_].Push(instance);
+			}
+		}
+	}
+	undergrowth_places.Clear();
+}
+
+bool Chunk::submitUndergrowthToCombiners()
+{
+	// Transforms are calculated in batches of this size, independent of slices
+	unsigned const TRANSFORM_BATCH_SIZE = 32;
+
+	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+	while (undergrowth_submit_cell < undergrowth_cells.Size()) {
+		UndergrowthCell& cell = undergrowth_cells[undergrowth_submit_cell];
+		if (cell.combiner.NotNull()) {
+			while (cell.submit_group != cell.places.End()) {
+				if (!world->hasUndergrowthTimeLeft()) {
+					return false;
+				}
+				Urho3D::Model* model = resources->GetResource<Urho3D::Model>(cell.submit_group->first_.first_);
+				Urho3D::Material* mat = world->getCombinedUndergrowthMaterial(cell.submit_group->first_.second_);
+				UndergrowthInstances const& instances = cell.submit_group->second_;
+				unsigned slice_size = Urho3D::Min(world->getUndergrowthSubmitSliceSize(), instances.Size() - cell.submit_instance);
+				UndergrowthInstance const* slice = instances.Buffer() + cell.submit_instance;
+				for (unsigned batch = 0; batch < slice_size; batch += TRANSFORM_BATCH_SIZE) {
+					unsigned batch_size = Urho3D::Min(TRANSFORM_BATCH_SIZE, slice_size - batch);
+					Urho3D::Matrix3x4 transfs[TRANSFORM_BATCH_SIZE];
+					getUndergrowthTransforms(transfs, slice + batch, batch_size);
+					for (unsigned i = 0; i < batch_size; ++ i) {
+						cell.combiner->AddModel(model, mat, transfs[i]);
+					}
+				}
+				cell.submit_instance += slice_size;
+				if (cell.submit_instance == instances.Size()) {
+					++ cell.submit_group;
+					cell.submit_instance = 0;
+				}
+			}
+		}
+		++ undergrowth_submit_cell;
+	}
+	return true;
+}
+
+void Chunk::finishUndergrowthCells()
+{
+	for (UndergrowthCell& cell : undergrowth_cells) {
+		if (cell.old_node) {
+			cell.old_node->Remove();
+			cell.old_node = NULL;
+		}
+		cell.places.Clear();
+		cell.building = false;
+	}
+	undergrowth_partial_rebuild = false;
+	removeOldUndergrowth();
+	undergrowth_state = UGSTATE_READY;
+}
+
+void Chunk::removeOldUndergrowth()
+{
+	if (undergrowth_old_node) {
+		undergrowth_old_node->Remove();
+		undergrowth_old_node = NULL;
+	}
+}
+
+unsigned const UNDERGROWTH_CACHE_FILE_VERSION = 4;
+
+bool readUndergrowthCacheFile(UndergrowthPlacements& result, Urho3D::Context* context, Urho3D::String const& path, unsigned checksum)
+{
+	if (!context->GetSubsystem<Urho3D::FileSystem>()->FileExists(path)) {
+		return false;
+	}
+	Urho3D::File file(context, path, Urho3D::FILE_READ);
+	if (!file.IsOpen()) {
+		return false;
+	}
+	// Cached placements might be from older version or from different ground
+	if (file.ReadUInt() != UNDERGROWTH_CACHE_FILE_VERSION || file.ReadUInt() != checksum) {
+		return false;
+	}
+	unsigned groups = file.ReadVLE();
+	for (unsigned group_i = 0; group_i < groups; ++ group_i) {
+		Urho3D::String model = file.ReadString();
+		Urho3D::String material = file.ReadString();
+		unsigned instances_size = file.ReadVLE();
+		// Protect against truncated files
+		if (instances_size * sizeof(UndergrowthInstance) > file.GetSize() - file.GetPosition()) {
+			result.Clear();
+			return false;
+		}
+		UndergrowthInstances& instances = result[StrNStr(model, material)];
+		instances.Resize(instances_size);
+		for (UndergrowthInstance& instance : instances) {
+			instance.pos = file.ReadVector3();
+			for (unsigned i = 0; i < 4; ++ i) {
+				instance.rot[i] = file.ReadShort();
+			}
+			instance.scale = file.ReadFloat();
+			instance.rank = file.ReadFloat();
+		}
+	}
+	return true;
+}
+
+void writeUndergrowthCacheFile(Urho3D::Context* context, Urho3D::String const& path, unsigned checksum, UndergrowthPlacements const& places)
+{
+	Urho3D::File file(context, path, Urho3D::FILE_WRITE);
+	if (!file.IsOpen()) {
+		return;
+	}
+	file.WriteUInt(UNDERGROWTH_CACHE_FILE_VERSION);
+	file.WriteUInt(checksum);
+	file.WriteVLE(places.Size());
+	for (UndergrowthPlacements::ConstIterator i = places.Begin(); i != places.End(); ++ i) {
+		file.WriteString(i->first_.first_);
+		file.WriteString(i->first_.second_);
+		file.WriteVLE(i->second_.Size());
+		for (UndergrowthInstance const& instance : i->second_) {
+			file.WriteVector3(instance.pos);
+			for (unsigned i = 0; i < 4; ++ i) {
+				file.WriteShort(instance.rot[i]);
+			}
+			file.WriteFloat(instance.scale);
+			file.WriteFloat(instance.rank);
+		}
+	}
+}
+
 void Chunk::undergrowthPlacer(Urho3D::WorkItem const* wi, unsigned thread_i)
 {
 	(void)thread_i;
 
 	Chunk* chunk = (Chunk*)wi->aux_;
+
+	// If placements have been stored to disk earlier, use them
+	if (!chunk->undergrowth_cache_file.Empty() && readUndergrowthCacheFile(chunk->undergrowth_places, chunk->context_, chunk->undergrowth_cache_file, chunk->undergrowth_checksum)) {
+		return;
+	}
+
 	UndergrowthModelsByTerraintype ugmodels = chunk->world->getUndergrowthModelsByTerraintype();
 
 	unsigned const CHUNK_WIDTH = chunk->world->getChunkWidth();
 	float const HEIGHTSTEP = chunk->world->getHeightstep();
 	float const SQUARE_WIDTH = chunk->world->getSquareWidth();
 	float const CHUNK_WIDTH_F_HALF = CHUNK_WIDTH * SQUARE_WIDTH / 2.0;
+	unsigned const CELLS = chunk->world->getUndergrowthCellsPerSide();
+	uint32_t const SEED = chunk->world->getUndergrowthSeed();
+	uint64_t const CHUNK_SEED = (uint64_t(uint32_t(chunk->pos.x_)) << 32) | uint32_t(chunk->pos.y_);
 
 	for (unsigned y = 0; y < CHUNK_WIDTH; ++ y) {
 		unsigned ofs_sw = (y + 1) * (CHUNK_WIDTH + 3) + 1;
@@ -605,36 +1007,42 @@ void Chunk::undergrowthPlacer(Urho3D::WorkItem const* wi, unsigned thread_i)
 				return;
 			}
 
-			// To generate similar results every time, use deterministic random
-// TODO: This does not work! Try something else!
-/*
-			UrhoExtras::Random rnd(ofs_sw);
-			rnd.seedMore(chunk->chunk->getPosition().x_);
-			rnd.seedMore(chunk->chunk->getPosition().y_);
-*/
-UrhoExtras::Random rnd(rand());
+			// If only some of the cells are rebuilt, skip squares that do
+			// not touch any of them. Square may span multiple cells, and
+			// instances are split to cells by their exact position later.
+			if (chunk->undergrowth_partial_rebuild) {
+				Urho3D::Vector2 sqr_sw(x * SQUARE_WIDTH - CHUNK_WIDTH_F_HALF, y * SQUARE_WIDTH - CHUNK_WIDTH_F_HALF);
+				Urho3D::Vector2 sqr_ne((x + 1) * SQUARE_WIDTH - CHUNK_WIDTH_F_HALF, (y + 1) * SQUARE_WIDTH - CHUNK_WIDTH_F_HALF);
+				unsigned cell_sw = chunk->getUndergrowthCell(sqr_sw);
+				unsigned cell_ne = chunk->getUndergrowthCell(sqr_ne);
+				bool building = false;
+				for (unsigned cell_y = cell_sw / CELLS; cell_y <= cell_ne / CELLS && !building; ++ cell_y) {
+					for (unsigned cell_x = cell_sw % CELLS; cell_x <= cell_ne % CELLS && !building; ++ cell_x) {
+						building = chunk->undergrowth_cells[cell_x + cell_y * CELLS].building;
+					}
+				}
+				if (!building) {
+					++ ofs_sw;
+					continue;
+				}
+			}
+
+			// To generate similar results every time, seed random
+			// from world seed, Chunk position and the square.
+			UrhoExtras::Random rnd(UrhoExtras::Procedural::md5Rng(SEED, CHUNK_SEED, y * CHUNK_WIDTH + x));
 
 			// Randomize rotation and position on square
 			float yaw_angle = 360 * rnd.randomFloat();
 			Urho3D::Vector2 sqr_pos(rnd.randomFloat(), rnd.randomFloat());
 
-			// Get average terraintypes in this square
-			BigWorld::TTypesByWeight const& ttypes_sw = chunk->undergrowth_corners[ofs_sw].ttypes;
-			BigWorld::TTypesByWeight const& ttypes_nw = chunk->undergrowth_corners[ofs_nw].ttypes;
-			BigWorld::TTypesByWeight const& ttypes_ne = chunk->undergrowth_corners[ofs_ne].ttypes;
-			BigWorld::TTypesByWeight const& ttypes_se = chunk->undergrowth_corners[ofs_se].ttypes;
-			BigWorld::TTypesByWeight ttypes = ttypes_sw.averageOfTwo(ttypes_se).averageOfTwo(ttypes_nw.averageOfTwo(ttypes_ne));
-
-			// Select one of the terrain types randomly
-			unsigned ttypes_total_weight = ttypes.getTotalWeight();
-			unsigned ttype_selection_weight = rnd.randomUnsigned() % ttypes_total_weight;
-			unsigned ttype_selection_idx = 0;
-			while (ttype_selection_weight >= ttypes.getValueByte(ttype_selection_idx)) {
-				ttype_selection_weight -= ttypes.getValueByte(ttype_selection_idx);
-				++ ttype_selection_idx;
-				assert(ttype_selection_idx < ttypes.size());
-			}
-			uint8_t ttype_selection = ttypes.getKey(ttype_selection_idx);
+			// Blend terraintypes of the corners of this square
+			// and select one of them randomly by their weights.
+			BigWorld::TTypesBlend ttypes;
+			ttypes.add(chunk->undergrowth_corners[ofs_sw].ttypes);
+			ttypes.add(chunk->undergrowth_corners[ofs_nw].ttypes);
+			ttypes.add(chunk->undergrowth_corners[ofs_ne].ttypes);
+			ttypes.add(chunk->undergrowth_corners[ofs_se].ttypes);
+			uint8_t ttype_selection = ttypes.select(rnd.randomUnsigned());
 
 			// Select one of the undergrowth models, based on terraintypes
 			UndergrowthModelsByTerraintype::ConstIterator ugs_find = ugmodels.Find(ttype_selection);
@@ -643,6 +1051,14 @@ UrhoExtras::Random rnd(rand());
 				UndergrowthModels const& ttype_ugs = ugs_find->second_;
 				UndergrowthModel const& ttype_ug = ttype_ugs[rnd.randomUnsigned() % ttype_ugs.Size()];
 
+				// Skip some of the squares, if terraintype has lower density
+				float density = chunk->world->getUndergrowthDensity(ttype_selection);
+				float rank = rnd.randomFloat();
+				if (density <= 0 || (density < 1 && rank >= density)) {
+					++ ofs_sw;
+					continue;
+				}
+
 				// Decide position and rotation
 				float c_sw = (int(chunk->undergrowth_corners[ofs_sw].height) - int(chunk->baseheight)) * HEIGHTSTEP;
 				float c_nw = (int(chunk->undergrowth_corners[ofs_nw].height) - int(chunk->baseheight)) * HEIGHTSTEP;
@@ -666,20 +1082,20 @@ UrhoExtras::Random rnd(rand());
 				}
 				float ug_scale = rnd.randomFloatRange(ttype_ug.min_scale, ttype_ug.max_scale);
 
-				// Combine position, rotation and scaling
-				Urho3D::Matrix4 ug_transf_scale;
-				ug_transf_scale.SetScale(ug_scale);
-				Urho3D::Matrix4 ug_transf;
-				ug_transf.SetRotation(ug_rot.RotationMatrix());
-				ug_transf.SetTranslation(ug_pos);
-				ug_transf = ug_transf * ug_transf_scale;
-
-				chunk->undergrowth_places[StrNStr(ttype_ug.model, ttype_ug.material)].Push(ug_transf);
+				UndergrowthInstance instance;
+				instance.pos = ug_pos;
+				instance.setRotation(ug_rot);
+				instance.scale = ug_scale;
+				instance.rank = Urho3D::Min(rank / density, 1.0f);
+				chunk->undergrowth_places[StrNStr(ttype_ug.model, ttype_ug.material)].Push(instance);
 			}
 			++ ofs_sw;
 		}
 	}
 
+	if (!chunk->undergrowth_cache_file.Empty()) {
+		writeUndergrowthCacheFile(chunk->context_, chunk->undergrowth_cache_file, chunk->undergrowth_checksum, chunk->undergrowth_places);
+	}
 }
 
 }
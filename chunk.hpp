@@ -2,6 +2,7 @@
 #define BIGWORLD_CHUNK_HPP
 
 #include "types.hpp"
+#include "weightmapatlas.hpp"
 
 #include "../urhoextras/modelcombiner.hpp"
 #include "../urhoextras/triangle.hpp"
@@ -80,6 +81,10 @@ public:
 	bool createUndergrowth();
 	bool destroyUndergrowth();
 
+	// Marks undergrowth cell at given position to be rebuilt.
+	// ChunkWorld will then call createUndergrowth() for it.
+	void rebuildUndergrowthCell(Urho3D::Vector2 const& local_pos);
+
 private:
 
 	// Undergrowth states
@@ -92,6 +97,22 @@ private:
 
 	typedef Urho3D::HashMap<uint8_t, Urho3D::SharedPtr<Urho3D::Model> > LodCache;
 
+	// Undergrowth is divided to grid of cells, each having its own batch
+	struct UndergrowthCell
+	{
+		Urho3D::Node* node;
+		// When cell is rebuilt, old Node is kept until new one is ready
+		Urho3D::Node* old_node;
+		Urho3D::SharedPtr<UrhoExtras::ModelCombiner> combiner;
+		UndergrowthPlacements places;
+		// Progress of submitting places to combiner
+		UndergrowthPlacements::ConstIterator submit_group;
+		unsigned submit_instance;
+		bool building;
+		bool dirty;
+	};
+	typedef Urho3D::Vector<UndergrowthCell> UndergrowthCells;
+
 	ChunkWorld* world;
 	Urho3D::IntVector2 pos;
 
@@ -105,6 +126,10 @@ private:
 	// cleared when data in corners change.
 	LodCache lodcache;
 	Urho3D::SharedPtr<Urho3D::Material> matcache;
+	// Material for LODs that are beyond material LOD level
+	Urho3D::SharedPtr<Urho3D::Material> matcache_far;
+	// If weight image of matcache is stored to atlas
+	WeightMapAtlas::Slot weightmap_slot;
 
 	// Scene Node, Model and LOD, if currently visible
 	Urho3D::Node* node;
@@ -120,15 +145,40 @@ private:
 	volatile unsigned char undergrowth_state;
 	BigWorld::Corners undergrowth_corners;
 	Urho3D::SharedPtr<Urho3D::WorkItem> undergrowth_placer_wi;
-	Urho3D::SharedPtr<UrhoExtras::ModelCombiner> undergrowth_combiner;
 	UndergrowthPlacements undergrowth_places;
 	Urho3D::Node* undergrowth_node;
+	UndergrowthCells undergrowth_cells;
+	bool undergrowth_cells_dirty;
+	// If only the cells that are marked as building are placed
+	bool undergrowth_partial_rebuild;
+	unsigned undergrowth_submit_cell;
+	// Distance tier of current undergrowth. When tier changes, the
+	// old undergrowth is kept visible until the new one is ready.
+	uint8_t undergrowth_tier;
+	Urho3D::Node* undergrowth_old_node;
+	// Checksum of everything that affects placing of undergrowth.
+	// Cached placements are only used if this matches.
+	unsigned undergrowth_checksum;
+	// If placements are cached to disk, this is the file
+	Urho3D::String undergrowth_cache_file;
 
 	// Return true if all task results were used succesfully.
 	bool storeTaskResultsToLodCache();
 
 	void updateLowestHeight();
 
+	unsigned calculateUndergrowthChecksum() const;
+
+	// Thins placements and changes Models based on undergrowth tier
+	void applyUndergrowthTier();
+
+	unsigned getUndergrowthCell(Urho3D::Vector2 const& local_pos) const;
+	void splitUndergrowthToCells();
+	// Returns true when everything is submitted to combiners
+	bool submitUndergrowthToCombiners();
+	void finishUndergrowthCells();
+	void removeOldUndergrowth();
+
 	static void undergrowthPlacer(Urho3D::WorkItem const* wi, unsigned thread_i);
 };
 
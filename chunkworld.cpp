@@ -8,7 +8,11 @@
 #include <Urho3D/Graphics/Technique.h>
 #include <Urho3D/Graphics/Skybox.h>
 #include <Urho3D/Graphics/Texture2D.h>
+#include <Urho3D/Graphics/Texture2DArray.h>
+#include <Urho3D/IO/FileSystem.h>
+#include <Urho3D/Resource/Image.h>
 #include <Urho3D/Resource/ResourceCache.h>
+#include <Urho3D/Resource/ResourceEvents.h>
 
 #include <Urho3D/Core/CoreEvents.h>
 #include <Urho3D/Engine/Application.h>
@@ -64,11 +68,25 @@ heightstep(heightstep),
 terrain_texture_repeats(terrain_texture_repeats),
 undergrowth_radius_chunks(undergrowth_radius_chunks),
 undergrowth_draw_distance(undergrowth_draw_distance),
+ugseed(0),
+ugmodels_checksum(0),
+ug_instancing(false),
+ug_packed_normals(false),
+ug_cells_per_side(1),
+ug_budget_usec(0),
+ug_upload_slice_size(0),
+ug_submit_slice_size(32),
 headless(headless),
+material_lod_level(255),
+mesh_optimization(false),
+multilayer_mats_cache_hits(0),
+multilayer_mats_cache_misses(0),
+texarray_used(false),
 water_refl(false),
 water_baseheight(0),
 water_height(0),
 water_node(NULL),
+ugcache_max_chunks(0),
 origin(0, 0),
 origin_height(0),
 viewarea_recalculation_required(false)
@@ -95,14 +113,29 @@ viewarea_recalculation_required(false)
 	boxObject->SetMaterial(cache->GetResource<Material>("Materials/Stone.xml"));
 	boxObject->SetCastShadows(true);
 
+	// Closest undergrowth tier
+	UndergrowthTier ug_tier;
+	ug_tier.min_distance_chunks = 0;
+	ug_tier.density = 1;
+	ug_tier.use_simplified_models = false;
+	ug_tiers.Push(ug_tier);
+
 	if (!headless) {
 		SubscribeToEvent(Urho3D::E_BEGINFRAME, URHO3D_HANDLER(ChunkWorld, handleBeginFrame));
 	}
+	SubscribeToEvent(Urho3D::E_RESOURCEBACKGROUNDLOADED, URHO3D_HANDLER(ChunkWorld, handleResourceBackgroundLoaded));
 }
 
 void ChunkWorld::addTerrainTexture(Urho3D::String const& name)
 {
 	texs_names.Push(name);
+	// Start loading immediately. In texture array mode
+	// the images are copied to layers of a single texture.
+	if (texarray_used) {
+		texs.Push(requestResource(Urho3D::Image::GetTypeStatic(), name, texs_loading));
+	} else {
+		texs.Push(requestResource(Urho3D::Texture2D::GetTypeStatic(), name, texs_loading));
+	}
 }
 
 void ChunkWorld::addUndergrowthModel(unsigned terraintype, Urho3D::String const& model, Urho3D::String const& material, bool follow_ground_angle, float min_scale, float max_scale)
@@ -114,6 +147,205 @@ void ChunkWorld::addUndergrowthModel(unsigned terraintype, Urho3D::String const&
 	ugmodel.min_scale = min_scale;
 	ugmodel.max_scale = max_scale;
 	ugmodels[terraintype].Push(ugmodel);
+
+	requestUndergrowthResource(Urho3D::Model::GetTypeStatic(), model);
+	requestUndergrowthResource(Urho3D::Material::GetTypeStatic(), material);
+
+	// Cached placements become invalid when models change
+	ugmodels_checksum = Urho3D::SDBMHash(ugmodels_checksum, terraintype);
+	ugmodels_checksum = Urho3D::SDBMHash(ugmodels_checksum, follow_ground_angle);
+	ugmodels_checksum = ugmodels_checksum * 31 + Urho3D::StringHash(model).Value();
+	ugmodels_checksum = ugmodels_checksum * 31 + Urho3D::StringHash(material).Value();
+	ugmodels_checksum = ugmodels_checksum * 31 + Urho3D::FloatToRawIntBits(min_scale);
+	ugmodels_checksum = ugmodels_checksum * 31 + Urho3D::FloatToRawIntBits(max_scale);
+}
+
+void ChunkWorld::setUndergrowthDensity(unsigned terraintype, float density)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Undergrowth density must be set before adding Chunks!");
+	}
+
+	ug_densities[terraintype] = density;
+
+	// Cached placements become invalid when density changes
+	ugmodels_checksum = Urho3D::SDBMHash(ugmodels_checksum, terraintype);
+	ugmodels_checksum = ugmodels_checksum * 31 + Urho3D::FloatToRawIntBits(density);
+}
+
+float ChunkWorld::getUndergrowthDensity(unsigned terraintype) const
+{
+	Urho3D::HashMap<unsigned, float>::ConstIterator ug_densities_find = ug_densities.Find(terraintype);
+	if (ug_densities_find == ug_densities.End()) {
+		return 1;
+	}
+	return ug_densities_find->second_;
+}
+
+void ChunkWorld::addUndergrowthTier(unsigned min_distance_chunks, float density, bool use_simplified_models)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Undergrowth tiers must be added before adding Chunks!");
+	}
+	if (min_distance_chunks == 0) {
+		throw std::runtime_error("Closest undergrowth tier always has full density!");
+	}
+	if (ug_tiers.Size() >= 255) {
+		throw std::runtime_error("Too many undergrowth tiers!");
+	}
+
+	UndergrowthTier ug_tier;
+	ug_tier.min_distance_chunks = min_distance_chunks;
+	ug_tier.density = density;
+	ug_tier.use_simplified_models = use_simplified_models;
+
+	// Keep tiers sorted by distance
+	unsigned insert_pos = ug_tiers.Size();
+	while (ug_tiers[insert_pos - 1].min_distance_chunks > min_distance_chunks) {
+		-- insert_pos;
+	}
+	if (ug_tiers[insert_pos - 1].min_distance_chunks == min_distance_chunks) {
+		throw std::runtime_error("Undergrowth tier with the same distance already exists!");
+	}
+	ug_tiers.Insert(insert_pos, ug_tier);
+}
+
+void ChunkWorld::setUndergrowthSimplifiedModel(Urho3D::String const& model, Urho3D::String const& simplified_model)
+{
+	ug_simplified_models[model] = simplified_model;
+
+	requestUndergrowthResource(Urho3D::Model::GetTypeStatic(), simplified_model);
+}
+
+void ChunkWorld::setUndergrowthSeed(uint32_t seed)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Undergrowth seed must be set before adding Chunks!");
+	}
+
+	ugseed = seed;
+}
+
+void ChunkWorld::setUndergrowthInstancing(bool enabled)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Undergrowth instancing must be set before adding Chunks!");
+	}
+
+	ug_instancing = enabled;
+}
+
+void ChunkWorld::setUndergrowthPackedNormals(bool enabled)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Packed undergrowth normals must be set before adding Chunks!");
+	}
+
+	ug_packed_normals = enabled;
+}
+
+Urho3D::Material* ChunkWorld::getCombinedUndergrowthMaterial(Urho3D::String const& name)
+{
+	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+	Urho3D::Material* mat = resources->GetResource<Urho3D::Material>(name);
+	if (!ug_packed_normals || !mat) {
+		return mat;
+	}
+
+	Urho3D::StringHash name_hash(name);
+	Urho3D::HashMap<Urho3D::StringHash, Urho3D::SharedPtr<Urho3D::Material> >::Iterator mats_find = ug_packed_normals_mats.Find(name_hash);
+	if (mats_find != ug_packed_normals_mats.End()) {
+		return mats_find->second_;
+	}
+
+	Urho3D::SharedPtr<Urho3D::Material> packed_mat = mat->Clone();
+	packed_mat->SetVertexShaderDefines((mat->GetVertexShaderDefines() + " PACKEDNORMAL").Trimmed());
+	ug_packed_normals_mats[name_hash] = packed_mat;
+	return packed_mat;
+}
+
+void ChunkWorld::setUndergrowthCellsPerSide(unsigned cells)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Undergrowth cells must be set before adding Chunks!");
+	}
+	if (cells == 0 || cells > chunk_width) {
+		throw std::runtime_error("Invalid number of undergrowth cells!");
+	}
+
+	ug_cells_per_side = cells;
+}
+
+void ChunkWorld::addUndergrowthLodLevel(float distance, float tris_ratio)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Undergrowth LOD levels must be added before adding Chunks!");
+	}
+	if (ug_lod_levels.Size() >= 3) {
+		throw std::runtime_error("Too many undergrowth LOD levels!");
+	}
+	if (!ug_lod_levels.Empty() && distance <= ug_lod_levels.Back().distance) {
+		throw std::runtime_error("Undergrowth LOD levels must be added in increasing distance!");
+	}
+	if (tris_ratio <= 0 || tris_ratio >= 1) {
+		throw std::runtime_error("Ratio of triangles in undergrowth LOD level must be between zero and one!");
+	}
+
+	UndergrowthLodLevel lod_level;
+	lod_level.distance = distance;
+	lod_level.tris_ratio = tris_ratio;
+	ug_lod_levels.Push(lod_level);
+}
+
+void ChunkWorld::setUndergrowthFrameBudget(float msec, unsigned upload_slice_bytes, unsigned submit_slice_models)
+{
+	ug_budget_usec = msec * 1000;
+	ug_upload_slice_size = msec > 0 ? upload_slice_bytes : 0;
+	ug_submit_slice_size = Urho3D::Max(submit_slice_models, 1u);
+}
+
+bool ChunkWorld::hasUndergrowthTimeLeft() const
+{
+	return ug_budget_usec == 0 || ug_frame_timer.GetUSec(false) < ug_budget_usec;
+}
+
+void ChunkWorld::rebuildUndergrowth(Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos)
+{
+	if (!chunks_having_undergrowth.Contains(chunk_pos)) {
+		return;
+	}
+	Chunk* chunk = getChunk(chunk_pos);
+	if (chunk) {
+		chunk->rebuildUndergrowthCell(pos);
+		chunks_missing_undergrowth.Insert(chunk_pos);
+	}
+}
+
+void ChunkWorld::setUpUndergrowthCache(unsigned max_chunks, Urho3D::String const& directory)
+{
+	ugcache_max_chunks = max_chunks;
+	ugcache.Clear();
+
+	ugcache_dir = directory;
+	if (!ugcache_dir.Empty()) {
+		ugcache_dir = Urho3D::AddTrailingSlash(ugcache_dir);
+		if (!GetSubsystem<Urho3D::FileSystem>()->CreateDir(ugcache_dir)) {
+			throw std::runtime_error("Unable to create directory for undergrowth cache!");
+		}
+	}
+}
+
+void ChunkWorld::setUpUndergrowthModelCache(unsigned max_memory)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Undergrowth model cache must be set up before adding Chunks!");
+	}
+
+	if (max_memory) {
+		ug_model_cache = new UrhoExtras::ModelCombinerCache(max_memory);
+	} else {
+		ug_model_cache = NULL;
+	}
 }
 
 Camera* ChunkWorld::setUpCamera(Urho3D::IntVector2 const& chunk_pos, unsigned baseheight, Urho3D::Vector3 const& pos, float yaw, float pitch, float roll, unsigned viewdistance_in_chunks)
@@ -181,6 +413,120 @@ void ChunkWorld::setUpWaterReflection(unsigned baseheight, float height, Urho3D:
 	updateWaterReflection();
 }
 
+void ChunkWorld::setUpTerrainTextureArray(Urho3D::String const& technique)
+{
+	if (texarray_used) {
+		throw std::runtime_error("Terrain texture array can be set up only once!");
+	}
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Terrain texture array must be set up before adding Chunks!");
+	}
+	if (!texs_names.Empty()) {
+		throw std::runtime_error("Terrain texture array must be set up before adding terrain textures!");
+	}
+
+	texarray_used = true;
+	texarray_technique = technique;
+}
+
+void ChunkWorld::setUpWeightMapAtlas(unsigned page_size)
+{
+	if (weightmap_atlas.NotNull()) {
+		throw std::runtime_error("Weight map atlas can be set up only once!");
+	}
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Weight map atlas must be set up before adding Chunks!");
+	}
+
+	weightmap_atlas = new WeightMapAtlas(context_, page_size, chunk_width + 1);
+}
+
+void ChunkWorld::setMaterialLodLevel(uint8_t lod)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Material LOD level must be set before adding Chunks!");
+	}
+
+	material_lod_level = lod;
+}
+
+void ChunkWorld::setMeshOptimization(bool enabled)
+{
+	if (!chunks.Empty()) {
+		throw std::runtime_error("Mesh optimization must be set before adding Chunks!");
+	}
+
+	mesh_optimization = enabled;
+}
+
+uint8_t ChunkWorld::getUndergrowthTier(Urho3D::IntVector2 const& chunk_pos) const
+{
+	float distance = (chunk_pos - origin).Length();
+	uint8_t tier = 0;
+	while (tier + 1u < ug_tiers.Size() && ug_tiers[tier + 1].min_distance_chunks <= distance) {
+		++ tier;
+	}
+	return tier;
+}
+
+Urho3D::String ChunkWorld::getUndergrowthSimplifiedModel(Urho3D::String const& model) const
+{
+	Urho3D::HashMap<Urho3D::String, Urho3D::String>::ConstIterator ug_simplified_models_find = ug_simplified_models.Find(model);
+	if (ug_simplified_models_find == ug_simplified_models.End() || isUndergrowthResourceFailed(ug_simplified_models_find->second_)) {
+		return model;
+	}
+	return ug_simplified_models_find->second_;
+}
+
+bool ChunkWorld::isUndergrowthResourceFailed(Urho3D::String const& name) const
+{
+	if (ug_resources_failed.Empty()) {
+		return false;
+	}
+	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+	return ug_resources_failed.Contains(Urho3D::StringHash(resources->SanitateResourceName(name)));
+}
+
+bool ChunkWorld::getCachedUndergrowthPlacements(UndergrowthPlacements& result, Urho3D::IntVector2 const& pos, unsigned checksum) const
+{
+	UndergrowthCache::ConstIterator ugcache_find = ugcache.Find(pos);
+	if (ugcache_find == ugcache.End() || ugcache_find->second_.checksum != checksum) {
+		return false;
+	}
+	result = ugcache_find->second_.places;
+	return true;
+}
+
+void ChunkWorld::storeUndergrowthPlacementsToCache(Urho3D::IntVector2 const& pos, unsigned checksum, UndergrowthPlacements const& places)
+{
+	if (ugcache_max_chunks == 0) {
+		return;
+	}
+
+	UndergrowthCacheEntry& entry = ugcache[pos];
+	entry.checksum = checksum;
+	entry.places = places;
+
+	// If cache grows too big, remove Chunk that is furthest away
+	while (ugcache.Size() > ugcache_max_chunks) {
+		UndergrowthCache::Iterator furthest = ugcache.Begin();
+		for (UndergrowthCache::Iterator i = ugcache.Begin(); i != ugcache.End(); ++ i) {
+			if ((i->first_ - origin).Length() > (furthest->first_ - origin).Length()) {
+				furthest = i;
+			}
+		}
+		ugcache.Erase(furthest);
+	}
+}
+
+Urho3D::String ChunkWorld::getUndergrowthCacheFile(Urho3D::IntVector2 const& pos) const
+{
+	if (ugcache_dir.Empty()) {
+		return Urho3D::String::EMPTY;
+	}
+	return ugcache_dir + "undergrowth_" + Urho3D::String(pos.x_) + "_" + Urho3D::String(pos.y_) + ".bin";
+}
+
 float ChunkWorld::getHeightFloat(Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos, unsigned baseheight) const
 {
 	Chunks::ConstIterator chunk_find = chunks.Find(chunk_pos);
@@ -337,6 +683,127 @@ void ChunkWorld::removeChunk(Urho3D::IntVector2 const& chunk_pos)
 	va_being_built.Clear();
 }
 
+void ChunkWorld::querySquares(UrhoExtras::HeightfieldSquares& result, Urho3D::BoundingBox const& bb) const
+{
+	float const CHUNK_WIDTH_F = getChunkWidthFloat();
+
+	// Lowest height of box in heightsteps. Everything below terrain is
+	// solid, so only squares that are completely below box can be skipped.
+	int min_h = Urho3D::FloorToInt(bb.min_.y_ / heightstep) + int(origin_height);
+
+	// Range of Chunks, relative to origin
+	int chunk_min_x = Urho3D::FloorToInt(bb.min_.x_ / CHUNK_WIDTH_F + 0.5f);
+	int chunk_min_y = Urho3D::FloorToInt(bb.min_.z_ / CHUNK_WIDTH_F + 0.5f);
+	int chunk_max_x = Urho3D::FloorToInt(bb.max_.x_ / CHUNK_WIDTH_F + 0.5f);
+	int chunk_max_y = Urho3D::FloorToInt(bb.max_.z_ / CHUNK_WIDTH_F + 0.5f);
+
+	for (int chunk_y = chunk_min_y; chunk_y <= chunk_max_y; ++ chunk_y) {
+		for (int chunk_x = chunk_min_x; chunk_x <= chunk_max_x; ++ chunk_x) {
+			Urho3D::IntVector2 chunk_pos = origin + Urho3D::IntVector2(chunk_x, chunk_y);
+			Chunks::ConstIterator chunk_find = chunks.Find(chunk_pos);
+			if (chunk_find == chunks.End()) {
+				continue;
+			}
+			Chunk const* chunk = chunk_find->second_;
+			// Chunks are not skipped by their lowest height. Terrain is solid
+			// below, so a Chunk that is completely above the box still collides
+			// with it. Only highest height could reject a Chunk, but it is not
+			// stored, so squares are rejected one by one instead.
+
+			// Neighbors are needed for the last row and column of squares
+			Chunks::ConstIterator chunk_n_find = chunks.Find(chunk_pos + Urho3D::IntVector2(0, 1));
+			Chunks::ConstIterator chunk_ne_find = chunks.Find(chunk_pos + Urho3D::IntVector2(1, 1));
+			Chunks::ConstIterator chunk_e_find = chunks.Find(chunk_pos + Urho3D::IntVector2(1, 0));
+			Chunk const* chunk_n = chunk_n_find != chunks.End() ? chunk_n_find->second_.Get() : NULL;
+			Chunk const* chunk_ne = chunk_ne_find != chunks.End() ? chunk_ne_find->second_.Get() : NULL;
+			Chunk const* chunk_e = chunk_e_find != chunks.End() ? chunk_e_find->second_.Get() : NULL;
+
+			// South west corner of Chunk
+			Urho3D::Vector2 chunk_sw((chunk_x - 0.5f) * CHUNK_WIDTH_F, (chunk_y - 0.5f) * CHUNK_WIDTH_F);
+
+			// Range of squares in this Chunk
+			float sqr_ofs = CHUNK_WIDTH_F / 2 - chunk_x * CHUNK_WIDTH_F;
+			int sqr_min_x = Urho3D::Clamp<int>(Urho3D::FloorToInt((bb.min_.x_ + sqr_ofs) / sqr_width), 0, chunk_width - 1);
+			int sqr_max_x = Urho3D::Clamp<int>(Urho3D::FloorToInt((bb.max_.x_ + sqr_ofs) / sqr_width), 0, chunk_width - 1);
+			sqr_ofs = CHUNK_WIDTH_F / 2 - chunk_y * CHUNK_WIDTH_F;
+			int sqr_min_y = Urho3D::Clamp<int>(Urho3D::FloorToInt((bb.min_.z_ + sqr_ofs) / sqr_width), 0, chunk_width - 1);
+			int sqr_max_y = Urho3D::Clamp<int>(Urho3D::FloorToInt((bb.max_.z_ + sqr_ofs) / sqr_width), 0, chunk_width - 1);
+
+			for (int sqr_y = sqr_min_y; sqr_y <= sqr_max_y; ++ sqr_y) {
+				if (sqr_y == int(chunk_width) - 1 && !chunk_n) {
+					continue;
+				}
+				for (int sqr_x = sqr_min_x; sqr_x <= sqr_max_x; ++ sqr_x) {
+					if (sqr_x == int(chunk_width) - 1 && (!chunk_e || (sqr_y == int(chunk_width) - 1 && !chunk_ne))) {
+						continue;
+					}
+
+					// Skip squares that are completely below the box
+					int h_sw = chunk->getHeight(sqr_x, sqr_y, chunk_width, chunk_n, chunk_ne, chunk_e);
+					int h_nw = chunk->getHeight(sqr_x, sqr_y + 1, chunk_width, chunk_n, chunk_ne, chunk_e);
+					int h_ne = chunk->getHeight(sqr_x + 1, sqr_y + 1, chunk_width, chunk_n, chunk_ne, chunk_e);
+					int h_se = chunk->getHeight(sqr_x + 1, sqr_y, chunk_width, chunk_n, chunk_ne, chunk_e);
+					if (Urho3D::Max(Urho3D::Max(h_sw, h_nw), Urho3D::Max(h_ne, h_se)) < min_h) {
+						continue;
+					}
+
+					UrhoExtras::HeightfieldSquare sqr;
+					sqr.pos = chunk_sw + Urho3D::Vector2(sqr_x * sqr_width, sqr_y * sqr_width);
+					sqr.h_sw = (h_sw - int(origin_height)) * heightstep;
+					sqr.h_nw = (h_nw - int(origin_height)) * heightstep;
+					sqr.h_ne = (h_ne - int(origin_height)) * heightstep;
+					sqr.h_se = (h_se - int(origin_height)) * heightstep;
+					// Same diagonal as in Chunk::getTriangles()
+					sqr.sw_ne_diagonal = abs(h_sw - h_ne) < abs(h_se - h_nw);
+					result.Push(sqr);
+				}
+			}
+		}
+	}
+}
+
+void ChunkWorld::queryTriangles(UrhoExtras::Triangles& result, Urho3D::BoundingBox const& bb) const
+{
+	UrhoExtras::HeightfieldSquares sqrs;
+	querySquares(sqrs, bb);
+
+	result.Reserve(result.Size() + sqrs.Size() * 2);
+	for (UrhoExtras::HeightfieldSquare const& sqr : sqrs) {
+		UrhoExtras::Triangle tri1, tri2;
+		sqr.getTriangles(tri1, tri2, sqr_width);
+		result.Push(tri1);
+		result.Push(tri2);
+	}
+}
+
+void ChunkWorld::collide(UrhoExtras::Collisions& result, UrhoExtras::CollisionShape const& shape, float extra_radius) const
+{
+	Urho3D::BoundingBox bb = shape.getBoundingBox(extra_radius < 0 ? shape.getRadius() : extra_radius);
+
+	UrhoExtras::HeightfieldSquares sqrs;
+	querySquares(sqrs, bb);
+
+	for (UrhoExtras::HeightfieldSquare const& sqr : sqrs) {
+		shape.getCollisionsToHeightfieldSquare(result, sqr, sqr_width, extra_radius);
+	}
+}
+
+bool ChunkWorld::sweep(UrhoExtras::SweepHit& result, UrhoExtras::CollisionShape const& shape, Urho3D::Vector3 const& move) const
+{
+	UrhoExtras::HeightfieldSquares sqrs;
+	querySquares(sqrs, shape.getSweptBoundingBox(move));
+
+	bool found = false;
+	for (UrhoExtras::HeightfieldSquare const& sqr : sqrs) {
+		UrhoExtras::SweepHit hit;
+		if (shape.sweepHeightfieldSquare(hit, sqr, sqr_width, move) && (!found || hit.time < result.time)) {
+			result = hit;
+			found = true;
+		}
+	}
+	return found;
+}
+
 Chunk* ChunkWorld::getChunk(Urho3D::IntVector2 const& chunk_pos)
 {
 	Chunks::Iterator chunks_find = chunks.Find(chunk_pos);
@@ -422,11 +889,20 @@ Urho3D::Material* ChunkWorld::getSingleLayerTerrainMaterial(uint8_t ttype)
 
 	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
 
-	// Check if Texture is loaded. If not, make sure it is being loaded
-	Urho3D::String const& tex_name = texs_names[ttype];
-	Urho3D::SharedPtr<Urho3D::Texture2D> tex(resources->GetExistingResource<Urho3D::Texture2D>(tex_name));
-	if (tex.Null()) {
-		resources->BackgroundLoadResource<Urho3D::Texture2D>(tex_name);
+	// Texture loading was started when it was added, except in texture
+	// array mode, where it is started now. Wait until it is ready.
+	Urho3D::Texture2D* tex;
+	if (texarray_used) {
+		if (!single_layer_texs_requested.Contains(ttype)) {
+			single_layer_texs_requested.Insert(ttype);
+			single_layer_texs.Resize(texs_names.Size());
+			single_layer_texs[ttype] = requestResource(Urho3D::Texture2D::GetTypeStatic(), texs_names[ttype], single_layer_texs_loading);
+		}
+		tex = static_cast<Urho3D::Texture2D*>(single_layer_texs[ttype].Get());
+	} else {
+		tex = static_cast<Urho3D::Texture2D*>(texs[ttype].Get());
+	}
+	if (!tex) {
 		return NULL;
 	}
 
@@ -442,6 +918,180 @@ Urho3D::Material* ChunkWorld::getSingleLayerTerrainMaterial(uint8_t ttype)
 	return mat;
 }
 
+Urho3D::Material* ChunkWorld::getMultiLayerTerrainMaterial(TTypes const& ttypes)
+{
+	assert(ttypes.Size() >= 2 && ttypes.Size() <= 4);
+
+	// Terraintypes are sorted and unique, so packing
+	// them to bytes gives an unique key for the set.
+	unsigned key = 0;
+	for (unsigned i = 0; i < ttypes.Size(); ++ i) {
+		assert(i == 0 || ttypes[i - 1] < ttypes[i]);
+		key |= unsigned(ttypes[i]) << (i * 8);
+	}
+
+	MultiLayerMaterialsCache::Iterator mats_cache_find = multilayer_mats_cache.Find(key);
+	if (mats_cache_find != multilayer_mats_cache.End()) {
+		++ multilayer_mats_cache_hits;
+		return mats_cache_find->second_;
+	}
+
+	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+
+	// First make sure all textures are loaded. If
+	// some of them are missing, then give up for now.
+	for (unsigned i = 0; i < ttypes.Size(); ++ i) {
+		if (texs[ttypes[i]].Null()) {
+			return NULL;
+		}
+	}
+
+	// All textures are ready. Construct new material.
+	Urho3D::SharedPtr<Urho3D::Material> mat(new Urho3D::Material(context_));
+	if (ttypes.Size() == 4) {
+		Urho3D::Technique* tech = resources->GetResource<Urho3D::Technique>("Techniques/TerrainBlend4.xml");
+		mat->SetTechnique(0, tech);
+	} else {
+		Urho3D::Technique* tech = resources->GetResource<Urho3D::Technique>("Techniques/TerrainBlend3.xml");
+		mat->SetTechnique(0, tech);
+	}
+	mat->SetShaderParameter("DetailTiling", Urho3D::Variant(Urho3D::Vector2::ONE * terrain_texture_repeats));
+	mat->SetShaderParameter("WeightMapWidth", Urho3D::Variant(chunk_width + 1));
+	for (unsigned layer = 0; layer < ttypes.Size(); ++ layer) {
+		mat->SetTexture((Urho3D::TextureUnit)(layer + 1), static_cast<Urho3D::Texture2D*>(texs[ttypes[layer]].Get()));
+	}
+
+	// Store to cache
+	multilayer_mats_cache[key] = mat;
+	++ multilayer_mats_cache_misses;
+	URHO3D_LOGDEBUGF("Multilayer terrain material cache: %u hits, %u misses.", multilayer_mats_cache_hits, multilayer_mats_cache_misses);
+
+	return mat;
+}
+
+Urho3D::Material* ChunkWorld::getTextureArrayTerrainMaterial()
+{
+	assert(texarray_used);
+
+	if (texarray_mat.NotNull()) {
+		return texarray_mat;
+	}
+
+	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+
+	// Image loading was started when they were added. Wait until all are ready.
+	if (!texs_loading.Empty() || texs.Empty()) {
+		return NULL;
+	}
+
+	// Images that failed to load are replaced with plain grey
+	// ones, that have the same size as the other layers.
+	Urho3D::Image* ref_img = NULL;
+	for (unsigned layer = 0; layer < texs.Size() && !ref_img; ++ layer) {
+		ref_img = static_cast<Urho3D::Image*>(texs[layer].Get());
+	}
+	for (unsigned layer = 0; layer < texs.Size(); ++ layer) {
+		if (texs[layer].Null()) {
+			if (ref_img && ref_img->IsCompressed()) {
+				throw std::runtime_error("Unable to replace missing terrain texture, because other terrain textures are compressed!");
+			}
+			Urho3D::SharedPtr<Urho3D::Image> img(new Urho3D::Image(context_));
+			img->SetSize(ref_img ? ref_img->GetWidth() : 1, ref_img ? ref_img->GetHeight() : 1, ref_img ? ref_img->GetComponents() : 4);
+			img->Clear(Urho3D::Color::GRAY);
+			texs[layer] = img;
+		}
+	}
+
+	// Images are loaded, so copy them to layers of a texture array
+	Urho3D::SharedPtr<Urho3D::Texture2DArray> tex(new Urho3D::Texture2DArray(context_));
+	tex->SetLayers(texs.Size());
+	for (unsigned layer = 0; layer < texs.Size(); ++ layer) {
+		assert(texs[layer].NotNull());
+		if (!tex->SetData(layer, static_cast<Urho3D::Image*>(texs[layer].Get()))) {
+			throw std::runtime_error("Unable to set terrain texture array layer! All terrain textures must have same size and format.");
+		}
+	}
+
+	// Images are not needed anymore
+	for (unsigned i = 0; i < texs_names.Size(); ++ i) {
+		texs[i].Reset();
+		resources->ReleaseResource<Urho3D::Image>(texs_names[i]);
+	}
+
+	Urho3D::Technique* tech = resources->GetResource<Urho3D::Technique>(texarray_technique);
+	texarray_mat = new Urho3D::Material(context_);
+	texarray_mat->SetTechnique(0, tech);
+	texarray_mat->SetTexture(Urho3D::TU_DIFFUSE, tex);
+	texarray_mat->SetShaderParameter("DetailTiling", Urho3D::Variant(Urho3D::Vector2::ONE * terrain_texture_repeats));
+
+	return texarray_mat;
+}
+
+void ChunkWorld::handleResourceBackgroundLoaded(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData)
+{
+	(void)eventType;
+
+	Urho3D::String const& name = eventData[Urho3D::ResourceBackgroundLoaded::P_RESOURCENAME].GetString();
+	Urho3D::StringHash name_hash(name);
+	// In texture array mode, the same file may be loaded both as an
+	// Image and as a Texture2D, so the type tells which one this is.
+	Urho3D::Resource* res = static_cast<Urho3D::Resource*>(eventData[Urho3D::ResourceBackgroundLoaded::P_RESOURCE].GetPtr());
+	Urho3D::StringHash type = res ? res->GetType() : Urho3D::StringHash();
+	bool is_ug_resource = ug_resources_loading.Contains(name_hash);
+	bool is_tex = texs_loading.Contains(name_hash) && (!texarray_used || type == Urho3D::Image::GetTypeStatic());
+	bool is_single_layer_tex = single_layer_texs_loading.Contains(name_hash) && type == Urho3D::Texture2D::GetTypeStatic();
+	if (!is_ug_resource && !is_tex && !is_single_layer_tex) {
+		return;
+	}
+
+	// Failed resources are not waited for anymore. Undergrowth skips
+	// them, and terrain textures are replaced with plain grey ones.
+	bool success = eventData[Urho3D::ResourceBackgroundLoaded::P_SUCCESS].GetBool();
+	if (!success) {
+		res = NULL;
+		URHO3D_LOGERRORF("Unable to load resource \"%s\"!", name.CString());
+		// In texture array mode, the grey Image is
+		// created when the size of other layers is known.
+		if ((is_tex && !texarray_used) || is_single_layer_tex) {
+			Urho3D::SharedPtr<Urho3D::Image> img(new Urho3D::Image(context_));
+			img->SetSize(1, 1, 4);
+			img->Clear(Urho3D::Color::GRAY);
+			Urho3D::Texture2D* tex = new Urho3D::Texture2D(context_);
+			tex->SetData(img);
+			res = tex;
+		}
+	}
+
+	if (is_ug_resource) {
+		ug_resources_loading.Erase(name_hash);
+		if (success) {
+			ug_resources.Push(Urho3D::SharedPtr<Urho3D::Resource>(res));
+		} else {
+			ug_resources_failed.Insert(name_hash);
+		}
+	}
+
+	if (is_tex) {
+		texs_loading.Erase(name_hash);
+		Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+		for (unsigned i = 0; i < texs_names.Size(); ++ i) {
+			if (texs[i].Null() && Urho3D::StringHash(resources->SanitateResourceName(texs_names[i])) == name_hash) {
+				texs[i] = res;
+			}
+		}
+	}
+
+	if (is_single_layer_tex) {
+		single_layer_texs_loading.Erase(name_hash);
+		Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+		for (unsigned i = 0; i < single_layer_texs.Size(); ++ i) {
+			if (single_layer_texs_requested.Contains(i) && single_layer_texs[i].Null() && Urho3D::StringHash(resources->SanitateResourceName(texs_names[i])) == name_hash) {
+				single_layer_texs[i] = res;
+			}
+		}
+	}
+}
+
 void ChunkWorld::handleBeginFrame(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData)
 {
 	URHO3D_PROFILE(ManageChunkWorldBuilding);
@@ -449,6 +1099,8 @@ void ChunkWorld::handleBeginFrame(Urho3D::StringHash eventType, Urho3D::VariantM
 	(void)eventType;
 	(void)eventData;
 
+	ug_frame_timer.Reset();
+
 	// If there is new viewarea being applied, then check if everything is ready
 	if (!va_being_built.Empty()) {
 		URHO3D_PROFILE(CheckIfViewareaIsReady);
@@ -588,6 +1240,29 @@ void ChunkWorld::handleBeginFrame(Urho3D::StringHash eventType, Urho3D::VariantM
 	}
 }
 
+Urho3D::SharedPtr<Urho3D::Resource> ChunkWorld::requestResource(Urho3D::StringHash type, Urho3D::String const& name, Urho3D::HashSet<Urho3D::StringHash>& loading)
+{
+	Urho3D::ResourceCache* resources = GetSubsystem<Urho3D::ResourceCache>();
+	Urho3D::SharedPtr<Urho3D::Resource> res(resources->GetExistingResource(type, name));
+	if (res.Null()) {
+		resources->BackgroundLoadResource(type, name);
+		// Without threading, resource is loaded immediately
+		res = resources->GetExistingResource(type, name);
+		if (res.Null()) {
+			loading.Insert(Urho3D::StringHash(resources->SanitateResourceName(name)));
+		}
+	}
+	return res;
+}
+
+void ChunkWorld::requestUndergrowthResource(Urho3D::StringHash type, Urho3D::String const& name)
+{
+	Urho3D::SharedPtr<Urho3D::Resource> res = requestResource(type, name, ug_resources_loading);
+	if (res.NotNull()) {
+		ug_resources.Push(res);
+	}
+}
+
 void ChunkWorld::updateWaterReflection()
 {
 	// Update water node position
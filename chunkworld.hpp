@@ -4,12 +4,19 @@
 #include "chunk.hpp"
 #include "types.hpp"
 #include "camera.hpp"
+#include "weightmapatlas.hpp"
+#include "../urhoextras/collisions.hpp"
+#include "../urhoextras/modelcombinercache.hpp"
+#include "../urhoextras/triangle.hpp"
 
 #include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/HashSet.h>
 #include <Urho3D/Container/Ptr.h>
 #include <Urho3D/Container/Vector.h>
+#include <Urho3D/Core/Timer.h>
 #include <Urho3D/Graphics/Material.h>
 #include <Urho3D/Math/Vector2.h>
+#include <Urho3D/Resource/Resource.h>
 
 namespace BigWorld
 {
@@ -40,6 +47,81 @@ public:
 	void addUndergrowthModel(unsigned terraintype, Urho3D::String const& model, Urho3D::String const& material, bool follow_ground_angle, float min_scale = 1, float max_scale = 1);
 	inline UndergrowthModelsByTerraintype getUndergrowthModelsByTerraintype() const { return ugmodels; }
 
+	// Density of undergrowth at specific terraintype. Density of 0.5 places
+	// undergrowth only to half of the squares. Default is one.
+	void setUndergrowthDensity(unsigned terraintype, float density);
+	float getUndergrowthDensity(unsigned terraintype) const;
+
+	// Thins undergrowth and optionally uses simplified Models in Chunks that
+	// are at least "min_distance_chunks" away from origin. Thinned instances
+	// are always a subset of denser tiers, so nothing reshuffles when Chunk
+	// moves from one tier to another. Closest tier has full density.
+	void addUndergrowthTier(unsigned min_distance_chunks, float density, bool use_simplified_models = false);
+	void setUndergrowthSimplifiedModel(Urho3D::String const& model, Urho3D::String const& simplified_model);
+
+	// Divides undergrowth of every Chunk to a grid of cells. Each cell is its
+	// own batch with tight bounding box, so most of the undergrowth near the
+	// camera can be culled. This must be called before any Chunks are added.
+	void setUndergrowthCellsPerSide(unsigned cells);
+	inline unsigned getUndergrowthCellsPerSide() const { return ug_cells_per_side; }
+
+	// Adds simplified LOD level to combined undergrowth cells. Level is used
+	// from given distance, and it has about the given ratio of triangles of
+	// full detail. Up to three levels can be added, in increasing distance.
+	// Instanced undergrowth is not simplified. This must be called before
+	// any Chunks are added.
+	void addUndergrowthLodLevel(float distance, float tris_ratio);
+	inline UndergrowthLodLevels const& getUndergrowthLodLevels() const { return ug_lod_levels; }
+
+	// Rebuilds undergrowth of the cell at given position. Position is
+	// relative to the center of Chunk. Other cells are not touched.
+	void rebuildUndergrowth(Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos);
+
+	// Limits how much time is spent for combining undergrowth per frame.
+	// Models are submitted to combiners and uploaded to GPU in slices until
+	// the time runs out. Time is checked between slices, so smaller slices
+	// keep closer to the budget. Zero budget means no limit, which is default.
+	void setUndergrowthFrameBudget(float msec, unsigned upload_slice_bytes = 65536, unsigned submit_slice_models = 32);
+	bool hasUndergrowthTimeLeft() const;
+	inline unsigned getUndergrowthUploadSliceSize() const { return ug_upload_slice_size; }
+	inline unsigned getUndergrowthSubmitSliceSize() const { return ug_submit_slice_size; }
+
+	// Undergrowth is placed deterministically using this seed together
+	// with Chunk position, so the same world always gets the same
+	// undergrowth. This must be called before any Chunks are added.
+	void setUndergrowthSeed(uint32_t seed);
+	inline uint32_t getUndergrowthSeed() const { return ugseed; }
+
+	// Placements of undergrowth are cached, so Chunks that re-enter the
+	// undergrowth radius do not need to place them again. Size is the
+	// maximum number of Chunks in memory. Zero disables the cache. If
+	// directory is given, placements are also cached to files there.
+	void setUpUndergrowthCache(unsigned max_chunks, Urho3D::String const& directory = Urho3D::String::EMPTY);
+
+	// Combined undergrowth Models are cached, so identical cells, for
+	// example when re-entering an area, do not need to be combined
+	// again. Limit is in bytes of vertex and index data. Zero disables
+	// the cache. This must be called before any Chunks are added.
+	void setUpUndergrowthModelCache(unsigned max_memory);
+	inline UrhoExtras::ModelCombinerCache* getUndergrowthModelCache() const { return ug_model_cache; }
+
+	// Draws undergrowth using hardware instancing instead of combining
+	// it to unique Models. Every undergrowth Model is then shared and
+	// only transforms of visible instances are sent to GPU. This must
+	// be called before any Chunks are added.
+	void setUndergrowthInstancing(bool enabled);
+	inline bool isUndergrowthInstancingUsed() const { return ug_instancing; }
+
+	// Stores normals and tangents of combined undergrowth as bytes, which
+	// almost halves the memory of typical vertices. Materials of combined
+	// undergrowth are then cloned with PACKEDNORMAL vertex shader define,
+	// which makes shaders unpack them. This must be called before any
+	// Chunks are added.
+	void setUndergrowthPackedNormals(bool enabled);
+	inline bool areUndergrowthNormalsPacked() const { return ug_packed_normals; }
+	// Returns Material that combined undergrowth should use
+	Urho3D::Material* getCombinedUndergrowthMaterial(Urho3D::String const& name);
+
 	inline Urho3D::Scene* getScene() const { return scene; }
 
 	// This can be called only once.
@@ -47,6 +129,36 @@ public:
 
 	void setUpWaterReflection(unsigned baseheight, float height, Urho3D::Material* water_material, float water_plane_width, unsigned water_viewmask = 0x80000000);
 
+	// Makes all Chunks to use one shared Material, where all terrain textures are
+	// stored to a single Texture2DArray. Terraintype indices and weights are stored
+	// to vertices, so more than four terraintypes can be used in a single Chunk. All
+	// terrain textures must have the same size and format. The Technique gets array
+	// at diffuse unit and indices/weights as BLENDINDICES/BLENDWEIGHTS 0 and 1.
+	// This must be called before any Chunks are added.
+	void setUpTerrainTextureArray(Urho3D::String const& technique = "Techniques/TerrainBlendArray.xml");
+	inline bool isTerrainTextureArrayUsed() const { return texarray_used; }
+
+	// Makes Chunks to store their terraintype weight images to big shared
+	// textures. Blended terrain Techniques then get the position of the
+	// weight image using shader parameters WeightMapOffset and WeightMapScale.
+	// This must be called before any Chunks are added.
+	void setUpWeightMapAtlas(unsigned page_size = 1024);
+	inline WeightMapAtlas* getWeightMapAtlas() const { return weightmap_atlas; }
+
+	// Chunks that are shown with this or less detailed LOD, will use
+	// single layer material of their dominant terraintype. No weight
+	// images are calculated for them. This must be called before any
+	// Chunks are added. By default, material LOD is not used.
+	void setMaterialLodLevel(uint8_t lod);
+	inline uint8_t getMaterialLodLevel() const { return material_lod_level; }
+
+	// Reorders triangles and vertices of terrain and combined undergrowth
+	// for better use of GPU vertex cache. This is done in worker threads,
+	// but makes building slower. This must be called before any Chunks
+	// are added. By default, meshes are not optimized.
+	void setMeshOptimization(bool enabled);
+	inline bool isMeshOptimizationUsed() const { return mesh_optimization; }
+
 	inline unsigned getChunkWidth() const { return chunk_width; }
 	inline float getChunkWidthFloat() const { return chunk_width * sqr_width; }
 	inline float getSquareWidth() const { return sqr_width; }
@@ -55,6 +167,13 @@ public:
 	inline float getUndergrowthDrawDistance() const { return undergrowth_draw_distance; }
 	inline Urho3D::String getTerrainTextureName(uint8_t ttype) const { return texs_names[ttype]; }
 
+	// Models and Materials of undergrowth are loaded in background when
+	// they are added. Chunks wait until this returns true. Resources that
+	// failed to load are marked as failed, and undergrowth using them is
+	// skipped. Terrain textures that fail are replaced with plain grey.
+	inline bool areUndergrowthResourcesLoaded() const { return ug_resources_loading.Empty(); }
+	bool isUndergrowthResourceFailed(Urho3D::String const& name) const;
+
 	inline bool isHeadless() const { return headless; }
 
 	float getHeightFloat(Urho3D::IntVector2 const& chunk_pos, Urho3D::Vector2 const& pos, unsigned baseheight) const;
@@ -62,6 +181,27 @@ public:
 	float getHeightFromCorners(float h_sw, float h_nw, float h_ne, float h_se, Urho3D::Vector2 const& sqr_pos) const;
 	Urho3D::Vector3 getNormalFromCorners(float h_sw, float h_nw, float h_ne, float h_se, Urho3D::Vector2 const& sqr_pos) const;
 
+	// Terrain queries below do not modify ChunkWorld, so they can be
+	// called from several threads, while Chunks are not being changed.
+
+	// Adds terrain squares that overlap with BoundingBox to "result". Box
+	// and squares are in Scene space. Terrain is solid below the squares,
+	// so squares are included also when the box is below them. Squares
+	// below the box are skipped, and so are squares whose Chunks are not
+	// loaded.
+	void querySquares(UrhoExtras::HeightfieldSquares& result, Urho3D::BoundingBox const& bb) const;
+	// Same, but adds two triangles of every square.
+	void queryTriangles(UrhoExtras::Triangles& result, Urho3D::BoundingBox const& bb) const;
+
+	// Adds collisions between shape and terrain to "result". Shape is in
+	// Scene space. Terrain is solid, so collisions always push the shape
+	// up from it. Extra radius works like in CollisionShape.
+	void collide(UrhoExtras::Collisions& result, UrhoExtras::CollisionShape const& shape, float extra_radius = -1) const;
+	// Moves shape along "move" and finds the first place where it touches
+	// terrain. Returns false if terrain is not touched. Shape and movement
+	// are in Scene space.
+	bool sweep(UrhoExtras::SweepHit& result, UrhoExtras::CollisionShape const& shape, Urho3D::Vector3 const& move) const;
+
 	inline Urho3D::IntVector2 getOrigin() const { return origin; }
 	inline unsigned getOriginHeight() const { return origin_height; }
 
@@ -77,13 +217,41 @@ public:
 
 	// This is used by Chunks. Returns NULL if Material is not yet ready.
 	Urho3D::Material* getSingleLayerTerrainMaterial(uint8_t ttype);
+	Urho3D::Material* getTextureArrayTerrainMaterial();
+
+	// Returns shared Material for multiple terraintypes, that must be sorted.
+	// The weight texture is not set, so Chunks should use clones of this.
+	// Returns NULL if Material is not yet ready.
+	Urho3D::Material* getMultiLayerTerrainMaterial(TTypes const& ttypes);
+	inline unsigned getMultiLayerMaterialCacheHits() const { return multilayer_mats_cache_hits; }
+	inline unsigned getMultiLayerMaterialCacheMisses() const { return multilayer_mats_cache_misses; }
+
+	// These are used by Chunks to get undergrowth tier.
+	uint8_t getUndergrowthTier(Urho3D::IntVector2 const& chunk_pos) const;
+	inline UndergrowthTier const& getUndergrowthTierData(uint8_t tier) const { return ug_tiers[tier]; }
+	Urho3D::String getUndergrowthSimplifiedModel(Urho3D::String const& model) const;
+
+	// These are used by Chunks for caching undergrowth placements.
+	// Checksum base covers the seed and undergrowth models.
+	inline unsigned getUndergrowthChecksumBase() const { return ugmodels_checksum * 31 + ugseed; }
+	bool getCachedUndergrowthPlacements(UndergrowthPlacements& result, Urho3D::IntVector2 const& pos, unsigned checksum) const;
+	void storeUndergrowthPlacementsToCache(Urho3D::IntVector2 const& pos, unsigned checksum, UndergrowthPlacements const& places);
+	Urho3D::String getUndergrowthCacheFile(Urho3D::IntVector2 const& pos) const;
 
 private:
 
 	typedef Urho3D::HashMap<uint8_t, Urho3D::SharedPtr<Urho3D::Material> > SingleLayerMaterialsCache;
+	typedef Urho3D::HashMap<unsigned, Urho3D::SharedPtr<Urho3D::Material> > MultiLayerMaterialsCache;
 	typedef Urho3D::HashMap<Urho3D::IntVector2, Urho3D::SharedPtr<Chunk> > Chunks;
 	typedef Urho3D::HashSet<Urho3D::IntVector2> IntVector2Set;
 
+	struct UndergrowthCacheEntry
+	{
+		unsigned checksum;
+		UndergrowthPlacements places;
+	};
+	typedef Urho3D::HashMap<Urho3D::IntVector2, UndergrowthCacheEntry> UndergrowthCache;
+
 	Urho3D::SharedPtr<Urho3D::Scene> scene;
 
 	// World options
@@ -96,9 +264,53 @@ private:
 	Urho3D::Vector<Urho3D::String> texs_names;
 	UndergrowthModelsByTerraintype ugmodels;
 
+	// Resources are requested once when they are added, and
+	// marked ready when ResourceCache has loaded them. Terrain
+	// textures are Images in texture array mode and NULL until
+	// they are loaded. Loading and failed sets contain sanitated names.
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Resource> > texs;
+	Urho3D::HashSet<Urho3D::StringHash> texs_loading;
+	// In texture array mode, single layer Materials need Texture2Ds
+	// of their own. These are requested when they are first needed.
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Resource> > single_layer_texs;
+	Urho3D::HashSet<uint8_t> single_layer_texs_requested;
+	Urho3D::HashSet<Urho3D::StringHash> single_layer_texs_loading;
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Resource> > ug_resources;
+	Urho3D::HashSet<Urho3D::StringHash> ug_resources_loading;
+	Urho3D::HashSet<Urho3D::StringHash> ug_resources_failed;
+
+	Urho3D::HashMap<unsigned, float> ug_densities;
+	UndergrowthTiers ug_tiers;
+	UndergrowthLodLevels ug_lod_levels;
+	Urho3D::HashMap<Urho3D::String, Urho3D::String> ug_simplified_models;
+	uint32_t ugseed;
+	unsigned ugmodels_checksum;
+	bool ug_instancing;
+	bool ug_packed_normals;
+	Urho3D::HashMap<Urho3D::StringHash, Urho3D::SharedPtr<Urho3D::Material> > ug_packed_normals_mats;
+	unsigned ug_cells_per_side;
+	unsigned ug_budget_usec;
+	unsigned ug_upload_slice_size;
+	unsigned ug_submit_slice_size;
+	mutable Urho3D::HiresTimer ug_frame_timer;
+
 	bool headless;
 
+	uint8_t material_lod_level;
+
+	bool mesh_optimization;
+
 	SingleLayerMaterialsCache mats_cache;
+	MultiLayerMaterialsCache multilayer_mats_cache;
+	unsigned multilayer_mats_cache_hits;
+	unsigned multilayer_mats_cache_misses;
+
+	// Texture array mode
+	bool texarray_used;
+	Urho3D::String texarray_technique;
+	Urho3D::SharedPtr<Urho3D::Material> texarray_mat;
+
+	Urho3D::SharedPtr<WeightMapAtlas> weightmap_atlas;
 
 	Urho3D::SharedPtr<Camera> camera;
 
@@ -116,6 +328,12 @@ private:
 	IntVector2Set chunks_missing_undergrowth;
 	IntVector2Set chunks_having_undergrowth;
 
+	// Undergrowth placements of recently visited Chunks
+	UndergrowthCache ugcache;
+	unsigned ugcache_max_chunks;
+	Urho3D::String ugcache_dir;
+	Urho3D::SharedPtr<UrhoExtras::ModelCombinerCache> ug_model_cache;
+
 	// View details
 	ViewArea va;
 	Urho3D::IntVector2 origin;
@@ -131,6 +349,12 @@ private:
 	unsigned va_being_built_view_distance_in_chunks;
 
 	void handleBeginFrame(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData);
+	void handleResourceBackgroundLoaded(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData);
+
+	// Returns resource if it is already loaded. Otherwise starts loading
+	// it in background and adds its name to the "loading" set.
+	Urho3D::SharedPtr<Urho3D::Resource> requestResource(Urho3D::StringHash type, Urho3D::String const& name, Urho3D::HashSet<Urho3D::StringHash>& loading);
+	void requestUndergrowthResource(Urho3D::StringHash type, Urho3D::String const& name);
 
 	void updateWaterReflection();
 
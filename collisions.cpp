@@ -4,35 +4,92 @@
 
 #include <Urho3D/Math/Plane.h>
 
+#ifdef URHO3D_SSE
+#include <xmmintrin.h>
+#endif
+
 namespace UrhoExtras
 {
 
-inline bool triangleHitsSphere(Urho3D::Vector3 const& pos, float radius, Triangle const& tri,
+// Margin that keeps rejection tests of batches conservative
+float const BATCH_REJECT_MARGIN = 0.001f;
+
+// When sweeping, shape is considered touching when it is this close
+float const SWEEP_TOLERANCE = 0.001f;
+unsigned const SWEEP_MAX_ITERATIONS = 32;
+
+void TriangleBatch::clear()
+{
+	groups.Clear();
+	tris.Clear();
+}
+
+void TriangleBatch::add(Triangle const& tri)
+{
+	unsigned lane = tris.Size() % 4;
+	if (lane == 0) {
+		// Unused lanes have empty bounding box, so they are always rejected
+		Group group;
+		for (unsigned i = 0; i < 4; ++ i) {
+			group.min_x[i] = group.min_y[i] = group.min_z[i] = Urho3D::M_INFINITY;
+			group.max_x[i] = group.max_y[i] = group.max_z[i] = -Urho3D::M_INFINITY;
+			group.nrm_x[i] = group.nrm_y[i] = group.nrm_z[i] = group.d[i] = 0;
+			group.bs_x[i] = group.bs_y[i] = group.bs_z[i] = group.bs_r[i] = 0;
+		}
+		groups.Push(group);
+	}
+	tris.Push(tri);
+
+	Group& group = groups.Back();
+	group.min_x[lane] = Urho3D::Min(tri.p1.x_, Urho3D::Min(tri.p2.x_, tri.p3.x_));
+	group.min_y[lane] = Urho3D::Min(tri.p1.y_, Urho3D::Min(tri.p2.y_, tri.p3.y_));
+	group.min_z[lane] = Urho3D::Min(tri.p1.z_, Urho3D::Min(tri.p2.z_, tri.p3.z_));
+	group.max_x[lane] = Urho3D::Max(tri.p1.x_, Urho3D::Max(tri.p2.x_, tri.p3.x_));
+	group.max_y[lane] = Urho3D::Max(tri.p1.y_, Urho3D::Max(tri.p2.y_, tri.p3.y_));
+	group.max_z[lane] = Urho3D::Max(tri.p1.z_, Urho3D::Max(tri.p2.z_, tri.p3.z_));
+
+	// Exactly the same plane and bounding sphere that collision tests
+	// use, so the tests can use these instead of calculating them again.
+	TriangleInfo info;
+	getTriangleInfo(info, tri);
+	group.nrm_x[lane] = info.plane.normal_.x_;
+	group.nrm_y[lane] = info.plane.normal_.y_;
+	group.nrm_z[lane] = info.plane.normal_.z_;
+	group.d[lane] = info.plane.d_;
+	group.bs_x[lane] = tri.p2.x_;
+	group.bs_y[lane] = tri.p2.y_;
+	group.bs_z[lane] = tri.p2.z_;
+	group.bs_r[lane] = info.bs_r;
+}
+
+void TriangleBatch::getGroupTriangleInfo(TriangleInfo& result, Group const& group, unsigned lane)
+{
+	result.plane.normal_ = Urho3D::Vector3(group.nrm_x[lane], group.nrm_y[lane], group.nrm_z[lane]);
+	result.plane.absNormal_ = result.plane.normal_.Abs();
+	result.plane.d_ = group.d[lane];
+	result.bs_r = group.bs_r[lane];
+}
+
+inline bool triangleHitsSphere(Urho3D::Vector3 const& pos, float radius, Triangle const& tri, TriangleInfo const& info,
                                Urho3D::Vector3& coll_pos, Urho3D::Vector3& coll_nrm, float& coll_depth)
 {
-	Urho3D::Plane plane = tri.getPlane();
+	Urho3D::Plane const& plane = info.plane;
 
 	Urho3D::Vector3 edge0(tri.p2 - tri.p1);
 	Urho3D::Vector3 edge1(tri.p3 - tri.p2);
 
-	// Before collision check, do bounding sphere check.
-	Urho3D::Vector3 const& tri_bs_pos2 = tri.p2;
-	float dst0 = edge0.Length();
-	float dst1 = edge1.Length();
-	float tri_bs_r2 = (dst0 > dst1) ? dst0 : dst1;
-	if ((pos - tri_bs_pos2).Length() > radius + tri_bs_r2) {
+	// Before collision check, do bounding sphere check. Its center is
+	// at the second corner, and radius is the longer of first edges.
+	if ((pos - tri.p2).Length() > radius + info.bs_r) {
 		return false;
 	}
 
 	// Do the collision check.
 	Urho3D::Vector3 edge2(tri.p1 - tri.p3);
-	// Form normal of plane. If result is zero, then do not test against
-	// plane. Only do edge and corner tests then.
-	Urho3D::Vector3 plane_nrm = edge0.CrossProduct(-edge2);
-	float plane_nrm_length = plane_nrm.Length();
-	if (plane_nrm_length > 0.0) {
+	// If triangle has practically no area, then its plane is zero. Do
+	// not test against plane then. Only do edge and corner tests.
+	if (plane.normal_ != Urho3D::Vector3::ZERO) {
 		// Check if center of sphere is above/below triangle
-		assert(plane_nrm.LengthSquared() > 0.0);
 		Urho3D::Vector3 pos_at_plane = plane.Project(pos);
 
 		// We can calculate collision normal and depth here.
@@ -51,7 +108,7 @@ inline bool triangleHitsSphere(Urho3D::Vector3 const& pos, float radius, Triangl
 				if (coll_nrm_length != 0) {
 					coll_nrm = -coll_nrm / coll_nrm_length;
 				} else {
-					coll_nrm = plane_nrm / plane_nrm_length;
+					coll_nrm = plane.normal_;
 				}
 				assert(coll_nrm.LengthSquared() != 0.0);
 				return true;
@@ -196,37 +253,56 @@ inline bool triangleHitsSphere(Urho3D::Vector3 const& pos, float radius, Triangl
 }
 
 
-inline void sphereToTriangle(Collisions& result,
-                             Urho3D::Vector3 const& pos, float radius,
-                             Triangle const& tri,
-                             float extra_radius, bool only_front_collisions)
+inline bool sphereHitsTriangle(Collision& result,
+                               Urho3D::Vector3 const& pos, float radius,
+                               Triangle const& tri, TriangleInfo const& info,
+                               float extra_radius, bool only_front_collisions)
 {
 	if (extra_radius < 0) {
 		extra_radius = radius;
 	}
 
 	Urho3D::Vector3 coll_pos;
-	Collision coll;
-	if (!triangleHitsSphere(pos, radius + extra_radius, tri, coll_pos, coll.normal, coll.depth)) {
-		return;
+	if (!triangleHitsSphere(pos, radius + extra_radius, tri, info, coll_pos, result.normal, result.depth)) {
+		return false;
 	}
-	assert(coll.normal.Length() > 0.99 && coll.normal.Length() < 1.01);
+	assert(result.normal.Length() > 0.99 && result.normal.Length() < 1.01);
 
 	// If facing wrong way
 	if (only_front_collisions) {
-		Urho3D::Plane plane = tri.getPlane();
-		if (plane.normal_.DotProduct(coll.normal) < 0) {
-			return;
+		if (info.plane.normal_.DotProduct(result.normal) < 0) {
+			return false;
 		}
 	}
 
-	coll.depth -= extra_radius;
-	result.Push(coll);
+	result.depth -= extra_radius;
+	return true;
+}
+
+inline void sphereToTriangle(Collisions& result,
+                             Urho3D::Vector3 const& pos, float radius,
+                             Triangle const& tri, TriangleInfo const& info,
+                             float extra_radius, bool only_front_collisions)
+{
+	Collision coll;
+	if (sphereHitsTriangle(coll, pos, radius, tri, info, extra_radius, only_front_collisions)) {
+		result.Push(coll);
+	}
+}
+
+// Keeps the first one of the deepest collisions
+inline void keepDeepest(Collision& deepest, bool& found, Collision const& coll)
+{
+	if (!found || coll.depth > deepest.depth) {
+		deepest = coll;
+		found = true;
+	}
 }
 
 inline void capsuleToTriangle(Collisions& result,
                               Urho3D::Vector3 const& pos0, Urho3D::Vector3 const& pos1, float radius,
-                              Triangle const& tri, float extra_radius, bool only_front_collisions)
+                              Triangle const& tri, TriangleInfo const& info,
+                              float extra_radius, bool only_front_collisions)
 {
 	if (extra_radius < 0) {
 		extra_radius = radius;
@@ -234,19 +310,21 @@ inline void capsuleToTriangle(Collisions& result,
 
 	Urho3D::Vector3 const diff = pos1 - pos0;
 
-	Urho3D::Plane plane = tri.getPlane();
+	Urho3D::Plane const& plane = info.plane;
 
 	// This is kind of hard shape, so go different kind of
-	// collision types through and pick all collisions to
-	// container. Finally deepest one of these is selected.
-	Collisions ccolls;
-	ccolls.Reserve(14);
-
-	// Test first capsule cap
-	sphereToTriangle(ccolls, pos0, radius, tri, extra_radius, only_front_collisions);
-
-	// Test second capsule cap
-	sphereToTriangle(ccolls, pos1, radius, tri, extra_radius, only_front_collisions);
+	// collision types through and keep the deepest one.
+	Collision deepest;
+	bool found = false;
+
+	// Test capsule caps
+	Collision cap_coll;
+	if (sphereHitsTriangle(cap_coll, pos0, radius, tri, info, extra_radius, only_front_collisions)) {
+		keepDeepest(deepest, found, cap_coll);
+	}
+	if (sphereHitsTriangle(cap_coll, pos1, radius, tri, info, extra_radius, only_front_collisions)) {
+		keepDeepest(deepest, found, cap_coll);
+	}
 
 	// Now check middle cylinder. Start from corners
 	for (unsigned corner_i = 0; corner_i < 3; ++ corner_i) {
@@ -276,7 +354,7 @@ inline void capsuleToTriangle(Collisions& result,
 			}
 			if (!only_front_collisions || plane.normal_.DotProduct(new_ccoll.normal) > 0) {
 				new_ccoll.normal /= new_ccoll_normal_len;
-				ccolls.Push(new_ccoll);
+				keepDeepest(deepest, found, new_ccoll);
 			}
 		}
 
@@ -315,7 +393,7 @@ inline void capsuleToTriangle(Collisions& result,
 					new_ccoll.depth = depth;
 					new_ccoll.normal = -x.Normalized();
 					if (!only_front_collisions || plane.normal_.DotProduct(new_ccoll.normal) > 0) {
-						ccolls.Push(new_ccoll);
+						keepDeepest(deepest, found, new_ccoll);
 					}
 				}
 			}
@@ -332,7 +410,7 @@ inline void capsuleToTriangle(Collisions& result,
 					new_ccoll.depth = depth;
 					new_ccoll.normal = -x.Normalized();
 					if (!only_front_collisions || plane.normal_.DotProduct(new_ccoll.normal) > 0) {
-						ccolls.Push(new_ccoll);
+						keepDeepest(deepest, found, new_ccoll);
 					}
 				}
 			}
@@ -357,7 +435,7 @@ inline void capsuleToTriangle(Collisions& result,
 			new_ccoll.depth = depth;
 			new_ccoll.normal = (point_at_centerline - point_at_edge).Normalized();
 			if (!only_front_collisions || plane.normal_.DotProduct(new_ccoll.normal) > 0) {
-				ccolls.Push(new_ccoll);
+				keepDeepest(deepest, found, new_ccoll);
 			}
 		}
 
@@ -366,20 +444,247 @@ inline void capsuleToTriangle(Collisions& result,
 
 	}
 
-	if (!ccolls.Empty()) {
-		// Search the deepest collision
-		float deepest_depth = ccolls[0].depth;
-		unsigned deepest = 0;
-		for (unsigned ccoll_id = 1; ccoll_id < ccolls.Size(); ++ ccoll_id) {
-			Collision const& ccoll = ccolls[ccoll_id];
-			if (ccoll.depth > deepest_depth) {
-				deepest_depth = ccoll.depth;
-				deepest = ccoll_id;
+	if (found) {
+		result.Push(deepest);
+	}
+}
+
+// Returns squared distance between nearest points of two line segments
+inline float nearestPointsOfSegments(Urho3D::Vector3& result1, Urho3D::Vector3& result2,
+                                     Urho3D::Vector3 const& begin1, Urho3D::Vector3 const& end1,
+                                     Urho3D::Vector3 const& begin2, Urho3D::Vector3 const& end2)
+{
+	Urho3D::Vector3 dir1 = end1 - begin1;
+	Urho3D::Vector3 dir2 = end2 - begin2;
+	Urho3D::Vector3 diff = begin1 - begin2;
+	float len1_sqr = dir1.LengthSquared();
+	float len2_sqr = dir2.LengthSquared();
+	float dp_d2_df = dir2.DotProduct(diff);
+
+	float m1, m2;
+	if (len1_sqr <= Urho3D::M_EPSILON) {
+		m1 = 0;
+		m2 = len2_sqr <= Urho3D::M_EPSILON ? 0 : Urho3D::Clamp(dp_d2_df / len2_sqr, 0.0f, 1.0f);
+	} else {
+		float dp_d1_df = dir1.DotProduct(diff);
+		if (len2_sqr <= Urho3D::M_EPSILON) {
+			m2 = 0;
+			m1 = Urho3D::Clamp(-dp_d1_df / len1_sqr, 0.0f, 1.0f);
+		} else {
+			float dp_d1_d2 = dir1.DotProduct(dir2);
+			float denom = len1_sqr * len2_sqr - dp_d1_d2 * dp_d1_d2;
+			// If segments are parallel, then any point is fine
+			m1 = denom != 0 ? Urho3D::Clamp((dp_d1_d2 * dp_d2_df - dp_d1_df * len2_sqr) / denom, 0.0f, 1.0f) : 0;
+			m2 = (dp_d1_d2 * m1 + dp_d2_df) / len2_sqr;
+			if (m2 < 0) {
+				m2 = 0;
+				m1 = Urho3D::Clamp(-dp_d1_df / len1_sqr, 0.0f, 1.0f);
+			} else if (m2 > 1) {
+				m2 = 1;
+				m1 = Urho3D::Clamp((dp_d1_d2 - dp_d1_df) / len1_sqr, 0.0f, 1.0f);
+			}
+		}
+	}
+
+	result1 = begin1 + dir1 * m1;
+	result2 = begin2 + dir2 * m2;
+	return (result1 - result2).LengthSquared();
+}
+
+// Checks if position is inside triangle when looking along its normal
+inline bool isAboveOrBelowTriangle(Urho3D::Vector3 const& pos, Urho3D::Vector3 const& nrm,
+                                   Urho3D::Vector3 const& p1, Urho3D::Vector3 const& p2, Urho3D::Vector3 const& p3)
+{
+	return nrm.DotProduct((p2 - p1).CrossProduct(pos - p1)) >= 0 &&
+	       nrm.DotProduct((p3 - p2).CrossProduct(pos - p2)) >= 0 &&
+	       nrm.DotProduct((p1 - p3).CrossProduct(pos - p3)) >= 0;
+}
+
+// Returns squared distance between nearest points of line segment and triangle
+inline float nearestPointsOfSegmentAndTriangle(Urho3D::Vector3& result_segment, Urho3D::Vector3& result_tri,
+                                               Urho3D::Vector3 const& begin, Urho3D::Vector3 const& end,
+                                               Urho3D::Vector3 const& p1, Urho3D::Vector3 const& p2, Urho3D::Vector3 const& p3)
+{
+	float nearest_dst_sqr = Urho3D::M_INFINITY;
+
+	// Segment ends above or below the area of triangle, and segment going
+	// through it. These are skipped if triangle has no area.
+	Urho3D::Vector3 nrm = (p2 - p1).CrossProduct(p3 - p1);
+	float nrm_len = nrm.Length();
+	if (nrm_len > Urho3D::M_EPSILON) {
+		nrm /= nrm_len;
+		float begin_dst = nrm.DotProduct(begin - p1);
+		float end_dst = nrm.DotProduct(end - p1);
+		if ((begin_dst < 0) != (end_dst < 0)) {
+			Urho3D::Vector3 cross = begin + (end - begin) * (begin_dst / (begin_dst - end_dst));
+			if (isAboveOrBelowTriangle(cross, nrm, p1, p2, p3)) {
+				result_segment = cross;
+				result_tri = cross;
+				return 0;
+			}
+		}
+		if (isAboveOrBelowTriangle(begin, nrm, p1, p2, p3)) {
+			nearest_dst_sqr = begin_dst * begin_dst;
+			result_segment = begin;
+			result_tri = begin - nrm * begin_dst;
+		}
+		if (end_dst * end_dst < nearest_dst_sqr && isAboveOrBelowTriangle(end, nrm, p1, p2, p3)) {
+			nearest_dst_sqr = end_dst * end_dst;
+			result_segment = end;
+			result_tri = end - nrm * end_dst;
+		}
+	}
+
+	// Edges and corners
+	for (unsigned edge_i = 0; edge_i < 3; ++ edge_i) {
+		Urho3D::Vector3 const& edge_begin = edge_i == 0 ? p1 : (edge_i == 1 ? p2 : p3);
+		Urho3D::Vector3 const& edge_end = edge_i == 0 ? p2 : (edge_i == 1 ? p3 : p1);
+		Urho3D::Vector3 at_segment, at_edge;
+		float dst_sqr = nearestPointsOfSegments(at_segment, at_edge, begin, end, edge_begin, edge_end);
+		if (dst_sqr < nearest_dst_sqr) {
+			nearest_dst_sqr = dst_sqr;
+			result_segment = at_segment;
+			result_tri = at_edge;
+		}
+	}
+
+	return nearest_dst_sqr;
+}
+
+// Sweeps segment with radius against triangle using conservative
+// advancement. Segment is moved by the distance to triangle, which
+// it can never overshoot, until it touches or has moved enough.
+inline bool sweepSegmentToTriangle(SweepHit& result,
+                                   Urho3D::Vector3 const& begin, Urho3D::Vector3 const& end, float radius,
+                                   Urho3D::Vector3 const& move,
+                                   Urho3D::Vector3 const& p1, Urho3D::Vector3 const& p2, Urho3D::Vector3 const& p3)
+{
+	float move_len = move.Length();
+	if (move_len < Urho3D::M_EPSILON) {
+		return false;
+	}
+
+	float time = 0;
+	for (unsigned iteration = 0; iteration < SWEEP_MAX_ITERATIONS; ++ iteration) {
+		Urho3D::Vector3 ofs = move * time;
+		Urho3D::Vector3 at_segment, at_tri;
+		float dst = Urho3D::Sqrt(nearestPointsOfSegmentAndTriangle(at_segment, at_tri, begin + ofs, end + ofs, p1, p2, p3));
+		float gap = dst - radius;
+
+		if (gap <= SWEEP_TOLERANCE) {
+			Urho3D::Vector3 nrm;
+			if (dst > Urho3D::M_EPSILON) {
+				nrm = (at_segment - at_tri) / dst;
+			} else {
+				nrm = -move / move_len;
+			}
+			// If touching already at the beginning, then only moving
+			// away is allowed. Distance between convex shapes grows
+			// all the way then, so triangle cannot be hit later.
+			if (iteration == 0 && nrm.DotProduct(move) >= 0) {
+				return false;
 			}
+			result.time = time;
+			result.normal = nrm;
+			return true;
 		}
 
-		result.Push(ccolls[deepest]);
+		// Distance between convex shapes is a convex function of time, so
+		// its tangent never goes above it. Advancing to where the tangent
+		// reaches the radius is safe, and converges fast also at shallow
+		// angles. If distance is not shrinking, it never will.
+		Urho3D::Vector3 nrm = (at_segment - at_tri) / dst;
+		float closing_speed = -nrm.DotProduct(move);
+		if (closing_speed <= Urho3D::M_EPSILON) {
+			return false;
+		}
+		float new_time = time + gap / closing_speed;
+		if (new_time > 1) {
+			return false;
+		}
+		time = new_time;
 	}
+
+	// Did not converge, but shape is still getting closer. Stop
+	// here, so that it cannot tunnel through the triangle.
+	Urho3D::Vector3 ofs = move * time;
+	Urho3D::Vector3 at_segment, at_tri;
+	float dst = Urho3D::Sqrt(nearestPointsOfSegmentAndTriangle(at_segment, at_tri, begin + ofs, end + ofs, p1, p2, p3));
+	result.time = time;
+	result.normal = dst > Urho3D::M_EPSILON ? (at_segment - at_tri) / dst : -move / move_len;
+	return true;
+}
+
+// Corners must be in such order, that normal points up
+inline bool segmentToHeightfieldTriangle(Collision& result,
+                                         Urho3D::Vector3 const& begin, Urho3D::Vector3 const& end, float radius, float reach,
+                                         Urho3D::Vector3 const& p1, Urho3D::Vector3 const& p2, Urho3D::Vector3 const& p3)
+{
+	Urho3D::Vector3 nrm = (p2 - p1).CrossProduct(p3 - p1).Normalized();
+	assert(nrm.y_ > 0);
+
+	// If even the lowest end of segment is too high above the
+	// plane, then it is too far from the triangle too.
+	float begin_dst = nrm.DotProduct(begin - p1);
+	float end_dst = nrm.DotProduct(end - p1);
+	float lowest_dst = Urho3D::Min(begin_dst, end_dst);
+	if (lowest_dst >= reach) {
+		return false;
+	}
+
+	// Distance is signed when segment is above or below the triangle
+	// area, so parts that are below surface are pushed up too.
+	float nearest_dst = Urho3D::M_INFINITY;
+	Urho3D::Vector3 nearest_nrm;
+
+	if (isAboveOrBelowTriangle(begin, nrm, p1, p2, p3) && begin_dst < nearest_dst) {
+		nearest_dst = begin_dst;
+		nearest_nrm = nrm;
+	}
+	if (isAboveOrBelowTriangle(end, nrm, p1, p2, p3) && end_dst < nearest_dst) {
+		nearest_dst = end_dst;
+		nearest_nrm = nrm;
+	}
+	// If segment goes through the triangle
+	if ((begin_dst < 0) != (end_dst < 0)) {
+		Urho3D::Vector3 cross = begin + (end - begin) * (begin_dst / (begin_dst - end_dst));
+		if (isAboveOrBelowTriangle(cross, nrm, p1, p2, p3) && lowest_dst < nearest_dst) {
+			nearest_dst = lowest_dst;
+			nearest_nrm = nrm;
+		}
+	}
+
+	// Edges and corners. Points below the surface are
+	// handled by the triangles that they are below.
+	for (unsigned edge_i = 0; edge_i < 3; ++ edge_i) {
+		if (nearest_dst <= 0) {
+			break;
+		}
+		Urho3D::Vector3 const& edge_begin = edge_i == 0 ? p1 : (edge_i == 1 ? p2 : p3);
+		Urho3D::Vector3 const& edge_end = edge_i == 0 ? p2 : (edge_i == 1 ? p3 : p1);
+		Urho3D::Vector3 at_segment, at_edge;
+		float dst_sqr = nearestPointsOfSegments(at_segment, at_edge, begin, end, edge_begin, edge_end);
+		if (dst_sqr >= nearest_dst * nearest_dst) {
+			continue;
+		}
+		Urho3D::Vector3 diff = at_segment - at_edge;
+		if (diff.DotProduct(nrm) < 0) {
+			continue;
+		}
+		float dst = Urho3D::Sqrt(dst_sqr);
+		if (dst < nearest_dst) {
+			nearest_dst = dst;
+			nearest_nrm = dst > Urho3D::M_EPSILON ? diff / dst : nrm;
+		}
+	}
+
+	if (nearest_dst >= reach) {
+		return false;
+	}
+
+	result.normal = nearest_nrm;
+	result.depth = radius - nearest_dst;
+	return true;
 }
 
 Urho3D::Vector3 moveOutFromCollisions(Collisions& colls)
@@ -549,14 +854,169 @@ Urho3D::Vector3 moveOutFromCollisions(Collisions& colls)
 	return result;
 }
 
+void CollisionShape::getCollisionsToHeightfieldSquare(Collisions& result, HeightfieldSquare const& sqr, float sqr_width, float extra_radius) const
+{
+	float reach = radius + (extra_radius < 0 ? radius : extra_radius);
+
+	// Quick rejection if the lowest point of shape is too high
+	float max_h = Urho3D::Max(Urho3D::Max(sqr.h_sw, sqr.h_nw), Urho3D::Max(sqr.h_ne, sqr.h_se));
+	Urho3D::Vector3 const& end = type == CAPSULE ? pos2 : pos1;
+	if (Urho3D::Min(pos1.y_, end.y_) - reach > max_h) {
+		return;
+	}
+
+	Urho3D::Vector3 pos_sw(sqr.pos.x_, sqr.h_sw, sqr.pos.y_);
+	Urho3D::Vector3 pos_nw(sqr.pos.x_, sqr.h_nw, sqr.pos.y_ + sqr_width);
+	Urho3D::Vector3 pos_ne(sqr.pos.x_ + sqr_width, sqr.h_ne, sqr.pos.y_ + sqr_width);
+	Urho3D::Vector3 pos_se(sqr.pos.x_ + sqr_width, sqr.h_se, sqr.pos.y_);
+
+	Collision coll;
+	if (sqr.sw_ne_diagonal) {
+		if (segmentToHeightfieldTriangle(coll, pos1, end, radius, reach, pos_sw, pos_ne, pos_se)) {
+			result.Push(coll);
+		}
+		if (segmentToHeightfieldTriangle(coll, pos1, end, radius, reach, pos_sw, pos_nw, pos_ne)) {
+			result.Push(coll);
+		}
+	} else {
+		if (segmentToHeightfieldTriangle(coll, pos1, end, radius, reach, pos_sw, pos_nw, pos_se)) {
+			result.Push(coll);
+		}
+		if (segmentToHeightfieldTriangle(coll, pos1, end, radius, reach, pos_nw, pos_ne, pos_se)) {
+			result.Push(coll);
+		}
+	}
+}
+
+bool CollisionShape::sweepTriangle(SweepHit& result, Triangle const& tri, Urho3D::Vector3 const& move) const
+{
+	Urho3D::Vector3 const& end = type == CAPSULE ? pos2 : pos1;
+	return sweepSegmentToTriangle(result, pos1, end, radius, move, tri.p1, tri.p2, tri.p3);
+}
+
+bool CollisionShape::sweepHeightfieldSquare(SweepHit& result, HeightfieldSquare const& sqr, float sqr_width, Urho3D::Vector3 const& move) const
+{
+	// Quick rejection if the lowest point of shape stays too high
+	float max_h = Urho3D::Max(Urho3D::Max(sqr.h_sw, sqr.h_nw), Urho3D::Max(sqr.h_ne, sqr.h_se));
+	Urho3D::Vector3 const& end = type == CAPSULE ? pos2 : pos1;
+	if (Urho3D::Min(pos1.y_, end.y_) + Urho3D::Min(move.y_, 0.0f) - radius > max_h) {
+		return false;
+	}
+
+	Triangle tri1, tri2;
+	sqr.getTriangles(tri1, tri2, sqr_width);
+	SweepHit hit2;
+	bool hit1_found = sweepSegmentToTriangle(result, pos1, end, radius, move, tri1.p1, tri1.p2, tri1.p3);
+	bool hit2_found = sweepSegmentToTriangle(hit2, pos1, end, radius, move, tri2.p1, tri2.p2, tri2.p3);
+	if (hit2_found && (!hit1_found || hit2.time < result.time)) {
+		result = hit2;
+	}
+	return hit1_found || hit2_found;
+}
+
+void CollisionShape::getCollisionsToTriangles(Collisions& result, TriangleBatch const& tris, Urho3D::BoundingBox const& bb, float extra_radius, bool only_front_collisions) const
+{
+	float reach = radius + (extra_radius < 0 ? radius : extra_radius) + BATCH_REJECT_MARGIN;
+
+	for (unsigned group_i = 0; group_i < tris.groups.Size(); ++ group_i) {
+		unsigned possible = getPossibleCollisions(tris.groups[group_i], bb, reach);
+		for (unsigned lane = 0; possible; ++ lane, possible >>= 1) {
+			if (!(possible & 1)) {
+				continue;
+			}
+			Triangle const& tri = tris.tris[group_i * 4 + lane];
+			TriangleInfo info;
+			TriangleBatch::getGroupTriangleInfo(info, tris.groups[group_i], lane);
+			if (type == SPHERE) {
+				sphereToTriangle(result, pos1, radius, tri, info, extra_radius, only_front_collisions);
+			} else {
+				capsuleToTriangle(result, pos1, pos2, radius, tri, info, extra_radius, only_front_collisions);
+			}
+		}
+	}
+}
+
+unsigned CollisionShape::getPossibleCollisions(TriangleBatch::Group const& group, Urho3D::BoundingBox const& bb, float reach) const
+{
+#ifdef URHO3D_SSE
+	// Same test as in getCollisionsToTriangle()
+	__m128 outside = _mm_or_ps(
+		_mm_cmpgt_ps(_mm_loadu_ps(group.min_x), _mm_set1_ps(bb.max_.x_)),
+		_mm_cmplt_ps(_mm_loadu_ps(group.max_x), _mm_set1_ps(bb.min_.x_))
+	);
+	outside = _mm_or_ps(outside, _mm_cmpgt_ps(_mm_loadu_ps(group.min_y), _mm_set1_ps(bb.max_.y_)));
+	outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_loadu_ps(group.max_y), _mm_set1_ps(bb.min_.y_)));
+	outside = _mm_or_ps(outside, _mm_cmpgt_ps(_mm_loadu_ps(group.min_z), _mm_set1_ps(bb.max_.z_)));
+	outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_loadu_ps(group.max_z), _mm_set1_ps(bb.min_.z_)));
+
+	// Sphere must reach both the plane and the bounding sphere of triangle.
+	// Capsule has tests that do not follow exactly these, so to get same
+	// results, only bounding box is used with capsules.
+	if (type == SPHERE) {
+		__m128 reach4 = _mm_set1_ps(reach);
+		__m128 pos1_x = _mm_set1_ps(pos1.x_);
+		__m128 pos1_y = _mm_set1_ps(pos1.y_);
+		__m128 pos1_z = _mm_set1_ps(pos1.z_);
+		__m128 dst = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(group.nrm_x), pos1_x), _mm_mul_ps(_mm_loadu_ps(group.nrm_y), pos1_y)),
+			_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(group.nrm_z), pos1_z), _mm_loadu_ps(group.d))
+		);
+		__m128 dst_abs = _mm_max_ps(dst, _mm_sub_ps(_mm_setzero_ps(), dst));
+		outside = _mm_or_ps(outside, _mm_cmpgt_ps(dst_abs, reach4));
+
+		__m128 diff_x = _mm_sub_ps(pos1_x, _mm_loadu_ps(group.bs_x));
+		__m128 diff_y = _mm_sub_ps(pos1_y, _mm_loadu_ps(group.bs_y));
+		__m128 diff_z = _mm_sub_ps(pos1_z, _mm_loadu_ps(group.bs_z));
+		__m128 dst_sqr = _mm_add_ps(_mm_add_ps(_mm_mul_ps(diff_x, diff_x), _mm_mul_ps(diff_y, diff_y)), _mm_mul_ps(diff_z, diff_z));
+		__m128 max_dst = _mm_add_ps(reach4, _mm_loadu_ps(group.bs_r));
+		outside = _mm_or_ps(outside, _mm_cmpgt_ps(dst_sqr, _mm_mul_ps(max_dst, max_dst)));
+	}
+
+	return ~_mm_movemask_ps(outside) & 0xf;
+#else
+	unsigned result = 0;
+	for (unsigned lane = 0; lane < 4; ++ lane) {
+		// Same test as in getCollisionsToTriangle()
+		if (group.min_x[lane] > bb.max_.x_ || group.max_x[lane] < bb.min_.x_ ||
+		    group.min_y[lane] > bb.max_.y_ || group.max_y[lane] < bb.min_.y_ ||
+		    group.min_z[lane] > bb.max_.z_ || group.max_z[lane] < bb.min_.z_) {
+			continue;
+		}
+		if (type == SPHERE) {
+			Urho3D::Vector3 nrm(group.nrm_x[lane], group.nrm_y[lane], group.nrm_z[lane]);
+			if (Urho3D::Abs(nrm.DotProduct(pos1) + group.d[lane]) > reach) {
+				continue;
+			}
+			Urho3D::Vector3 bs_pos(group.bs_x[lane], group.bs_y[lane], group.bs_z[lane]);
+			float max_dst = reach + group.bs_r[lane];
+			if ((pos1 - bs_pos).LengthSquared() > max_dst * max_dst) {
+				continue;
+			}
+		}
+		result |= 1 << lane;
+	}
+	return result;
+#endif
+}
+
 void CollisionShape::getCollisionsToTriangle(Collisions& result, Triangle const& tri, Urho3D::BoundingBox const& bb, float extra_radius, bool only_front_collisions) const
 {
-// TODO: Use BoundingBox!
-(void)bb;
+	// Quick rejection of triangles that are outside of the bounding box
+	if (Urho3D::Min(tri.p1.x_, Urho3D::Min(tri.p2.x_, tri.p3.x_)) > bb.max_.x_ ||
+	    Urho3D::Max(tri.p1.x_, Urho3D::Max(tri.p2.x_, tri.p3.x_)) < bb.min_.x_ ||
+	    Urho3D::Min(tri.p1.y_, Urho3D::Min(tri.p2.y_, tri.p3.y_)) > bb.max_.y_ ||
+	    Urho3D::Max(tri.p1.y_, Urho3D::Max(tri.p2.y_, tri.p3.y_)) < bb.min_.y_ ||
+	    Urho3D::Min(tri.p1.z_, Urho3D::Min(tri.p2.z_, tri.p3.z_)) > bb.max_.z_ ||
+	    Urho3D::Max(tri.p1.z_, Urho3D::Max(tri.p2.z_, tri.p3.z_)) < bb.min_.z_) {
+		return;
+	}
+
+	TriangleInfo info;
+	getTriangleInfo(info, tri);
 	if (type == SPHERE) {
-		sphereToTriangle(result, pos1, radius, tri, extra_radius, only_front_collisions);
+		sphereToTriangle(result, pos1, radius, tri, info, extra_radius, only_front_collisions);
 	} else {
-		capsuleToTriangle(result, pos1, pos2, radius, tri, extra_radius, only_front_collisions);
+		capsuleToTriangle(result, pos1, pos2, radius, tri, info, extra_radius, only_front_collisions);
 	}
 }
 
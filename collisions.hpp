@@ -5,6 +5,7 @@
 
 #include <Urho3D/Container/Vector.h>
 #include <Urho3D/Math/BoundingBox.h>
+#include <Urho3D/Math/Vector2.h>
 #include <Urho3D/Math/Vector3.h>
 
 #include <cassert>
@@ -27,6 +28,92 @@ struct Collision
 };
 typedef Urho3D::PODVector<Collision> Collisions;
 
+// Result of sweeping a shape. Time is the fraction of movement
+// where shape touches something, and normal points away from it.
+struct SweepHit
+{
+	float time;
+	Urho3D::Vector3 normal;
+};
+
+// Square of a regular heightfield. Position is the X and Z of south west
+// corner, and north is towards positive Z. Square is split to two triangles
+// along one of its diagonals. Everything below the square is solid.
+struct HeightfieldSquare
+{
+	Urho3D::Vector2 pos;
+	float h_sw, h_nw, h_ne, h_se;
+	bool sw_ne_diagonal;
+
+	inline void getTriangles(Triangle& tri1, Triangle& tri2, float width) const
+	{
+		Urho3D::Vector3 pos_sw(pos.x_, h_sw, pos.y_);
+		Urho3D::Vector3 pos_nw(pos.x_, h_nw, pos.y_ + width);
+		Urho3D::Vector3 pos_ne(pos.x_ + width, h_ne, pos.y_ + width);
+		Urho3D::Vector3 pos_se(pos.x_ + width, h_se, pos.y_);
+		if (sw_ne_diagonal) {
+			tri1 = Triangle(pos_sw, pos_ne, pos_se);
+			tri2 = Triangle(pos_sw, pos_nw, pos_ne);
+		} else {
+			tri1 = Triangle(pos_sw, pos_nw, pos_se);
+			tri2 = Triangle(pos_nw, pos_ne, pos_se);
+		}
+	}
+};
+typedef Urho3D::PODVector<HeightfieldSquare> HeightfieldSquares;
+
+// Values of triangle that collision tests need. Plane is zero if triangle
+// has practically no area. Bounding sphere is centered at the second corner.
+struct TriangleInfo
+{
+	Urho3D::Plane plane;
+	float bs_r;
+};
+
+inline void getTriangleInfo(TriangleInfo& result, Triangle const& tri)
+{
+	if ((tri.p2 - tri.p1).CrossProduct(tri.p3 - tri.p1).Length() >= Urho3D::M_EPSILON) {
+		result.plane = tri.getPlane();
+	} else {
+		result.plane = Urho3D::Plane();
+	}
+	result.bs_r = Urho3D::Max((tri.p2 - tri.p1).Length(), (tri.p3 - tri.p2).Length());
+}
+
+// Triangles that are stored in groups of four as structure of arrays,
+// together with precomputed bounding boxes, planes and bounding spheres.
+// Shapes use these to reject four triangles at a time using SIMD.
+class TriangleBatch
+{
+
+public:
+
+	void clear();
+	void add(Triangle const& tri);
+
+	inline unsigned size() const { return tris.Size(); }
+	inline Triangle const& getTriangle(unsigned i) const { return tris[i]; }
+
+private:
+
+	friend class CollisionShape;
+
+	struct Group
+	{
+		float min_x[4], min_y[4], min_z[4];
+		float max_x[4], max_y[4], max_z[4];
+		// Plane and bounding sphere from TriangleInfo
+		float nrm_x[4], nrm_y[4], nrm_z[4], d[4];
+		float bs_x[4], bs_y[4], bs_z[4], bs_r[4];
+	};
+	typedef Urho3D::PODVector<Group> Groups;
+
+	static void getGroupTriangleInfo(TriangleInfo& result, Group const& group, unsigned lane);
+
+	Groups groups;
+	Triangles tris;
+};
+
 class CollisionShape
 {
 
@@ -76,6 +163,14 @@ public:
 		return bb;
 	}
 
+	// Bounding box of everything that shape touches while moving
+	inline Urho3D::BoundingBox getSweptBoundingBox(Urho3D::Vector3 const& move) const
+	{
+		Urho3D::BoundingBox bb = getBoundingBox();
+		bb.Merge(Urho3D::BoundingBox(bb.min_ + move, bb.max_ + move));
+		return bb;
+	}
+
 	inline void move(Urho3D::Vector3 const& v)
 	{
 		pos1 += v;
@@ -84,8 +179,27 @@ public:
 		}
 	}
 
+	// Bounding box must cover the shape grown by extra radius, or by radius
+	// if extra radius is negative. Triangles outside of it are skipped.
 	void getCollisionsToTriangle(Collisions& result, Triangle const& tri, Urho3D::BoundingBox const& bb, float extra_radius = -1, bool only_front_collisions = false) const;
 
+	// Collides with heightfield square. This is faster than colliding with
+	// its triangles, and since heightfield is solid below, collisions always
+	// push the shape up, even if it is mostly below the surface.
+	void getCollisionsToHeightfieldSquare(Collisions& result, HeightfieldSquare const& sqr, float sqr_width, float extra_radius = -1) const;
+
+	// Moves shape along "move" and finds when it first touches triangle
+	// or heightfield square. Returns false if it is not touched. If shape
+	// touches already at the beginning, then it is hit at time zero,
+	// unless it is moving away. Overlapping shapes should be moved out
+	// using static collision tests before sweeping.
+	bool sweepTriangle(SweepHit& result, Triangle const& tri, Urho3D::Vector3 const& move) const;
+	bool sweepHeightfieldSquare(SweepHit& result, HeightfieldSquare const& sqr, float sqr_width, Urho3D::Vector3 const& move) const;
+
+	// Same as calling getCollisionsToTriangle() for every triangle of batch,
+	// but most triangles get rejected four at a time.
+	void getCollisionsToTriangles(Collisions& result, TriangleBatch const& tris, Urho3D::BoundingBox const& bb, float extra_radius = -1, bool only_front_collisions = false) const;
+
 private:
 
 	Type type;
@@ -94,6 +208,9 @@ private:
 	float radius;
 
 	inline CollisionShape() : type(SPHERE) {}
+
+	// Returns bits of those triangles of group that might collide
+	unsigned getPossibleCollisions(TriangleBatch::Group const& group, Urho3D::BoundingBox const& bb, float reach) const;
 };
 
 // Calculates position delta to get object out of walls. Note,
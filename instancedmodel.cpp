@@ -0,0 +1,293 @@
+#include "instancedmodel.hpp"
+
+#include <Urho3D/Graphics/Batch.h>
+#include <Urho3D/Graphics/Geometry.h>
+#include <Urho3D/Graphics/Model.h>
+#include <Urho3D/Graphics/OctreeQuery.h>
+#include <Urho3D/Math/Frustum.h>
+#include <Urho3D/Math/Ray.h>
+#include <Urho3D/Math/Sphere.h>
+#include <Urho3D/Scene/Node.h>
+
+#ifdef URHO3D_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace UrhoExtras
+{
+
+InstancedModel::InstancedModel(Urho3D::Context* context) :
+Urho3D::StaticModel(context),
+visible_transfs_frame_number(0)
+{
+}
+
+InstancedModel::~InstancedModel()
+{
+}
+
+void InstancedModel::SetInstances(Urho3D::PODVector<Urho3D::Matrix3x4> const& transfs)
+{
+	assert(GetModel());
+
+	this->transfs = transfs;
+	visible_transfs.Clear();
+
+	Urho3D::BoundingBox const& model_bb = GetModel()->GetBoundingBox();
+	float model_radius = model_bb.HalfSize().Length();
+
+	unsigned padded_size = (transfs.Size() + 3) & ~3;
+	sphere_xs.Resize(padded_size);
+	sphere_ys.Resize(padded_size);
+	sphere_zs.Resize(padded_size);
+	sphere_rs.Resize(padded_size);
+
+	instances_bb.Clear();
+	for (unsigned i = 0; i < transfs.Size(); ++ i) {
+		Urho3D::Matrix3x4 const& transf = transfs[i];
+		Urho3D::Vector3 center = transf * model_bb.Center();
+		Urho3D::Vector3 scale = transf.Scale();
+		sphere_xs[i] = center.x_;
+		sphere_ys[i] = center.y_;
+		sphere_zs[i] = center.z_;
+		sphere_rs[i] = model_radius * Urho3D::Max(scale.x_, Urho3D::Max(scale.y_, scale.z_));
+		instances_bb.Merge(model_bb.Transformed(transf));
+	}
+	for (unsigned i = transfs.Size(); i < padded_size; ++ i) {
+		sphere_xs[i] = 0;
+		sphere_ys[i] = 0;
+		sphere_zs[i] = 0;
+		sphere_rs[i] = -Urho3D::M_LARGE_VALUE;
+	}
+
+	OnMarkedDirty(node_);
+}
+
+void InstancedModel::UpdateBatches(Urho3D::FrameInfo const& frame)
+{
+	// Use distance to the closest point of bounding box, so
+	// draw distance does not hide instances that are near.
+	Urho3D::BoundingBox const& world_bb = GetWorldBoundingBox();
+	Urho3D::Vector3 camera_pos = frame.camera_->GetNode()->GetWorldPosition();
+	Urho3D::Vector3 closest(
+		Urho3D::Clamp(camera_pos.x_, world_bb.min_.x_, world_bb.max_.x_),
+		Urho3D::Clamp(camera_pos.y_, world_bb.min_.y_, world_bb.max_.y_),
+		Urho3D::Clamp(camera_pos.z_, world_bb.min_.z_, world_bb.max_.z_)
+	);
+	distance_ = (closest - camera_pos).Length();
+
+	if (frame.frameNumber_ != visible_transfs_frame_number) {
+		RemoveOldVisibleTransforms(frame.frameNumber_);
+	}
+	VisibleTransforms& visible_entry = visible_transfs[frame.camera_];
+	visible_entry.frame_number = frame.frameNumber_;
+	Transforms& visible = visible_entry.transfs;
+	CullInstances(visible, frame.camera_);
+
+	for (unsigned i = 0; i < batches_.Size(); ++ i) {
+		batches_[i].distance_ = distance_;
+		batches_[i].worldTransform_ = visible.Empty() ? &Urho3D::Matrix3x4::IDENTITY : &visible[0];
+		batches_[i].numWorldTransforms_ = visible.Size();
+	}
+
+	float scale = world_bb.Size().DotProduct(Urho3D::DOT_SCALE);
+	float new_lod_distance = frame.camera_->GetLodDistance(distance_, scale, lodBias_);
+	if (new_lod_distance != lodDistance_) {
+		lodDistance_ = new_lod_distance;
+		CalculateLodLevels();
+	}
+}
+
+void InstancedModel::ProcessRayQuery(Urho3D::RayOctreeQuery const& query, Urho3D::PODVector<Urho3D::RayQueryResult>& results)
+{
+	if (transfs.Empty()) {
+		Urho3D::StaticModel::ProcessRayQuery(query, results);
+		return;
+	}
+
+	Urho3D::RayQueryLevel level = query.level_;
+	Urho3D::Matrix3x4 const& world_transf = node_->GetWorldTransform();
+
+	// Reject instances using bounding spheres in local space. Node
+	// is not scaled, so distances are the same as in world space.
+	Urho3D::Ray local_ray = query.ray_.Transformed(world_transf.Inverse());
+
+	float nearest_dist = query.maxDistance_;
+	Urho3D::Vector3 nearest_nrm;
+	Urho3D::Vector2 nearest_uv;
+	unsigned nearest_instance = Urho3D::M_MAX_UNSIGNED;
+	for (unsigned i = 0; i < transfs.Size(); ++ i) {
+		Urho3D::Sphere sphere(Urho3D::Vector3(sphere_xs[i], sphere_ys[i], sphere_zs[i]), sphere_rs[i]);
+		if (local_ray.HitDistance(sphere) >= nearest_dist) {
+			continue;
+		}
+
+		Urho3D::Matrix3x4 instance_transf = world_transf * transfs[i];
+
+		// Axis aligned bounding box of a single instance
+		if (level == Urho3D::RAY_AABB) {
+			float dist = query.ray_.HitDistance(boundingBox_.Transformed(instance_transf));
+			if (dist < nearest_dist) {
+				nearest_dist = dist;
+				nearest_nrm = -query.ray_.direction_;
+				nearest_instance = i;
+			}
+			continue;
+		}
+
+		// Oriented bounding box or triangles. These are tested in the
+		// space of instance, like StaticModel does in the space of Node.
+		Urho3D::Ray instance_ray = query.ray_.Transformed(instance_transf.Inverse());
+		if (instance_ray.HitDistance(boundingBox_) == Urho3D::M_INFINITY) {
+			continue;
+		}
+		float dist = 0;
+		Urho3D::Vector3 nrm = -query.ray_.direction_;
+		Urho3D::Vector2 uv;
+		if (level >= Urho3D::RAY_TRIANGLE) {
+			float instance_dist = Urho3D::M_INFINITY;
+			for (unsigned batch_i = 0; batch_i < batches_.Size(); ++ batch_i) {
+				Urho3D::Geometry* geometry = batches_[batch_i].geometry_;
+				if (!geometry) {
+					continue;
+				}
+				Urho3D::Vector3 geometry_nrm;
+				Urho3D::Vector2 geometry_uv;
+				float geometry_dist;
+				if (level == Urho3D::RAY_TRIANGLE) {
+					geometry_dist = geometry->GetHitDistance(instance_ray, &geometry_nrm);
+				} else {
+					geometry_dist = geometry->GetHitDistance(instance_ray, &geometry_nrm, &geometry_uv);
+				}
+				if (geometry_dist < instance_dist) {
+					instance_dist = geometry_dist;
+					nrm = (instance_transf * Urho3D::Vector4(geometry_nrm, 0)).Normalized();
+					uv = geometry_uv;
+				}
+			}
+			if (instance_dist == Urho3D::M_INFINITY) {
+				continue;
+			}
+			dist = instance_dist;
+		} else {
+			dist = instance_ray.HitDistance(boundingBox_);
+		}
+		// Instances may be scaled, so measure the distance in world space
+		Urho3D::Vector3 hit_pos = instance_transf * (instance_ray.origin_ + dist * instance_ray.direction_);
+		dist = (hit_pos - query.ray_.origin_).Length();
+		if (dist < nearest_dist) {
+			nearest_dist = dist;
+			nearest_nrm = nrm;
+			nearest_uv = uv;
+			nearest_instance = i;
+		}
+	}
+
+	if (nearest_instance != Urho3D::M_MAX_UNSIGNED) {
+		Urho3D::RayQueryResult result;
+		result.position_ = query.ray_.origin_ + nearest_dist * query.ray_.direction_;
+		result.normal_ = nearest_nrm;
+		result.textureUV_ = nearest_uv;
+		result.distance_ = nearest_dist;
+		result.drawable_ = this;
+		result.node_ = node_;
+		result.subObject_ = nearest_instance;
+		results.Push(result);
+	}
+}
+
+void InstancedModel::OnWorldBoundingBoxUpdate()
+{
+	if (transfs.Empty()) {
+		worldBoundingBox_ = boundingBox_.Transformed(node_->GetWorldTransform());
+	} else {
+		worldBoundingBox_ = instances_bb.Transformed(node_->GetWorldTransform());
+	}
+}
+
+void InstancedModel::CullInstances(Transforms& result, Urho3D::Camera const* camera)
+{
+	result.Clear();
+
+	// Do culling in local space
+	Urho3D::Matrix3x4 const& world_transf = node_->GetWorldTransform();
+	Urho3D::Matrix3x4 world_transf_inv = world_transf.Inverse();
+	Urho3D::Frustum frustum = camera->GetFrustum().Transformed(world_transf_inv);
+	Urho3D::Vector3 camera_pos = world_transf_inv * camera->GetNode()->GetWorldPosition();
+	float max_dist = drawDistance_ > 0 ? drawDistance_ : Urho3D::M_INFINITY;
+	// Shadow casters outside the frustum may cast shadows inside it
+	unsigned frustum_planes = castShadows_ ? 0 : Urho3D::NUM_FRUSTUM_PLANES;
+
+#ifdef URHO3D_SSE
+	__m128 const zero = _mm_setzero_ps();
+	__m128 const max_dist4 = _mm_set1_ps(max_dist);
+	__m128 const cam_x = _mm_set1_ps(camera_pos.x_);
+	__m128 const cam_y = _mm_set1_ps(camera_pos.y_);
+	__m128 const cam_z = _mm_set1_ps(camera_pos.z_);
+	for (unsigned i = 0; i < sphere_xs.Size(); i += 4) {
+		__m128 x = _mm_loadu_ps(&sphere_xs[i]);
+		__m128 y = _mm_loadu_ps(&sphere_ys[i]);
+		__m128 z = _mm_loadu_ps(&sphere_zs[i]);
+		__m128 r = _mm_loadu_ps(&sphere_rs[i]);
+
+		// Check distance
+		__m128 dx = _mm_sub_ps(x, cam_x);
+		__m128 dy = _mm_sub_ps(y, cam_y);
+		__m128 dz = _mm_sub_ps(z, cam_z);
+		__m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		__m128 max_dist_r = _mm_add_ps(max_dist4, r);
+		__m128 visible = _mm_cmple_ps(dist2, _mm_mul_ps(max_dist_r, max_dist_r));
+
+		// Check frustum planes
+		for (unsigned plane_i = 0; plane_i < frustum_planes; ++ plane_i) {
+			Urho3D::Plane const& plane = frustum.planes_[plane_i];
+			__m128 d = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.normal_.x_)), _mm_mul_ps(y, _mm_set1_ps(plane.normal_.y_)));
+			d = _mm_add_ps(d, _mm_mul_ps(z, _mm_set1_ps(plane.normal_.z_)));
+			d = _mm_add_ps(d, _mm_add_ps(_mm_set1_ps(plane.d_), r));
+			visible = _mm_and_ps(visible, _mm_cmpge_ps(d, zero));
+		}
+
+		int mask = _mm_movemask_ps(visible);
+		for (unsigned bit = 0; mask; ++ bit, mask >>= 1) {
+			if (mask & 1) {
+				assert(i + bit < transfs.Size());
+				result.Push(world_transf * transfs[i + bit]);
+			}
+		}
+	}
+#else
+	for (unsigned i = 0; i < transfs.Size(); ++ i) {
+		Urho3D::Vector3 center(sphere_xs[i], sphere_ys[i], sphere_zs[i]);
+		float r = sphere_rs[i];
+		if ((center - camera_pos).LengthSquared() > (max_dist + r) * (max_dist + r)) {
+			continue;
+		}
+		bool visible = true;
+		for (unsigned plane_i = 0; plane_i < frustum_planes; ++ plane_i) {
+			if (frustum.planes_[plane_i].Distance(center) < -r) {
+				visible = false;
+				break;
+			}
+		}
+		if (visible) {
+			result.Push(world_transf * transfs[i]);
+		}
+	}
+#endif
+}
+
+void InstancedModel::RemoveOldVisibleTransforms(unsigned frame_number)
+{
+	// Renderer has finished with the transforms of earlier frames
+	VisibleTransformsByCamera::Iterator it = visible_transfs.Begin();
+	while (it != visible_transfs.End()) {
+		if (it->second_.frame_number != frame_number) {
+			it = visible_transfs.Erase(it);
+		} else {
+			++ it;
+		}
+	}
+	visible_transfs_frame_number = frame_number;
+}
+
+}
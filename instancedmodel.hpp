@@ -0,0 +1,81 @@
+#ifndef URHOEXTRAS_INSTANCEDMODEL_HPP
+#define URHOEXTRAS_INSTANCEDMODEL_HPP
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Graphics/Camera.h>
+#include <Urho3D/Graphics/StaticModel.h>
+#include <Urho3D/Math/Matrix3x4.h>
+
+namespace UrhoExtras
+{
+
+// Draws one Model many times using hardware instancing. Instances are given
+// as transforms relative to the Node. Every view culls instances with its own
+// Camera, and only transforms of instances that are inside view frustum and
+// draw distance are passed to Renderer. If the Model casts shadows, only draw
+// distance is checked, because shadow casters may be outside the frustum. The Node
+// should not be scaled, because draw distance is checked in its local space.
+// Component is not registered to Context, so it should be created with "new"
+// and added to Node using AddComponent().
+class InstancedModel : public Urho3D::StaticModel
+{
+	URHO3D_OBJECT(InstancedModel, Urho3D::StaticModel)
+
+public:
+
+	InstancedModel(Urho3D::Context* context);
+	virtual ~InstancedModel();
+
+	// Model must be set before instances.
+	void SetInstances(Urho3D::PODVector<Urho3D::Matrix3x4> const& transfs);
+	inline unsigned GetNumInstances() const { return transfs.Size(); }
+
+	virtual void UpdateBatches(Urho3D::FrameInfo const& frame);
+	// Tests all instances and reports the nearest hit. Sub object
+	// of the result is the index of the instance that was hit.
+	virtual void ProcessRayQuery(Urho3D::RayOctreeQuery const& query, Urho3D::PODVector<Urho3D::RayQueryResult>& results);
+
+protected:
+
+	virtual void OnWorldBoundingBoxUpdate();
+
+private:
+
+	typedef Urho3D::PODVector<Urho3D::Matrix3x4> Transforms;
+
+	struct VisibleTransforms
+	{
+		// Frame when these were culled
+		unsigned frame_number;
+		Transforms transfs;
+	};
+	typedef Urho3D::HashMap<Urho3D::Camera const*, VisibleTransforms> VisibleTransformsByCamera;
+
+	// Instance transforms in local space
+	Transforms transfs;
+
+	// Bounding spheres of instances in local space. These are stored as
+	// separate arrays, padded to multiple of four, so they can be culled
+	// four at a time. Padding has negative radius, so it is always culled.
+	Urho3D::PODVector<float> sphere_xs;
+	Urho3D::PODVector<float> sphere_ys;
+	Urho3D::PODVector<float> sphere_zs;
+	Urho3D::PODVector<float> sphere_rs;
+
+	Urho3D::BoundingBox instances_bb;
+
+	// Visible transforms in world space. Renderer only stores pointers to
+	// these, so every Camera (for example water reflection) needs its own.
+	// They are needed until the frame is rendered, so transforms of the
+	// Cameras that did not see this in the current frame are removed
+	// when the next frame starts.
+	VisibleTransformsByCamera visible_transfs;
+	unsigned visible_transfs_frame_number;
+
+	void CullInstances(Transforms& result, Urho3D::Camera const* camera);
+	void RemoveOldVisibleTransforms(unsigned frame_number);
+};
+
+}
+
+#endif
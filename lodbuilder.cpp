@@ -1,12 +1,18 @@
 #include "lodbuilder.hpp"
 
-#include <Urho3D/Container/HashSet.h>
+#include <Urho3D/Container/Sort.h>
+
+#include <cstring>
 
 #include "types.hpp"
+#include "../urhoextras/meshoptimizer.hpp"
 
 namespace BigWorld
 {
 
+unsigned const MAX_TERRAINTYPES_IN_MATERIAL = 4;
+unsigned const MAX_TERRAINTYPES_IN_TEXTURE_ARRAY_CHUNK = 8;
+
 inline void pushV2(Urho3D::PODVector<char>& buf, Urho3D::Vector2 const& v)
 {
 	buf.Insert(buf.End(), (char*)v.Data(), (char*)v.Data() + sizeof(float) * 2);
@@ -17,91 +23,148 @@ inline void pushV3(Urho3D::PODVector<char>& buf, Urho3D::Vector3 const& v)
 	buf.Insert(buf.End(), (char*)v.Data(), (char*)v.Data() + sizeof(float) * 3);
 }
 
-Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_ttypes, Urho3D::Context* context, Corners const& corners, unsigned chunk_width)
+unsigned char const NO_PALETTE_SLOT = 0xff;
+
+// Converts weights of terraintypes in a palette to bytes, so that their sum
+// is 255. "palette_slots" tells slot of every terraintype in the palette, or
+// NO_PALETTE_SLOT if terraintype is not in the palette.
+inline void getPaletteWeights(unsigned char* result, unsigned palette_size, unsigned char const* palette_slots, TTypesBlend const& blend)
+{
+	unsigned weights[MAX_TERRAINTYPES_IN_TEXTURE_ARRAY_CHUNK] = { 0 };
+	unsigned total = 0;
+	for (unsigned i = 0; i < blend.size(); ++ i) {
+		unsigned char slot = palette_slots[blend.getKey(i)];
+		if (slot != NO_PALETTE_SLOT) {
+			weights[slot] += blend.getWeight(i);
+			total += blend.getWeight(i);
+		}
+	}
+	if (total == 0) {
+		weights[0] = 1;
+		total = 1;
+	}
+	for (unsigned slot = 0; slot < palette_size; ++ slot) {
+		result[slot] = (weights[slot] * 255 + total / 2) / total;
+	}
+}
+
+inline void setUpPaletteSlots(unsigned char* result, TTypes const& palette)
+{
+	memset(result, NO_PALETTE_SLOT, 256);
+	for (unsigned slot = 0; slot < palette.Size(); ++ slot) {
+		result[palette[slot]] = slot;
+	}
+}
+
+// Pushes indices and weights of the palette of terraintypes. Indices are the
+// same in every vertex of the Chunk, so interpolation between them is safe.
+inline void pushTerraintypeBlend(Urho3D::PODVector<char>& buf, TTypes const& palette, unsigned char const* palette_slots, TTypesByWeight const& ttypes)
+{
+	unsigned char idxs[MAX_TERRAINTYPES_IN_TEXTURE_ARRAY_CHUNK] = { 0 };
+	unsigned char weights[MAX_TERRAINTYPES_IN_TEXTURE_ARRAY_CHUNK] = { 0 };
+	for (unsigned slot = 0; slot < palette.Size(); ++ slot) {
+		idxs[slot] = palette[slot];
+	}
+	TTypesBlend blend;
+	blend.add(ttypes);
+	getPaletteWeights(weights, palette.Size(), palette_slots, blend);
+	// First four indices and weights, then rest of them
+	for (unsigned group = 0; group < MAX_TERRAINTYPES_IN_TEXTURE_ARRAY_CHUNK; group += 4) {
+		buf.Insert(buf.End(), (char*)idxs + group, (char*)idxs + group + 4);
+		buf.Insert(buf.End(), (char*)weights + group, (char*)weights + group + 4);
+	}
+}
+
+inline void pushVertex(LodBuildingTaskData* data, unsigned char const* palette_slots, Urho3D::Vector3 const& pos, Urho3D::Vector3 const& normal, Urho3D::Vector2 const& uv, Corner const& corner)
+{
+	pushV3(data->vrts_data, pos);
+	pushV3(data->vrts_data, normal);
+	pushV2(data->vrts_data, uv);
+	if (data->texture_array_mode) {
+		pushTerraintypeBlend(data->vrts_data, data->used_ttypes, palette_slots, corner.ttypes);
+	}
+}
+
+void calculateUsedTerraintypes(TTypes& result_used_ttypes, Corners const& corners, unsigned chunk_width, unsigned max_ttypes)
 {
 	// Precalculate some stuff
 	unsigned const CHUNK_W1 = chunk_width + 1;
 	unsigned const CHUNK_W3 = chunk_width + 3;
 
-	// Calculate what terrains are used and how much. If there are
-	// too many of them, then the rarest ones will be ignored.
-	unsigned const MAX_TERRAINTYPES_IN_MATERIAL = 4;
-	Urho3D::HashMap<uint8_t, float> used_ttypes;
+	// Calculate what terrains are used and how much
+	unsigned usage[256] = { 0 };
 	for (unsigned y = 0; y < CHUNK_W1; ++ y) {
 		unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
 		for (unsigned x = 0; x < CHUNK_W1; ++ x) {
-			Corner const& corner = corners[ofs];
-			for (unsigned ttypes_i = 0; ttypes_i < corner.ttypes.size(); ++ ttypes_i) {
-				uint8_t ttype = corner.ttypes.getKey(ttypes_i);
-				float weight = corner.ttypes.getValue(ttypes_i);
-				if (weight > 0) {
-					if (!used_ttypes.Contains(ttype)) {
-						used_ttypes[ttype] = 0;
-					}
-					used_ttypes[ttype] += weight;
-				}
+			TTypesByWeight const& ttypes = corners[ofs].ttypes;
+			for (unsigned ttypes_i = 0; ttypes_i < ttypes.size(); ++ ttypes_i) {
+				usage[ttypes.getKey(ttypes_i)] += ttypes.getValueByte(ttypes_i);
 			}
 			++ ofs;
 		}
 	}
-	// Do the possible ignoring of rarest terraintypes
-	while (used_ttypes.Size() > MAX_TERRAINTYPES_IN_MATERIAL) {
-		float lowest_usage = 9999999;
-		unsigned lowest_usage_ttype = 0;
-		for (Urho3D::HashMap<uint8_t, float>::Iterator it = used_ttypes.Begin(); it != used_ttypes.End(); ++ it) {
-			if (it->second_ < lowest_usage) {
-				lowest_usage = it->second_;
-				lowest_usage_ttype = it->first_;
+
+	// Pick the most used ones. If there are too
+	// many of them, then the rarest ones are ignored.
+	assert(result_used_ttypes.Empty());
+	result_used_ttypes.Reserve(max_ttypes);
+	while (result_used_ttypes.Size() < max_ttypes) {
+		unsigned highest_usage = 0;
+		unsigned highest_usage_ttype = 0;
+		for (unsigned ttype = 0; ttype < 256; ++ ttype) {
+			if (usage[ttype] > highest_usage) {
+				highest_usage = usage[ttype];
+				highest_usage_ttype = ttype;
 			}
 		}
-		used_ttypes.Erase(lowest_usage_ttype);
-	}
-	assert(result_used_ttypes.Empty());
-	result_used_ttypes.Reserve(used_ttypes.Size());
-	for (Urho3D::HashMap<uint8_t, float>::Iterator i = used_ttypes.Begin(); i != used_ttypes.End(); ++ i) {
-		result_used_ttypes.Push(i->first_);
+		if (highest_usage == 0) {
+			break;
+		}
+		result_used_ttypes.Push(highest_usage_ttype);
+		usage[highest_usage_ttype] = 0;
 	}
 	assert(!result_used_ttypes.Empty());
 
+	// Keep terraintypes sorted, so Chunks with same
+	// terraintypes can share their Materials.
+	Urho3D::Sort(result_used_ttypes.Begin(), result_used_ttypes.End());
+}
+
+Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_ttypes, Urho3D::Context* context, Corners const& corners, unsigned chunk_width)
+{
+	// Precalculate some stuff
+	unsigned const CHUNK_W1 = chunk_width + 1;
+	unsigned const CHUNK_W3 = chunk_width + 3;
+
+	calculateUsedTerraintypes(result_used_ttypes, corners, chunk_width, MAX_TERRAINTYPES_IN_MATERIAL);
+
 	// If there is only one terraintype, then image is not needed
 	if (result_used_ttypes.Size() == 1) {
 		return Urho3D::SharedPtr<Urho3D::Image> ();
 	}
+	assert(result_used_ttypes.Size() >= 2);
+	assert(result_used_ttypes.Size() <= 4);
 
 	Urho3D::SharedPtr<Urho3D::Image> img(new Urho3D::Image(context));
 // TODO: Consider using POT(Power Of Two) image size!
-// TODO: Use variable amount of components!
-	if (result_used_ttypes.Size() == 4) {
-		img->SetSize(CHUNK_W1, CHUNK_W1, 4);
-	} else {
-		img->SetSize(CHUNK_W1, CHUNK_W1, 3);
-	}
+	unsigned const COMPONENTS = result_used_ttypes.Size() == 4 ? 4 : 3;
+	img->SetSize(CHUNK_W1, CHUNK_W1, COMPONENTS);
+
+	unsigned char palette_slots[256];
+	setUpPaletteSlots(palette_slots, result_used_ttypes);
 
-	// Render terrain types to image
+	// Render terrain types straight to the pixel data of image
+	TTypesBlend blend;
+	unsigned char* pixel = img->GetData();
 	for (unsigned y = 0; y < CHUNK_W1; ++ y) {
 		unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
 		for (unsigned x = 0; x < CHUNK_W1; ++ x) {
-			TTypesByWeight const& ttypes = corners[ofs].ttypes;
-			assert(result_used_ttypes.Size() >= 2);
-			assert(result_used_ttypes.Size() <= 4);
-
-			float w0 = ttypes[result_used_ttypes[0]];
-			float w1 = ttypes[result_used_ttypes[1]];
-			float w2 = 0;
-			float w3 = 0;
-			if (result_used_ttypes.Size() >= 3) {
-				w2 = ttypes[result_used_ttypes[2]];
-			}
-			if (result_used_ttypes.Size() >= 4) {
-				w3 = ttypes[result_used_ttypes[3]];
-			}
-			float total = w0 + w1 + w2 + w3;
-			if (total == 0) {
-				w0 = 1;
-				total = 1;
-			}
-			img->SetPixel(x, y, Urho3D::Color(w0 / total, w1 / total, w2 / total, w3 / total));
-
+			// Unused third channel must be zero
+			pixel[2] = 0;
+			blend.clear();
+			blend.add(corners[ofs].ttypes);
+			getPaletteWeights(pixel, result_used_ttypes.Size(), palette_slots, blend);
+			pixel += COMPONENTS;
 			++ ofs;
 		}
 	}
@@ -115,8 +178,14 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 
 	LodBuildingTaskData* data = (LodBuildingTaskData*)item->aux_;
 
-	// Check if terraintype image calculation is also needed
-	if (data->calculate_ttype_image) {
+	// Far away LODs only need to know the dominant terraintype. In texture array
+	// mode, the terraintypes are stored to vertices. Otherwise check if
+	// terraintype image calculation is needed.
+	if (data->dominant_ttype_only) {
+		calculateUsedTerraintypes(data->used_ttypes, data->corners, data->chunk_width, 1);
+	} else if (data->texture_array_mode) {
+		calculateUsedTerraintypes(data->used_ttypes, data->corners, data->chunk_width, MAX_TERRAINTYPES_IN_TEXTURE_ARRAY_CHUNK);
+	} else if (data->calculate_ttype_image) {
 		data->ttype_image = calculateTerraintypeImage(data->used_ttypes, data->context, data->corners, data->chunk_width);
 	}
 
@@ -138,10 +207,22 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 	float occ_h_ne = (int(data->corners[CHUNK_W3 * (1 + CHUNK_W) + 1 + CHUNK_W].height) - int(data->baseheight)) * HEIGHTSTEP;
 	float occluder_lowering = 0;
 
+	// In texture array mode, find out which vertex attribute slot is used for each terraintype
+	unsigned char palette_slots[256];
+	if (data->texture_array_mode) {
+		setUpPaletteSlots(palette_slots, data->used_ttypes);
+	}
+
 	// Set up elements
 	data->vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_POSITION));
 	data->vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR3, Urho3D::SEM_NORMAL));
 	data->vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_VECTOR2, Urho3D::SEM_TEXCOORD));
+	if (data->texture_array_mode) {
+		for (unsigned i = 0; i < MAX_TERRAINTYPES_IN_TEXTURE_ARRAY_CHUNK / 4; ++ i) {
+			data->vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_UBYTE4, Urho3D::SEM_BLENDINDICES, i));
+			data->vrts_elems.Push(Urho3D::VertexElement(Urho3D::TYPE_UBYTE4_NORM, Urho3D::SEM_BLENDWEIGHTS, i));
+		}
+	}
 	unsigned const VRT_SIZE = Urho3D::VertexBuffer::GetVertexSize(data->vrts_elems);
 
 	// Create array of positions and calculate boundingbox
@@ -168,17 +249,19 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 	}
 
 	// Check if there is more than one terraintype used
-	Urho3D::HashSet<uint8_t> ttype_check;
-	for (unsigned y = 0; y < CHUNK_W1 && ttype_check.Size() <= 1; ++ y) {
+	bool many_ttypes_used = false;
+	int first_ttype = -1;
+	for (unsigned y = 0; y < CHUNK_W1 && !many_ttypes_used; ++ y) {
 		unsigned ofs = 1 + (y + 1) * (CHUNK_W3);
-		for (unsigned x = 0; x < CHUNK_W1 && ttype_check.Size() <= 1; ++ x) {
-			Corner const& corner = data->corners[ofs];
-			for (unsigned ttypes_i = 0; ttypes_i < corner.ttypes.size(); ++ ttypes_i) {
-				uint8_t ttype = corner.ttypes.getKey(ttypes_i);
-				float weight = corner.ttypes.getValue(ttypes_i);
-				if (weight > 0) {
-					ttype_check.Insert(ttype);
-					if (ttype_check.Size() > 1) {
+		for (unsigned x = 0; x < CHUNK_W1 && !many_ttypes_used; ++ x) {
+			TTypesByWeight const& ttypes = data->corners[ofs].ttypes;
+			for (unsigned ttypes_i = 0; ttypes_i < ttypes.size(); ++ ttypes_i) {
+				if (ttypes.getValueByte(ttypes_i) > 0) {
+					uint8_t ttype = ttypes.getKey(ttypes_i);
+					if (first_ttype < 0) {
+						first_ttype = ttype;
+					} else if (first_ttype != ttype) {
+						many_ttypes_used = true;
 						break;
 					}
 				}
@@ -186,7 +269,10 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 			++ ofs;
 		}
 	}
-	bool multiple_terraintypes = ttype_check.Size() > 1;
+	// Texture array material applies the repeating in shader, so
+	// it needs the same kind of UV coordinates as blended materials.
+	// Dominant terraintype is drawn using single layer material.
+	bool multiple_terraintypes = (many_ttypes_used && !data->dominant_ttype_only) || data->texture_array_mode;
 
 	// Create array of normals and UV coordinates
 	Urho3D::PODVector<Urho3D::Vector3> nrms;
@@ -237,9 +323,7 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 			Urho3D::Vector3 const& pos = poss[ofs];
 			Urho3D::Vector3 const& normal = nrms[ofs];
 			Urho3D::Vector2 const& uv = uvs[ofs];
-			pushV3(data->vrts_data, pos);
-			pushV3(data->vrts_data, normal);
-			pushV2(data->vrts_data, uv);
+			pushVertex(data, palette_slots, pos, normal, uv, data->corners[ofs]);
 			ofs += step;
 
 			// Use position to check if occluder should be lowered
@@ -308,9 +392,7 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 				Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
 				Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
 				Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
-				pushV3(data->vrts_data, center_pos);
-				pushV3(data->vrts_data, center_nrm);
-				pushV2(data->vrts_data, center_uv);
+				pushVertex(data, palette_slots, center_pos, center_nrm, center_uv, data->corners[i_center_ofs]);
 				// Create new triangle
 				data->idxs_data.Push(i_begin);
 				data->idxs_data.Push(i_end);
@@ -333,9 +415,7 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 				Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
 				Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
 				Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
-				pushV3(data->vrts_data, center_pos);
-				pushV3(data->vrts_data, center_nrm);
-				pushV2(data->vrts_data, center_uv);
+				pushVertex(data, palette_slots, center_pos, center_nrm, center_uv, data->corners[i_center_ofs]);
 				// Create new triangle
 				data->idxs_data.Push(i_begin);
 				data->idxs_data.Push(i_end);
@@ -358,9 +438,7 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 				Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
 				Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
 				Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
-				pushV3(data->vrts_data, center_pos);
-				pushV3(data->vrts_data, center_nrm);
-				pushV2(data->vrts_data, center_uv);
+				pushVertex(data, palette_slots, center_pos, center_nrm, center_uv, data->corners[i_center_ofs]);
 				// Create new triangle
 				data->idxs_data.Push(i_begin);
 				data->idxs_data.Push(i_end);
@@ -383,9 +461,7 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 				Urho3D::Vector3 const& center_pos = poss[i_center_ofs];
 				Urho3D::Vector3 const& center_nrm = nrms[i_center_ofs];
 				Urho3D::Vector2 const& center_uv = uvs[i_center_ofs];
-				pushV3(data->vrts_data, center_pos);
-				pushV3(data->vrts_data, center_nrm);
-				pushV2(data->vrts_data, center_uv);
+				pushVertex(data, palette_slots, center_pos, center_nrm, center_uv, data->corners[i_center_ofs]);
 				// Create new triangle
 				data->idxs_data.Push(i_begin);
 				data->idxs_data.Push(i_end);
@@ -395,6 +471,13 @@ void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex)
 		}
 	}
 
+	if (data->optimize_mesh) {
+		unsigned vrts_size = data->vrts_data.Size() / VRT_SIZE;
+		UrhoExtras::optimizeVertexCache(data->idxs_data.Buffer(), data->idxs_data.Size(), vrts_size);
+		vrts_size = UrhoExtras::optimizeVertexFetch((unsigned char*)data->vrts_data.Buffer(), VRT_SIZE, vrts_size, data->idxs_data.Buffer(), data->idxs_data.Size());
+		data->vrts_data.Resize(vrts_size * VRT_SIZE);
+	}
+
 	// Construct occluder shape. It will be a lower detail version of the terrain.
 	unsigned occ_step = CHUNK_W / 4;
 	unsigned occ_width = CHUNK_W / occ_step + 1;
@@ -1,6 +1,8 @@
 #ifndef BIGWORLD_LODBUILDER_HPP
 #define BIGWORLD_LODBUILDER_HPP
 
+#include "types.hpp"
+
 #include <Urho3D/Core/WorkQueue.h>
 
 namespace BigWorld
@@ -8,6 +10,11 @@ namespace BigWorld
 
 void buildLod(Urho3D::WorkItem const* item, unsigned threadIndex);
 
+// Finds up to four most used terraintypes and renders their weights to an
+// image. Returns null if only one terraintype is used. This is exposed for
+// benchmarking.
+Urho3D::SharedPtr<Urho3D::Image> calculateTerraintypeImage(TTypes& result_used_ttypes, Urho3D::Context* context, Corners const& corners, unsigned chunk_width);
+
 }
 
 #endif
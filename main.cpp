@@ -1,7 +1,9 @@
 #include <string>
 #include <sstream>
+#include <cstdlib>
 
 #include <Urho3D/Core/CoreEvents.h>
+#include <Urho3D/Core/ProcessUtils.h>
 #include <Urho3D/Engine/Application.h>
 #include <Urho3D/Engine/Engine.h>
 #include <Urho3D/Input/Input.h>
@@ -36,6 +38,8 @@
 #include "types.hpp"
 #include "cameracontrol.hpp"
 #include "camera.hpp"
+#include "selfcheck.hpp"
+#include "benchmark.hpp"
 
 using namespace Urho3D;
 using namespace BigWorld;
@@ -46,13 +50,33 @@ class MyApp: public Application
 public:
     CameraControl *cameracontrol_;
     BigWorld::Camera *bwCamera_;
+    bool selfCheck_;
+    bool benchmark_;
     MyApp(Context *context)
-        : Application(context)
+        : Application(context),
+          selfCheck_(false),
+          benchmark_(false)
     {
     }
 
     virtual void Setup()
     {
+        // With "-selfcheck" or "-benchmark", only run
+        // checks or benchmarks without window and quit
+        const Vector<String>& arguments = GetArguments();
+        for (unsigned i = 0; i < arguments.Size(); i++)
+        {
+            if (arguments[i].ToLower() == "-selfcheck")
+                selfCheck_ = true;
+            else if (arguments[i].ToLower() == "-benchmark")
+                benchmark_ = true;
+        }
+        if (selfCheck_ || benchmark_)
+        {
+            engineParameters_["Headless"] = true;
+            return;
+        }
+
         engineParameters_["FullScreen"] = false;
         engineParameters_["WindowWidth"] = 1000;
         engineParameters_["WindowHeight"] = 700;
@@ -64,6 +88,16 @@ public:
 
     virtual void Start()
     {
+        if (selfCheck_ || benchmark_)
+        {
+            if (selfCheck_ && !BigWorld::runSelfCheck(1, 100000))
+                exitCode_ = EXIT_FAILURE;
+            if (benchmark_)
+                BigWorld::runBenchmarks(context_);
+            engine_->Exit();
+            return;
+        }
+
         const int CHUNK_WIDTH = 32;
         ChunkWorld *chunkWorld = new ChunkWorld(context_, CHUNK_WIDTH, 2, 1, 1, 1, 1, false);
         chunkWorld->addTerrainTexture("Textures/terrain0.jpg");
@@ -0,0 +1,601 @@
+#include "meshoptimizer.hpp"
+
+#include <Urho3D/Container/Sort.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/MathDefs.h>
+#include <Urho3D/Math/Vector3.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+namespace UrhoExtras
+{
+
+namespace
+{
+
+// Parameters of the scoring
+unsigned const CACHE_SIZE = 32;
+float const CACHE_DECAY_POWER = 1.5f;
+float const LAST_TRI_SCORE = 0.75f;
+float const VALENCE_BOOST_SCALE = 2.0f;
+float const VALENCE_BOOST_POWER = 0.5f;
+
+unsigned const NONE = Urho3D::M_MAX_UNSIGNED;
+
+float getVertexScore(int cache_pos, unsigned tris_left)
+{
+	// Vertices without triangles are not needed anymore
+	if (tris_left == 0) {
+		return -1;
+	}
+
+	float score = 0;
+	if (cache_pos >= 0) {
+		// Vertices of the last triangle get fixed score, so
+		// the next triangle does not prefer any of its edges.
+		if (cache_pos < 3) {
+			score = LAST_TRI_SCORE;
+		} else {
+			float scaler = 1.0f / (CACHE_SIZE - 3);
+			score = powf(1.0f - (cache_pos - 3) * scaler, CACHE_DECAY_POWER);
+		}
+	}
+
+	// Prefer vertices that have only few triangles left
+	score += VALENCE_BOOST_SCALE * powf(float(tris_left), -VALENCE_BOOST_POWER);
+
+	return score;
+}
+
+// Symmetric 4x4 matrix that measures squared distance to planes
+struct Quadric
+{
+	double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+
+	inline void addPlane(Urho3D::Vector3 const& n, float d, float weight)
+	{
+		a00 += weight * n.x_ * n.x_;
+		a01 += weight * n.x_ * n.y_;
+		a02 += weight * n.x_ * n.z_;
+		a03 += weight * n.x_ * d;
+		a11 += weight * n.y_ * n.y_;
+		a12 += weight * n.y_ * n.z_;
+		a13 += weight * n.y_ * d;
+		a22 += weight * n.z_ * n.z_;
+		a23 += weight * n.z_ * d;
+		a33 += weight * d * d;
+	}
+
+	inline void add(Quadric const& q)
+	{
+		a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+		a11 += q.a11; a12 += q.a12; a13 += q.a13;
+		a22 += q.a22; a23 += q.a23;
+		a33 += q.a33;
+	}
+
+	inline float getError(Urho3D::Vector3 const& p) const
+	{
+		double x = p.x_;
+		double y = p.y_;
+		double z = p.z_;
+		double error =
+			a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x +
+			a11 * y * y + 2 * a12 * y * z + 2 * a13 * y +
+			a22 * z * z + 2 * a23 * z +
+			a33;
+		return float(error < 0 ? -error : error);
+	}
+};
+
+// Weight of planes that keep open edges in place
+float const BORDER_WEIGHT = 10.0f;
+
+struct EdgeCollapse
+{
+	// Position vertices of the edge, and the actual vertex
+	// that vertices at "from" are moved to by default.
+	unsigned from;
+	unsigned to;
+	unsigned to_vrt;
+	float error;
+
+	inline bool operator<(EdgeCollapse const& other) const { return error < other.error; }
+};
+
+struct PositionKey
+{
+	Urho3D::Vector3 pos;
+	unsigned vrt;
+
+	inline bool operator<(PositionKey const& other) const
+	{
+		if (pos.x_ != other.pos.x_) return pos.x_ < other.pos.x_;
+		if (pos.y_ != other.pos.y_) return pos.y_ < other.pos.y_;
+		if (pos.z_ != other.pos.z_) return pos.z_ < other.pos.z_;
+		return vrt < other.vrt;
+	}
+};
+
+// Collects directed edges of triangles as sorted keys. Edges
+// of triangles that are collapsed to a line are skipped.
+void findEdges(Urho3D::PODVector<unsigned long long>& result, unsigned const* idxs, unsigned idxs_size)
+{
+	result.Clear();
+	result.Reserve(idxs_size);
+	for (unsigned i = 0; i < idxs_size; i += 3) {
+		for (unsigned j = 0; j < 3; ++ j) {
+			unsigned long long a = idxs[i + j];
+			unsigned long long b = idxs[i + (j + 1) % 3];
+			if (a != b) {
+				result.Push((a << 32) | b);
+			}
+		}
+	}
+	Urho3D::Sort(result.Begin(), result.End());
+}
+
+// Returns true if edge has no opposite edge
+inline bool isBorderEdge(Urho3D::PODVector<unsigned long long> const& edges, unsigned a, unsigned b)
+{
+	return !std::binary_search(edges.Begin(), edges.End(), ((unsigned long long)b << 32) | a);
+}
+
+// Returns true if moving vertex "from" to vertex "to" would
+// flip any triangle that does not get removed by the collapse.
+bool collapseFlipsTriangles(unsigned const* idxs, unsigned const* tris, unsigned tris_size, Urho3D::PODVector<Urho3D::Vector3> const& poss, unsigned from, unsigned to)
+{
+	for (unsigned i = 0; i < tris_size; ++ i) {
+		unsigned const* tri = idxs + tris[i] * 3;
+		if (tri[0] == to || tri[1] == to || tri[2] == to) {
+			continue;
+		}
+		Urho3D::Vector3 p[3];
+		Urho3D::Vector3 p_after[3];
+		for (unsigned j = 0; j < 3; ++ j) {
+			p[j] = poss[tri[j]];
+			p_after[j] = tri[j] == from ? poss[to] : p[j];
+		}
+		Urho3D::Vector3 n = (p[1] - p[0]).CrossProduct(p[2] - p[0]);
+		Urho3D::Vector3 n_after = (p_after[1] - p_after[0]).CrossProduct(p_after[2] - p_after[0]);
+		if (n.DotProduct(n_after) <= 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+}
+
+void optimizeVertexCache(unsigned* idxs, unsigned idxs_size, unsigned vrts_size)
+{
+	assert(idxs_size % 3 == 0);
+	unsigned tris_size = idxs_size / 3;
+	if (tris_size < 2) {
+		return;
+	}
+
+	// Triangles of every vertex. Triangles that are not yet
+	// added are kept at the beginning of the range of vertex.
+	Urho3D::PODVector<unsigned> vrt_tris_begin;
+	Urho3D::PODVector<unsigned> vrt_tris_left;
+	vrt_tris_begin.Resize(vrts_size + 1);
+	vrt_tris_left.Resize(vrts_size);
+	for (unsigned i = 0; i < vrts_size; ++ i) {
+		vrt_tris_left[i] = 0;
+	}
+	for (unsigned i = 0; i < idxs_size; ++ i) {
+		assert(idxs[i] < vrts_size);
+		++ vrt_tris_left[idxs[i]];
+	}
+	unsigned ofs = 0;
+	for (unsigned i = 0; i < vrts_size; ++ i) {
+		vrt_tris_begin[i] = ofs;
+		ofs += vrt_tris_left[i];
+		vrt_tris_left[i] = 0;
+	}
+	vrt_tris_begin[vrts_size] = ofs;
+	Urho3D::PODVector<unsigned> vrt_tris;
+	vrt_tris.Resize(idxs_size);
+	for (unsigned i = 0; i < idxs_size; ++ i) {
+		unsigned vrt = idxs[i];
+		vrt_tris[vrt_tris_begin[vrt] + vrt_tris_left[vrt]] = i / 3;
+		++ vrt_tris_left[vrt];
+	}
+
+	// Initial scores
+	Urho3D::PODVector<int> vrt_cache_pos;
+	Urho3D::PODVector<float> vrt_score;
+	vrt_cache_pos.Resize(vrts_size);
+	vrt_score.Resize(vrts_size);
+	for (unsigned i = 0; i < vrts_size; ++ i) {
+		vrt_cache_pos[i] = -1;
+		vrt_score[i] = getVertexScore(-1, vrt_tris_left[i]);
+	}
+	Urho3D::PODVector<float> tri_score;
+	Urho3D::PODVector<unsigned char> tri_added;
+	tri_score.Resize(tris_size);
+	tri_added.Resize(tris_size);
+	unsigned best_tri = 0;
+	for (unsigned i = 0; i < tris_size; ++ i) {
+		tri_score[i] = vrt_score[idxs[i * 3]] + vrt_score[idxs[i * 3 + 1]] + vrt_score[idxs[i * 3 + 2]];
+		tri_added[i] = false;
+		if (tri_score[i] > tri_score[best_tri]) {
+			best_tri = i;
+		}
+	}
+
+	Urho3D::PODVector<unsigned> result;
+	result.Reserve(idxs_size);
+
+	// Cache has room for three extra vertices, because
+	// vertices of new triangle are added before removing.
+	unsigned cache[CACHE_SIZE + 3];
+	unsigned cache_size = 0;
+	unsigned new_cache[CACHE_SIZE + 3];
+
+	unsigned scan_pos = 0;
+	while (result.Size() < idxs_size) {
+		// If no triangle touches the cache, then pick
+		// the first one that has not been added yet.
+		if (best_tri == NONE) {
+			while (tri_added[scan_pos]) {
+				++ scan_pos;
+			}
+			best_tri = scan_pos;
+		}
+
+		// Add triangle
+		unsigned const* tri_vrts = idxs + best_tri * 3;
+		tri_added[best_tri] = true;
+		for (unsigned i = 0; i < 3; ++ i) {
+			unsigned vrt = tri_vrts[i];
+			result.Push(vrt);
+			// Move triangle out of the range of not added triangles
+			unsigned* tris = vrt_tris.Buffer() + vrt_tris_begin[vrt];
+			unsigned& tris_left = vrt_tris_left[vrt];
+			for (unsigned j = 0; j < tris_left; ++ j) {
+				if (tris[j] == best_tri) {
+					tris[j] = tris[tris_left - 1];
+					tris[tris_left - 1] = best_tri;
+					break;
+				}
+			}
+			-- tris_left;
+		}
+
+		// Vertices of triangle go to the front of the cache
+		unsigned new_cache_size = 0;
+		for (unsigned i = 0; i < 3; ++ i) {
+			new_cache[new_cache_size ++] = tri_vrts[i];
+		}
+		for (unsigned i = 0; i < cache_size; ++ i) {
+			unsigned vrt = cache[i];
+			if (vrt != tri_vrts[0] && vrt != tri_vrts[1] && vrt != tri_vrts[2]) {
+				new_cache[new_cache_size ++] = vrt;
+			}
+		}
+
+		// Update scores of vertices in cache, and of
+		// those that were pushed out of the cache.
+		for (unsigned i = 0; i < new_cache_size; ++ i) {
+			unsigned vrt = new_cache[i];
+			vrt_cache_pos[vrt] = i < CACHE_SIZE ? int(i) : -1;
+			vrt_score[vrt] = getVertexScore(vrt_cache_pos[vrt], vrt_tris_left[vrt]);
+		}
+
+		// Update scores of triangles that touch the
+		// cache and pick the best one of them.
+		best_tri = NONE;
+		float best_score = -1;
+		for (unsigned i = 0; i < new_cache_size; ++ i) {
+			unsigned vrt = new_cache[i];
+			unsigned const* tris = vrt_tris.Buffer() + vrt_tris_begin[vrt];
+			for (unsigned j = 0; j < vrt_tris_left[vrt]; ++ j) {
+				unsigned tri = tris[j];
+				unsigned const* vrts = idxs + tri * 3;
+				float score = vrt_score[vrts[0]] + vrt_score[vrts[1]] + vrt_score[vrts[2]];
+				tri_score[tri] = score;
+				if (score > best_score) {
+					best_score = score;
+					best_tri = tri;
+				}
+			}
+		}
+
+		cache_size = Urho3D::Min(new_cache_size, CACHE_SIZE);
+		memcpy(cache, new_cache, sizeof(unsigned) * cache_size);
+	}
+
+	memcpy(idxs, result.Buffer(), sizeof(unsigned) * idxs_size);
+}
+
+unsigned optimizeVertexFetch(unsigned char* vrts, unsigned vrt_size, unsigned vrts_size, unsigned* idxs, unsigned idxs_size)
+{
+	Urho3D::PODVector<unsigned> remap;
+	remap.Resize(vrts_size);
+	for (unsigned i = 0; i < vrts_size; ++ i) {
+		remap[i] = NONE;
+	}
+
+	Urho3D::PODVector<unsigned char> new_vrts;
+	new_vrts.Resize(vrts_size * vrt_size);
+	unsigned new_vrts_size = 0;
+	for (unsigned i = 0; i < idxs_size; ++ i) {
+		unsigned& new_vrt = remap[idxs[i]];
+		if (new_vrt == NONE) {
+			new_vrt = new_vrts_size ++;
+			memcpy(new_vrts.Buffer() + new_vrt * vrt_size, vrts + idxs[i] * vrt_size, vrt_size);
+		}
+		idxs[i] = new_vrt;
+	}
+
+	memcpy(vrts, new_vrts.Buffer(), new_vrts_size * vrt_size);
+	return new_vrts_size;
+}
+
+unsigned simplifyMesh(unsigned* result, unsigned const* idxs, unsigned idxs_size, unsigned char const* vrts, unsigned vrt_size, unsigned pos_offset, unsigned vrts_size, unsigned target_idxs_size)
+{
+	assert(idxs_size % 3 == 0);
+	memcpy(result, idxs, sizeof(unsigned) * idxs_size);
+	if (idxs_size <= target_idxs_size) {
+		return idxs_size;
+	}
+
+	Urho3D::PODVector<Urho3D::Vector3> poss;
+	poss.Resize(vrts_size);
+	for (unsigned i = 0; i < vrts_size; ++ i) {
+		memcpy(&poss[i], vrts + i * vrt_size + pos_offset, sizeof(float) * 3);
+	}
+
+	// Vertices at the same position are handled as one, so input does not
+	// need to be welded. Simplification is done to triangles that use these
+	// position vertices, and "result" is kept in the same order with them.
+	Urho3D::PODVector<unsigned> vrt_pos;
+	vrt_pos.Resize(vrts_size);
+	{
+		Urho3D::PODVector<PositionKey> keys;
+		keys.Resize(vrts_size);
+		for (unsigned i = 0; i < vrts_size; ++ i) {
+			keys[i].pos = poss[i];
+			keys[i].vrt = i;
+		}
+		Urho3D::Sort(keys.Begin(), keys.End());
+		for (unsigned i = 0; i < vrts_size; ++ i) {
+			bool same = i > 0 && keys[i].pos == keys[i - 1].pos;
+			vrt_pos[keys[i].vrt] = same ? vrt_pos[keys[i - 1].vrt] : keys[i].vrt;
+		}
+	}
+	Urho3D::PODVector<unsigned> pos_idxs;
+	pos_idxs.Resize(idxs_size);
+	for (unsigned i = 0; i < idxs_size; ++ i) {
+		pos_idxs[i] = vrt_pos[idxs[i]];
+	}
+
+	// Quadrics of triangle planes, weighted by area. Open edges also get
+	// planes that are perpendicular to their triangle. These keep borders,
+	// like the outlines of grass cards, from moving inwards.
+	Urho3D::PODVector<unsigned long long> edges;
+	findEdges(edges, pos_idxs.Buffer(), idxs_size);
+	Urho3D::PODVector<Quadric> quadrics;
+	quadrics.Resize(vrts_size);
+	memset(quadrics.Buffer(), 0, sizeof(Quadric) * vrts_size);
+	for (unsigned i = 0; i < idxs_size; i += 3) {
+		Urho3D::Vector3 const& p0 = poss[pos_idxs[i]];
+		Urho3D::Vector3 n = (poss[pos_idxs[i + 1]] - p0).CrossProduct(poss[pos_idxs[i + 2]] - p0);
+		float n_len = n.Length();
+		if (n_len < Urho3D::M_EPSILON) {
+			continue;
+		}
+		n /= n_len;
+		float d = -n.DotProduct(p0);
+		for (unsigned j = 0; j < 3; ++ j) {
+			quadrics[pos_idxs[i + j]].addPlane(n, d, n_len * 0.5f);
+		}
+		for (unsigned j = 0; j < 3; ++ j) {
+			unsigned a = pos_idxs[i + j];
+			unsigned b = pos_idxs[i + (j + 1) % 3];
+			if (a == b || !isBorderEdge(edges, a, b)) {
+				continue;
+			}
+			Urho3D::Vector3 edge = poss[b] - poss[a];
+			Urho3D::Vector3 border_n = edge.CrossProduct(n);
+			float border_n_len = border_n.Length();
+			if (border_n_len < Urho3D::M_EPSILON) {
+				continue;
+			}
+			border_n /= border_n_len;
+			float border_d = -border_n.DotProduct(poss[a]);
+			float weight = BORDER_WEIGHT * edge.LengthSquared();
+			quadrics[a].addPlane(border_n, border_d, weight);
+			quadrics[b].addPlane(border_n, border_d, weight);
+		}
+	}
+
+	Urho3D::PODVector<unsigned> vrt_tris_begin;
+	Urho3D::PODVector<unsigned> vrt_tris_fill;
+	Urho3D::PODVector<unsigned> vrt_tris;
+	Urho3D::PODVector<unsigned char> vrt_border;
+	Urho3D::PODVector<unsigned> remap;
+	Urho3D::PODVector<unsigned> remap_to_vrt;
+	Urho3D::PODVector<unsigned> vrt_remap;
+	Urho3D::PODVector<unsigned char> vrt_touched;
+	Urho3D::PODVector<EdgeCollapse> collapses;
+	vrt_tris_begin.Resize(vrts_size + 1);
+	vrt_tris_fill.Resize(vrts_size);
+	vrt_border.Resize(vrts_size);
+	remap.Resize(vrts_size);
+	remap_to_vrt.Resize(vrts_size);
+	vrt_remap.Resize(vrts_size);
+	vrt_touched.Resize(vrts_size);
+
+	unsigned result_size = idxs_size;
+	while (result_size > target_idxs_size) {
+		// Triangles of every position vertex
+		for (unsigned i = 0; i <= vrts_size; ++ i) {
+			vrt_tris_begin[i] = 0;
+		}
+		for (unsigned i = 0; i < result_size; ++ i) {
+			++ vrt_tris_begin[pos_idxs[i] + 1];
+		}
+		for (unsigned i = 0; i < vrts_size; ++ i) {
+			vrt_tris_begin[i + 1] += vrt_tris_begin[i];
+		}
+		vrt_tris.Resize(result_size);
+		for (unsigned i = 0; i < vrts_size; ++ i) {
+			vrt_tris_fill[i] = vrt_tris_begin[i];
+		}
+		for (unsigned i = 0; i < result_size; ++ i) {
+			vrt_tris[vrt_tris_fill[pos_idxs[i]] ++] = i / 3;
+		}
+
+		// Vertices at open edges may only slide along them
+		findEdges(edges, pos_idxs.Buffer(), result_size);
+		for (unsigned i = 0; i < vrts_size; ++ i) {
+			vrt_border[i] = false;
+		}
+		for (unsigned long long edge : edges) {
+			unsigned a = unsigned(edge >> 32);
+			unsigned b = unsigned(edge & 0xffffffff);
+			if (isBorderEdge(edges, a, b)) {
+				vrt_border[a] = true;
+				vrt_border[b] = true;
+			}
+		}
+
+		// Every interior edge is found from both of its triangles, so
+		// both directions get considered. Open edges are found only
+		// once, so their other direction is added separately.
+		collapses.Clear();
+		for (unsigned i = 0; i < result_size; i += 3) {
+			for (unsigned j = 0; j < 3; ++ j) {
+				unsigned a = pos_idxs[i + j];
+				unsigned b = pos_idxs[i + (j + 1) % 3];
+				if (a == b) {
+					continue;
+				}
+				bool border_edge = isBorderEdge(edges, a, b);
+				for (unsigned dir = 0; dir < (border_edge ? 2 : 1); ++ dir) {
+					EdgeCollapse collapse;
+					collapse.from = dir == 0 ? a : b;
+					collapse.to = dir == 0 ? b : a;
+					collapse.to_vrt = result[i + (dir == 0 ? (j + 1) % 3 : j)];
+					if (vrt_border[collapse.from] && !border_edge) {
+						continue;
+					}
+					Quadric q = quadrics[collapse.from];
+					q.add(quadrics[collapse.to]);
+					collapse.error = q.getError(poss[collapse.to]);
+					collapses.Push(collapse);
+				}
+			}
+		}
+		if (collapses.Empty()) {
+			break;
+		}
+		Urho3D::Sort(collapses.Begin(), collapses.End());
+
+		// Every collapse removes about two triangles. Triangles around
+		// a collapse are not touched again during the same pass.
+		unsigned collapses_needed = (result_size - target_idxs_size) / 6 + 1;
+		unsigned collapses_done = 0;
+		for (unsigned i = 0; i < vrts_size; ++ i) {
+			remap[i] = i;
+			vrt_remap[i] = NONE;
+			vrt_touched[i] = false;
+		}
+		for (EdgeCollapse const& collapse : collapses) {
+			if (collapses_done >= collapses_needed) {
+				break;
+			}
+			if (vrt_touched[collapse.from] || vrt_touched[collapse.to]) {
+				continue;
+			}
+			unsigned const* tris = vrt_tris.Buffer() + vrt_tris_begin[collapse.from];
+			unsigned tris_size = vrt_tris_begin[collapse.from + 1] - vrt_tris_begin[collapse.from];
+			if (collapseFlipsTriangles(pos_idxs.Buffer(), tris, tris_size, poss, collapse.from, collapse.to)) {
+				continue;
+			}
+			remap[collapse.from] = collapse.to;
+			remap_to_vrt[collapse.from] = collapse.to_vrt;
+			quadrics[collapse.to].add(quadrics[collapse.from]);
+			for (unsigned j = 0; j < tris_size; ++ j) {
+				unsigned const* tri = pos_idxs.Buffer() + tris[j] * 3;
+				unsigned const* tri_vrts = result + tris[j] * 3;
+				vrt_touched[tri[0]] = true;
+				vrt_touched[tri[1]] = true;
+				vrt_touched[tri[2]] = true;
+				// Where possible, move vertex to the one at the
+				// other end of the edge, that has same attributes.
+				for (unsigned k = 0; k < 3; ++ k) {
+					if (tri[k] == collapse.from) {
+						for (unsigned l = 0; l < 3; ++ l) {
+							if (tri[l] == collapse.to) {
+								vrt_remap[tri_vrts[k]] = tri_vrts[l];
+							}
+						}
+					}
+				}
+			}
+			++ collapses_done;
+		}
+		if (collapses_done == 0) {
+			break;
+		}
+
+		// Apply collapses and remove degenerate triangles
+		unsigned new_result_size = 0;
+		for (unsigned i = 0; i < result_size; i += 3) {
+			unsigned a = remap[pos_idxs[i]];
+			unsigned b = remap[pos_idxs[i + 1]];
+			unsigned c = remap[pos_idxs[i + 2]];
+			if (a == b || b == c || c == a) {
+				continue;
+			}
+			for (unsigned j = 0; j < 3; ++ j) {
+				unsigned pos_vrt = pos_idxs[i + j];
+				unsigned vrt = result[i + j];
+				if (remap[pos_vrt] != pos_vrt) {
+					vrt = vrt_remap[vrt] != NONE ? vrt_remap[vrt] : remap_to_vrt[pos_vrt];
+				}
+				result[new_result_size + j] = vrt;
+			}
+			pos_idxs[new_result_size ++] = a;
+			pos_idxs[new_result_size ++] = b;
+			pos_idxs[new_result_size ++] = c;
+		}
+		result_size = new_result_size;
+	}
+
+	return result_size;
+}
+
+float calculateAcmr(unsigned const* idxs, unsigned idxs_size, unsigned vrts_size, unsigned cache_size)
+{
+	if (idxs_size < 3) {
+		return 0;
+	}
+
+	// Vertex is in FIFO cache if less than
+	// "cache_size" misses have happened after it.
+	Urho3D::PODVector<unsigned> vrt_miss_time;
+	vrt_miss_time.Resize(vrts_size);
+	for (unsigned i = 0; i < vrts_size; ++ i) {
+		vrt_miss_time[i] = NONE;
+	}
+	unsigned misses = 0;
+	for (unsigned i = 0; i < idxs_size; ++ i) {
+		unsigned& miss_time = vrt_miss_time[idxs[i]];
+		if (miss_time == NONE || misses - miss_time >= cache_size) {
+			miss_time = misses;
+			++ misses;
+		}
+	}
+
+	return float(misses) / (idxs_size / 3);
+}
+
+}
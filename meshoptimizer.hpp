@@ -0,0 +1,34 @@
+#ifndef URHOEXTRAS_MESHOPTIMIZER_HPP
+#define URHOEXTRAS_MESHOPTIMIZER_HPP
+
+namespace UrhoExtras
+{
+
+// Reorders triangles of an indexed triangle list, so that vertices are
+// reused while they are still in post-transform cache of GPU. This uses
+// the algorithm of Tom Forsyth, so it does not depend on the cache size.
+void optimizeVertexCache(unsigned* idxs, unsigned idxs_size, unsigned vrts_size);
+
+// Reorders vertices to the order they are first used by indices, and
+// updates indices. Unused vertices are removed. Returns the number of
+// vertices left. This should be done after optimizing vertex cache.
+unsigned optimizeVertexFetch(unsigned char* vrts, unsigned vrt_size, unsigned vrts_size, unsigned* idxs, unsigned idxs_size);
+
+// Simplifies triangle list by collapsing edges that cause the smallest
+// quadric error, until at most "target_idxs_size" indices are left or
+// nothing can be collapsed. Vertices with the same position are handled
+// as one, so input does not need to be welded. Vertices at open edges
+// only slide along them, so open meshes like grass cards get simplified
+// too. No vertices are created, so the result can share the
+// original vertex data. Positions are read as three floats at offset
+// "pos_offset". "result" must have room for "idxs_size" indices.
+// Returns the number of indices in the result.
+unsigned simplifyMesh(unsigned* result, unsigned const* idxs, unsigned idxs_size, unsigned char const* vrts, unsigned vrt_size, unsigned pos_offset, unsigned vrts_size, unsigned target_idxs_size);
+
+// Returns average cache miss ratio, which is the number of transformed
+// vertices per triangle, with FIFO cache of given size. Smaller is better.
+float calculateAcmr(unsigned const* idxs, unsigned idxs_size, unsigned vrts_size, unsigned cache_size = 16);
+
+}
+
+#endif
@@ -1,19 +1,50 @@
 #include "modelcombiner.hpp"
 
+#include "meshoptimizer.hpp"
+
 #include <Urho3D/Graphics/Geometry.h>
 #include <Urho3D/Graphics/IndexBuffer.h>
 #include <Urho3D/Graphics/VertexBuffer.h>
 #include <Urho3D/IO/Log.h>
+#include <Urho3D/Math/MathDefs.h>
+
+#ifdef URHO3D_SSE
+#include <xmmintrin.h>
+#endif
+
+#include <chrono>
+#include <cstring>
 
 namespace UrhoExtras
 {
 
+// Size of cells that are used for finding vertices to weld
+float const WELD_CELL_SIZE = 0.01f;
+
+unsigned const NO_VERTEX = Urho3D::M_MAX_UNSIGNED;
+
+// How many queue items are processed by a worker at once
+unsigned const BLOCK_SIZE = 64;
+
 ModelCombiner::ModelCombiner(Urho3D::Context* context) :
 Urho3D::Object(context),
+blocks_claimed(0),
+tasks_running(0),
 tri_add_mat(NULL),
 tri_add_vrt_size(0),
+welding(true),
+pack_normals(false),
+optimize_mesh(false),
+input_hash(14695981039346656037ull),
+cache_key(0),
+cache_checked(false),
 no_more_input_coming(false),
 give_up(false),
+indices_ready(false),
+upload_slice_size(0),
+upload_vbuf_i(0),
+upload_vrts_done(0),
+upload_idxs_done(0),
 finalized(false)
 {
 }
@@ -21,16 +52,22 @@ finalized(false)
 ModelCombiner::~ModelCombiner()
 {
 	give_up = true;
-	if (worker_wi.NotNull()) {
-		Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
-		if (!workqueue->RemoveWorkItem(worker_wi)) {
-			while (!worker_wi->completed_) {
+	Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+	for (Urho3D::SharedPtr<Urho3D::WorkItem> const& worker : workers) {
+		if (!workqueue->RemoveWorkItem(worker)) {
+			while (!worker->completed_) {
+			}
+		}
+	}
+	if (indices_wi.NotNull()) {
+		if (!workqueue->RemoveWorkItem(indices_wi)) {
+			while (!indices_wi->completed_) {
 			}
 		}
 	}
 }
 
-bool ModelCombiner::AddModel(Urho3D::Model const* model, Urho3D::Vector<Urho3D::Material*> const& mats, Urho3D::Matrix4 const& transf)
+bool ModelCombiner::AddModel(Urho3D::Model const* model, Urho3D::Vector<Urho3D::Material*> const& mats, Urho3D::Matrix3x4 const& transf)
 {
 	if (no_more_input_coming) {
 		URHO3D_LOGERROR("Unable to add models after using .ready()!");
@@ -38,35 +75,19 @@ bool ModelCombiner::AddModel(Urho3D::Model const* model, Urho3D::Vector<Urho3D::
 	}
 	assert(mats.Size() == model->GetNumGeometries());
 	for (unsigned geom_i = 0; geom_i < model->GetNumGeometries(); ++ geom_i) {
-		Urho3D::Geometry const* geom = model->GetGeometry(geom_i, 0);
-		Urho3D::Material* mat = mats[geom_i];
-
-		// Get raw data from Geometry
 		Urho3D::SharedPtr<QueueItem> qitem(new QueueItem);
-		unsigned char const* vbuf;
-		unsigned char const* ibuf;
-		Urho3D::PODVector<Urho3D::VertexElement> const* elems;
-		geom->GetRawData(vbuf, qitem->vrt_size, ibuf, qitem->idx_size, elems);
-		// Find what is the biggest used vertex
-		unsigned vbuf_size = 0;
-		for (unsigned i = geom->GetVertexStart(); i < geom->GetIndexStart() + geom->GetIndexCount(); ++ i) {
-			vbuf_size = Urho3D::Max<unsigned>(vbuf_size, GetIndex(ibuf, qitem->idx_size, i) + 1);
-		}
-		qitem->vbuf.Insert(qitem->vbuf.End(), vbuf, vbuf + vbuf_size * qitem->vrt_size);
-		qitem->ibuf.Insert(qitem->ibuf.End(), ibuf + qitem->idx_size * geom->GetIndexStart(), ibuf + qitem->idx_size * (geom->GetIndexStart() + geom->GetIndexCount()));
-		qitem->elems = *elems;
-		qitem->primitive_type = geom->GetPrimitiveType();
-		qitem->mat = mat;
+		qitem->src = GetOrCreateSourceGeometry(model->GetGeometry(geom_i, 0));
+		qitem->mat = mats[geom_i];
 		qitem->transf = transf;
 
-		{
-			Urho3D::MutexLock queue_lock(queue_mutex);
-			(void)queue_lock;
-			queue.Push(qitem);
-			qitem = NULL;
+		if (cache) {
+			Urho3D::Geometry const* geom = qitem->src->geom;
+			HashInput(&geom, sizeof(geom));
+			HashInput(&qitem->mat, sizeof(qitem->mat));
+			HashInput(transf.Data(), sizeof(float) * 12);
 		}
 
-		MakeSureTaskIsRunning();
+		PushToQueue(qitem);
 	}
 
 	return true;
@@ -106,26 +127,34 @@ bool ModelCombiner::AddTriangleData(unsigned char const* buf, unsigned buf_size)
 	// If all data was got
 	if (tri_add_buf.Size() == tri_add_vrt_size * 3) {
 		// Convert triangle data to QueueItem.
+		Urho3D::SharedPtr<SourceGeometry> src(new SourceGeometry);
+		src->vrt_size = tri_add_vrt_size;
+		src->vbuf.Swap(tri_add_buf);
+		src->ibuf.Reserve(2*3);
+		src->ibuf.Push(0); src->ibuf.Push(0);
+		src->ibuf.Push(1); src->ibuf.Push(0);
+		src->ibuf.Push(2); src->ibuf.Push(0);
+		src->idx_size = 2;
+		src->elems = tri_add_elems;
+		src->primitive_type = Urho3D::TRIANGLE_LIST;
+		srcs.Push(src);
+
 		Urho3D::SharedPtr<QueueItem> qitem(new QueueItem);
-		qitem->vrt_size = tri_add_vrt_size;
-		qitem->vbuf.Swap(tri_add_buf);
-		qitem->ibuf.Reserve(2*3);
-		qitem->ibuf.Push(0); qitem->ibuf.Push(0);
-		qitem->ibuf.Push(1); qitem->ibuf.Push(0);
-		qitem->ibuf.Push(2); qitem->ibuf.Push(0);
-		qitem->idx_size = 2;
-		qitem->elems = tri_add_elems;
-		qitem->primitive_type = Urho3D::TRIANGLE_LIST;
+		qitem->src = src;
 		qitem->mat = tri_add_mat;
 
-		{
-			Urho3D::MutexLock queue_lock(queue_mutex);
-			(void)queue_lock;
-			queue.Push(qitem);
-			qitem = NULL;
+		// Triangles are identified by their data
+		if (cache) {
+			for (Urho3D::VertexElement const& elem : src->elems) {
+				HashInput(&elem.type_, sizeof(elem.type_));
+				HashInput(&elem.semantic_, sizeof(elem.semantic_));
+				HashInput(&elem.index_, sizeof(elem.index_));
+			}
+			HashInput(&qitem->mat, sizeof(qitem->mat));
+			HashInput(src->vbuf.Buffer(), src->vbuf.Size());
 		}
 
-		MakeSureTaskIsRunning();
+		PushToQueue(qitem);
 
 		tri_add_vrt_size = 0;
 		assert(tri_add_buf.Empty());
@@ -133,6 +162,32 @@ bool ModelCombiner::AddTriangleData(unsigned char const* buf, unsigned buf_size)
 	return true;
 }
 
+bool ModelCombiner::AddLodLevel(float distance, float tris_ratio)
+{
+	if (!blocks.Empty() || tri_add_vrt_size) {
+		URHO3D_LOGERROR("LOD levels must be added before adding anything!");
+		return false;
+	}
+	if (lod_levels.Size() >= MAX_LOD_LEVELS) {
+		URHO3D_LOGERROR("Too many LOD levels!");
+		return false;
+	}
+	if (!lod_levels.Empty() && distance <= lod_levels.Back().distance) {
+		URHO3D_LOGERROR("LOD levels must be added in increasing distance!");
+		return false;
+	}
+	if (tris_ratio <= 0 || tris_ratio >= 1) {
+		URHO3D_LOGERROR("Ratio of triangles in LOD level must be between zero and one!");
+		return false;
+	}
+
+	LodLevel lod_level;
+	lod_level.distance = distance;
+	lod_level.tris_ratio = tris_ratio;
+	lod_levels.Push(lod_level);
+	return true;
+}
+
 bool ModelCombiner::Ready()
 {
 	// If already finalized
@@ -145,109 +200,113 @@ bool ModelCombiner::Ready()
 		return false;
 	}
 
-	// Mark that no other input is coming
-	no_more_input_coming = true;
+	if (UseCachedResult()) {
+		return true;
+	}
 
-	// Check if there is still unprocessed stuff in queue
+	// Mark that no other input is coming, and check
+	// if there are still unprocessed blocks in queue
+	bool blocks_unclaimed;
 	{
 		Urho3D::MutexLock queue_lock(queue_mutex);
 		(void)queue_lock;
-		if (!queue.Empty()) {
-			// There is still stuff to process, make
-			// sure task is running and try again later.
-			MakeSureTaskIsRunning();
+		no_more_input_coming = true;
+		blocks_unclaimed = blocks_claimed < blocks.Size();
+	}
+	if (blocks_unclaimed) {
+		// There is still stuff to process, make sure
+		// workers are running and try again later.
+		MakeSureWorkersAreRunning();
+		return false;
+	}
+	// Everything is claimed, but workers need to be waited too.
+	for (Urho3D::WorkItem* worker : workers) {
+		if (!worker->completed_) {
 			return false;
 		}
 	}
-	// Queue is empty, but worker unit needs to be waited too.
-	if (worker_wi && !worker_wi->completed_) {
+	workers.Clear();
+
+	// Merge blocks and convert indices to final format at background
+	if (!indices_ready) {
+		if (indices_wi.Null()) {
+			indices_wi = new Urho3D::WorkItem();
+			indices_wi->workFunction_ = IndicesWorker;
+			indices_wi->aux_ = this;
+			TaskStarted();
+			Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+			workqueue->AddWorkItem(indices_wi);
+		}
+		if (!indices_wi->completed_) {
+			return false;
+		}
+		indices_wi = NULL;
+		indices_ready = true;
+	}
+
+	// Upload buffers, possibly in multiple slices
+	if (!UploadBuffers()) {
 		return false;
 	}
 
 	// Discard previous possible incomplete results, just to be sure
 	mats.Clear();
 
-	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::IndexBuffer> > ibufs;
-	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::VertexBuffer> > vbufs;
-	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Geometry> > geoms;
-	for (RawVBuf const& raw_vbuf : raw_vbufs) {
-		// Create Vertexbuffer
-		Urho3D::SharedPtr<Urho3D::VertexBuffer> vbuf(new Urho3D::VertexBuffer(context_));
-		vbuf->SetShadowed(true);
-		assert(raw_vbuf.buf.Size() % raw_vbuf.vrt_size == 0);
-		if (!vbuf->SetSize(raw_vbuf.buf.Size() / raw_vbuf.vrt_size, raw_vbuf.elems)) {
-			URHO3D_LOGERROR("Unable to set vertexbuffer size!");
-			return false;
-		}
-		if (!vbuf->SetData(raw_vbuf.buf.Buffer())) {
-			URHO3D_LOGERROR("Unable to set vertexbuffer data!");
-			return false;
-		}
-		vbufs.Push(vbuf);
+	Urho3D::Vector<Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Geometry> > > geoms;
+	for (unsigned vbuf_i = 0; vbuf_i < raw_vbufs.Size(); ++ vbuf_i) {
+		RawVBuf const& raw_vbuf = raw_vbufs[vbuf_i];
 
-		// Create single indexbuffer
-		ByteBuf total_ibuf_bytes;
-		unsigned idx_size;
-		if (vbuf->GetVertexCount() <= 65536) {
-			idx_size = 2;
-			total_ibuf_bytes.Reserve(2 * vbuf->GetVertexCount());
-			for (IndexBufsByMaterial::ConstIterator tris_i = raw_vbuf.tris.Begin(); tris_i != raw_vbuf.tris.End(); ++ tris_i) {
-				for (unsigned i : tris_i->second_) {
-					unsigned short i2 = i;
-					total_ibuf_bytes.Insert(total_ibuf_bytes.End(), (unsigned char*)&i2, (unsigned char*)&i2 + 2);
-				}
-			}
-		} else {
-			idx_size = 4;
-			total_ibuf_bytes.Reserve(4 * vbuf->GetVertexCount());
-			for (IndexBufsByMaterial::ConstIterator tris_i = raw_vbuf.tris.Begin(); tris_i != raw_vbuf.tris.End(); ++ tris_i) {
-				for (unsigned i : tris_i->second_) {
-					total_ibuf_bytes.Insert(total_ibuf_bytes.End(), (unsigned char*)&i, (unsigned char*)&i + 4);
-				}
+		// Indices are stored level by level, so
+		// find where every level begins.
+		Urho3D::PODVector<unsigned> ibuf_ofss;
+		unsigned ibuf_ofs = 0;
+		for (unsigned lod_i = 0; lod_i <= raw_vbuf.lod_tris.Size(); ++ lod_i) {
+			ibuf_ofss.Push(ibuf_ofs);
+			IndexBufsByMaterial const& level_tris = lod_i == 0 ? raw_vbuf.tris : raw_vbuf.lod_tris[lod_i - 1];
+			for (IndexBufsByMaterial::ConstIterator tris_i = level_tris.Begin(); tris_i != level_tris.End(); ++ tris_i) {
+				ibuf_ofs += tris_i->second_.Size();
 			}
 		}
-		Urho3D::SharedPtr<Urho3D::IndexBuffer> ibuf(new Urho3D::IndexBuffer(context_));
-		ibuf->SetShadowed(true);
-		if (!ibuf->SetSize(total_ibuf_bytes.Size() / idx_size, idx_size == 4)) {
-			URHO3D_LOGERROR("Unable to set indexbuffer size!");
-			return false;
-		}
-		if (!ibuf->SetData(total_ibuf_bytes.Buffer())) {
-			URHO3D_LOGERROR("Unable to set indexbuffer data!");
-			return false;
-		}
-		ibufs.Push(ibuf);
 
 		// Create geometries
-		unsigned ibuf_ofs = 0;
 		for (IndexBufsByMaterial::ConstIterator tris_i = raw_vbuf.tris.Begin(); tris_i != raw_vbuf.tris.End(); ++ tris_i) {
 			Urho3D::Material* mat = tris_i->first_;
-			IndexBuf const& ibuf_raw = tris_i->second_;
 
-			Urho3D::SharedPtr<Urho3D::Geometry> geom(new Urho3D::Geometry(context_));
-			if (!geom->SetNumVertexBuffers(1)) {
-				URHO3D_LOGERROR("Unable to set number of vertexbuffers in geometry!");
-				return false;
-			}
-			if (!geom->SetVertexBuffer(0, vbuf)) {
-				URHO3D_LOGERROR("Unable to set geometry vertexbuffer!");
-				return false;
-			}
-			geom->SetIndexBuffer(ibuf);
-			if (!geom->SetDrawRange(Urho3D::TRIANGLE_LIST, ibuf_ofs, ibuf_raw.Size())) {
-				URHO3D_LOGERROR("Unable to set geometry drawing range!");
-				return false;
+			Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Geometry> > geom_lods;
+			for (unsigned lod_i = 0; lod_i <= raw_vbuf.lod_tris.Size(); ++ lod_i) {
+				IndexBuf const& ibuf_raw = lod_i == 0 ? tris_i->second_ : raw_vbuf.lod_tris[lod_i - 1].Find(mat)->second_;
+
+				Urho3D::SharedPtr<Urho3D::Geometry> geom(new Urho3D::Geometry(context_));
+				if (!geom->SetNumVertexBuffers(1)) {
+					URHO3D_LOGERROR("Unable to set number of vertexbuffers in geometry!");
+					return false;
+				}
+				if (!geom->SetVertexBuffer(0, vbufs[vbuf_i])) {
+					URHO3D_LOGERROR("Unable to set geometry vertexbuffer!");
+					return false;
+				}
+				geom->SetIndexBuffer(ibufs[vbuf_i]);
+				if (!geom->SetDrawRange(Urho3D::TRIANGLE_LIST, ibuf_ofss[lod_i], ibuf_raw.Size())) {
+					URHO3D_LOGERROR("Unable to set geometry drawing range!");
+					return false;
+				}
+				if (lod_i > 0) {
+					geom->SetLodDistance(lod_levels[lod_i - 1].distance);
+				}
+
+				geom_lods.Push(geom);
+
+				ibuf_ofss[lod_i] += ibuf_raw.Size();
 			}
 
-			geoms.Push(geom);
+			geoms.Push(geom_lods);
 			mats.Push(mat);
-
-			ibuf_ofs += ibuf_raw.Size();
 		}
 	}
 
 	// If this would result to empty model, then stop here
 	if (geoms.Empty()) {
+		StoreResultToCache();
 		finalized = true;
 		return true;
 	}
@@ -268,26 +327,193 @@ bool ModelCombiner::Ready()
 	}
 	model->SetNumGeometries(geoms.Size());
 	for (unsigned geom_i = 0; geom_i < geoms.Size(); ++ geom_i) {
-		if (!model->SetGeometry(geom_i, 0, geoms[geom_i])) {
-			URHO3D_LOGERROR("Unable to set geometry of model!");
+		if (!model->SetNumGeometryLodLevels(geom_i, geoms[geom_i].Size())) {
+			URHO3D_LOGERROR("Unable to set number of LOD levels of model!");
 			return false;
 		}
+		for (unsigned lod_i = 0; lod_i < geoms[geom_i].Size(); ++ lod_i) {
+			if (!model->SetGeometry(geom_i, lod_i, geoms[geom_i][lod_i])) {
+				URHO3D_LOGERROR("Unable to set geometry of model!");
+				return false;
+			}
+		}
 	}
 	model->SetBoundingBox(bb);
 
+	StoreResultToCache();
+
 	// Clean temporary data
+	srcs.Clear();
+	srcs_by_geom.Clear();
 	raw_vbufs.Clear();
+	vbufs.Clear();
+	ibufs.Clear();
 
 	finalized = true;
 
 	return true;
 }
 
+bool ModelCombiner::UploadBuffers()
+{
+	unsigned budget = upload_slice_size ? upload_slice_size : Urho3D::M_MAX_UNSIGNED;
+	// Every call must make progress, even if slice is smaller than elements
+	if (upload_vbuf_i < raw_vbufs.Size()) {
+		RawVBuf const& raw_vbuf = raw_vbufs[upload_vbuf_i];
+		budget = Urho3D::Max(budget, raw_vbuf.vrt_size + raw_vbuf.idx_size);
+	}
+
+	while (upload_vbuf_i < raw_vbufs.Size()) {
+		RawVBuf const& raw_vbuf = raw_vbufs[upload_vbuf_i];
+
+		// Create buffers
+		if (vbufs.Size() <= upload_vbuf_i) {
+			Urho3D::SharedPtr<Urho3D::VertexBuffer> vbuf(new Urho3D::VertexBuffer(context_));
+			vbuf->SetShadowed(true);
+			assert(raw_vbuf.buf.Size() % raw_vbuf.vrt_size == 0);
+			if (!vbuf->SetSize(raw_vbuf.buf.Size() / raw_vbuf.vrt_size, raw_vbuf.elems)) {
+				URHO3D_LOGERROR("Unable to set vertexbuffer size!");
+				return false;
+			}
+			vbufs.Push(vbuf);
+
+			Urho3D::SharedPtr<Urho3D::IndexBuffer> ibuf(new Urho3D::IndexBuffer(context_));
+			ibuf->SetShadowed(true);
+			if (!ibuf->SetSize(raw_vbuf.ibuf_bytes.Size() / raw_vbuf.idx_size, raw_vbuf.idx_size == 4)) {
+				URHO3D_LOGERROR("Unable to set indexbuffer size!");
+				return false;
+			}
+			ibufs.Push(ibuf);
+		}
+
+		// Upload vertices
+		Urho3D::VertexBuffer* vbuf = vbufs[upload_vbuf_i];
+		while (upload_vrts_done < vbuf->GetVertexCount()) {
+			if (budget < raw_vbuf.vrt_size) {
+				return false;
+			}
+			unsigned count = Urho3D::Min(vbuf->GetVertexCount() - upload_vrts_done, budget / raw_vbuf.vrt_size);
+			if (!vbuf->SetDataRange(raw_vbuf.buf.Buffer() + upload_vrts_done * raw_vbuf.vrt_size, upload_vrts_done, count)) {
+				URHO3D_LOGERROR("Unable to set vertexbuffer data!");
+				return false;
+			}
+			upload_vrts_done += count;
+			budget -= count * raw_vbuf.vrt_size;
+		}
+
+		// Upload indices
+		Urho3D::IndexBuffer* ibuf = ibufs[upload_vbuf_i];
+		while (upload_idxs_done < ibuf->GetIndexCount()) {
+			if (budget < raw_vbuf.idx_size) {
+				return false;
+			}
+			unsigned count = Urho3D::Min(ibuf->GetIndexCount() - upload_idxs_done, budget / raw_vbuf.idx_size);
+			if (!ibuf->SetDataRange(raw_vbuf.ibuf_bytes.Buffer() + upload_idxs_done * raw_vbuf.idx_size, upload_idxs_done, count)) {
+				URHO3D_LOGERROR("Unable to set indexbuffer data!");
+				return false;
+			}
+			upload_idxs_done += count;
+			budget -= count * raw_vbuf.idx_size;
+		}
+
+		++ upload_vbuf_i;
+		upload_vrts_done = 0;
+		upload_idxs_done = 0;
+	}
+
+	return true;
+}
+
 void ModelCombiner::FinalizeNow()
 {
-// TODO: Ask thread to stop and finalize in this thread!
-while (!Ready()) {
+	FinalizeNow(Urho3D::M_MAX_UNSIGNED);
 }
+
+bool ModelCombiner::FinalizeNow(unsigned timeout_msec)
+{
+	if (finalized) {
+		return true;
+	}
+
+	if (tri_add_vrt_size) {
+		URHO3D_LOGERROR("Unable to finalize because there is an incomplete triangle adding!");
+		return false;
+	}
+
+	if (UseCachedResult()) {
+		return true;
+	}
+
+	bool use_timeout = timeout_msec != Urho3D::M_MAX_UNSIGNED;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(use_timeout ? timeout_msec : 0);
+
+	{
+		Urho3D::MutexLock queue_lock(queue_mutex);
+		(void)queue_lock;
+		no_more_input_coming = true;
+	}
+
+	// Process remaining blocks in this thread, together with workers
+	while (!use_timeout || std::chrono::steady_clock::now() < deadline) {
+		Block* block = ClaimBlock();
+		if (!block) {
+			break;
+		}
+		if (!ProcessBlock(block)) {
+			return false;
+		}
+	}
+
+	// Tasks that have not started yet do not need to be waited
+	Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+	for (unsigned i = 0; i < workers.Size(); ) {
+		if (workqueue->RemoveWorkItem(workers[i])) {
+			TaskFinished();
+			workers.Erase(i);
+		} else {
+			++ i;
+		}
+	}
+	if (indices_wi.NotNull() && workqueue->RemoveWorkItem(indices_wi)) {
+		TaskFinished();
+		indices_wi = NULL;
+	}
+
+	// Wait for running tasks
+	{
+		std::unique_lock<std::mutex> tasks_lock(tasks_mutex);
+		if (!use_timeout) {
+			tasks_cond.wait(tasks_lock, [this] { return tasks_running == 0; });
+		} else if (!tasks_cond.wait_until(tasks_lock, deadline, [this] { return tasks_running == 0; })) {
+			return false;
+		}
+	}
+	workers.Clear();
+
+	// If there was timeout, some blocks might be still unprocessed
+	{
+		Urho3D::MutexLock queue_lock(queue_mutex);
+		(void)queue_lock;
+		if (blocks_claimed < blocks.Size()) {
+			return false;
+		}
+	}
+
+	if (!indices_ready) {
+		// If conversion was not running, then do it here
+		if (indices_wi.Null()) {
+			ConvertIndices();
+		}
+		indices_wi = NULL;
+		indices_ready = true;
+	}
+
+	// Upload everything at once
+	unsigned upload_slice_size_backup = upload_slice_size;
+	upload_slice_size = 0;
+	bool result = Ready();
+	upload_slice_size = upload_slice_size_backup;
+	return result;
 }
 
 Urho3D::Model* ModelCombiner::GetModel()
@@ -309,215 +535,713 @@ Urho3D::Material* ModelCombiner::GetMaterial(unsigned geom_i)
 	return mats[geom_i];
 }
 
-ModelCombiner::RawVBuf* ModelCombiner::GetOrCreateVertexbuffer(unsigned vrt_size, Urho3D::PODVector<Urho3D::VertexElement> const& elems)
+ModelCombiner::RawVBuf* ModelCombiner::GetOrCreateVertexbuffer(RawVBufs& raw_vbufs, unsigned src_vrt_size, Urho3D::PODVector<Urho3D::VertexElement> const& src_elems)
 {
 	for (RawVBuf& raw_vbuf : raw_vbufs) {
-		if (raw_vbuf.vrt_size == vrt_size && raw_vbuf.elems == elems) {
+		if (raw_vbuf.src_vrt_size == src_vrt_size && raw_vbuf.src_elems == src_elems) {
 			return &raw_vbuf;
 		}
 	}
 	RawVBuf new_raw_vbuf;
-	new_raw_vbuf.vrt_size = vrt_size;
-	new_raw_vbuf.elems = elems;
-	raw_vbufs.Push(new_raw_vbuf);
-	return &raw_vbufs.Back();
-}
+	new_raw_vbuf.src_vrt_size = src_vrt_size;
+	new_raw_vbuf.src_elems = src_elems;
+	new_raw_vbuf.elems_supported = true;
 
-int ModelCombiner::GetOrCreateVertexIndex(RawVBuf* raw_vbuf, unsigned char const* vrt_data, Urho3D::Matrix4 const& transf)
-{
-	// Apply transform to vertex data
-	ByteBuf vrt_data_transfd;
-	for (Urho3D::VertexElement const& elem : raw_vbuf->elems) {
-		if (elem.semantic_ == Urho3D::SEM_POSITION) {
-			if (elem.type_ == Urho3D::TYPE_VECTOR3) {
-				Urho3D::Vector3 pos((float*)(vrt_data + elem.offset_));
-				pos = transf * pos;
-				vrt_data_transfd.Insert(vrt_data_transfd.End(), (unsigned char*)pos.Data(), (unsigned char*)pos.Data() + sizeof(float) * 3);
-				bb.Merge(pos);
-			} else {
+	// Decide layout of combined vertices
+	new_raw_vbuf.elems = src_elems;
+	for (Urho3D::VertexElement& elem : new_raw_vbuf.elems) {
+		bool is_dir = elem.semantic_ == Urho3D::SEM_NORMAL || elem.semantic_ == Urho3D::SEM_BINORMAL || elem.semantic_ == Urho3D::SEM_TANGENT;
+		if (is_dir && pack_normals) {
+			elem.type_ = Urho3D::TYPE_UBYTE4_NORM;
+		}
+	}
+	Urho3D::VertexBuffer::UpdateOffsets(new_raw_vbuf.elems);
+	new_raw_vbuf.vrt_size = Urho3D::VertexBuffer::GetVertexSize(new_raw_vbuf.elems);
+
+	// Build the plan
+	new_raw_vbuf.pos_offset = -1;
+	for (unsigned i = 0; i < src_elems.Size(); ++ i) {
+		Urho3D::VertexElement const& src_elem = src_elems[i];
+		Urho3D::VertexElement const& dest_elem = new_raw_vbuf.elems[i];
+		TransformOp op;
+		op.src_type = src_elem.type_;
+		op.dest_type = dest_elem.type_;
+		op.src_offset = src_elem.offset_;
+		op.dest_offset = dest_elem.offset_;
+		op.size = Urho3D::ELEMENT_TYPESIZES[src_elem.type_];
+		if (src_elem.semantic_ == Urho3D::SEM_POSITION) {
+			if (src_elem.type_ != Urho3D::TYPE_VECTOR3) {
 				URHO3D_LOGERROR("For SEM_POSITION only TYPE_VECTOR3 is supported for now!");
-				return -1;
+				new_raw_vbuf.elems_supported = false;
+			} else if (new_raw_vbuf.pos_offset < 0) {
+				new_raw_vbuf.pos_offset = dest_elem.offset_;
 			}
-		} else if (elem.semantic_ == Urho3D::SEM_NORMAL || elem.semantic_ == Urho3D::SEM_BINORMAL || elem.semantic_ == Urho3D::SEM_TANGENT) {
-			if (elem.type_ == Urho3D::TYPE_VECTOR3) {
-				Urho3D::Vector3 vec((float*)(vrt_data + elem.offset_));
-				vec = transf.RotationMatrix() * vec;
-				vrt_data_transfd.Insert(vrt_data_transfd.End(), (unsigned char*)vec.Data(), (unsigned char*)vec.Data() + sizeof(float) * 3);
-			} else {
-				URHO3D_LOGERROR("For SEM_NORMAL, SEM_BINORMAL and SEM_TANGENT only TYPE_VECTOR3 is supported for now!");
-				return -1;
+			op.op = OP_POSITION;
+		} else if (src_elem.semantic_ == Urho3D::SEM_NORMAL || src_elem.semantic_ == Urho3D::SEM_BINORMAL || src_elem.semantic_ == Urho3D::SEM_TANGENT) {
+			if (src_elem.type_ != Urho3D::TYPE_VECTOR3 && src_elem.type_ != Urho3D::TYPE_VECTOR4 && src_elem.type_ != Urho3D::TYPE_UBYTE4_NORM) {
+				URHO3D_LOGERROR("For SEM_NORMAL, SEM_BINORMAL and SEM_TANGENT only TYPE_VECTOR3, TYPE_VECTOR4 and TYPE_UBYTE4_NORM are supported for now!");
+				new_raw_vbuf.elems_supported = false;
 			}
+			op.op = OP_DIRECTION;
+		} else if (src_elem.type_ > Urho3D::TYPE_UBYTE4_NORM) {
+			URHO3D_LOGERRORF("Unsupported element type(%i)!", src_elem.type_);
+			new_raw_vbuf.elems_supported = false;
+			op.op = OP_COPY;
 		} else {
-			unsigned elem_size;
-			switch (elem.type_) {
-			case Urho3D::TYPE_INT:
-				elem_size = sizeof(int);
-				break;
-			case Urho3D::TYPE_FLOAT:
-				elem_size = sizeof(float);
-				break;
-			case Urho3D::TYPE_VECTOR2:
-				elem_size = sizeof(float) * 2;
-				break;
-			case Urho3D::TYPE_VECTOR3:
-				elem_size = sizeof(float) * 3;
-				break;
-			case Urho3D::TYPE_VECTOR4:
-				elem_size = sizeof(float) * 4;
-				break;
-			default:
-				URHO3D_LOGERRORF("Unsupported element type(%i)!", elem.type_);
-				return -1;
-			}
-			vrt_data_transfd.Insert(vrt_data_transfd.End(), vrt_data + elem.offset_, vrt_data + elem.offset_ + elem_size);
-		}
-	}
-
-	// Go existing vertices through, and try to find a match
-	for (unsigned i = 0; i < raw_vbuf->buf.Size(); i += raw_vbuf->vrt_size) {
-		bool all_match = true;
-		for (Urho3D::VertexElement const& elem : raw_vbuf->elems) {
-			unsigned char const* ptr1 = raw_vbuf->buf.Buffer() + i + elem.offset_;
-			unsigned char const* ptr2 = vrt_data_transfd.Buffer() + elem.offset_;
-			switch (elem.type_) {
-			case Urho3D::TYPE_INT:
-			{
-				int i1 = *(int*)ptr1;
-				int i2 = *(int*)ptr2;
-				if (i1 != i2) all_match = false;
-				break;
-			}
-			case Urho3D::TYPE_FLOAT:
-			{
-				float f1 = *(float*)ptr1;
-				float f2 = *(float*)ptr2;
-				if (fabs(f1 - f2) > Urho3D::M_EPSILON) all_match = false;
-				break;
-			}
-			case Urho3D::TYPE_VECTOR2:
-			{
-				Urho3D::Vector2 v1((float*)ptr1);
-				Urho3D::Vector2 v2((float*)ptr2);
-				if ((v1 - v2).Length() > Urho3D::M_EPSILON) all_match = false;
-				break;
-			}
-			case Urho3D::TYPE_VECTOR3:
-			{
-				Urho3D::Vector3 v1((float*)ptr1);
-				Urho3D::Vector3 v2((float*)ptr2);
-				if ((v1 - v2).Length() > Urho3D::M_EPSILON) all_match = false;
-				break;
-			}
-			case Urho3D::TYPE_VECTOR4:
-			{
-				Urho3D::Vector4 v1((float*)ptr1);
-				Urho3D::Vector4 v2((float*)ptr2);
-				Urho3D::Vector4 diff = v1 - v2;
-				float len = sqrt(diff.x_*diff.x_ + diff.y_*diff.y_ + diff.z_*diff.z_ + diff.w_*diff.w_);
-				if (len > Urho3D::M_EPSILON) all_match = false;
-				break;
+			op.op = OP_COPY;
+		}
+		new_raw_vbuf.plan.Push(op);
+	}
+
+	raw_vbufs.Push(new_raw_vbuf);
+	return &raw_vbufs.Back();
+}
+
+ModelCombiner::SourceGeometry* ModelCombiner::GetOrCreateSourceGeometry(Urho3D::Geometry const* geom)
+{
+	SourceGeometriesByGeometry::Iterator srcs_find = srcs_by_geom.Find(geom);
+	if (srcs_find != srcs_by_geom.End()) {
+		return srcs_find->second_;
+	}
+
+	Urho3D::SharedPtr<SourceGeometry> src(new SourceGeometry);
+	src->geom = const_cast<Urho3D::Geometry*>(geom);
+	unsigned char const* vbuf;
+	unsigned char const* ibuf;
+	Urho3D::PODVector<Urho3D::VertexElement> const* elems;
+	geom->GetRawData(vbuf, src->vrt_size, ibuf, src->idx_size, elems);
+	// Find what is the biggest used vertex
+	unsigned vbuf_size = 0;
+	for (unsigned i = geom->GetIndexStart(); i < geom->GetIndexStart() + geom->GetIndexCount(); ++ i) {
+		vbuf_size = Urho3D::Max<unsigned>(vbuf_size, GetIndex(ibuf, src->idx_size, i) + 1);
+	}
+	src->vbuf.Insert(src->vbuf.End(), vbuf, vbuf + vbuf_size * src->vrt_size);
+	src->ibuf.Insert(src->ibuf.End(), ibuf + src->idx_size * geom->GetIndexStart(), ibuf + src->idx_size * (geom->GetIndexStart() + geom->GetIndexCount()));
+	src->elems = *elems;
+	src->primitive_type = geom->GetPrimitiveType();
+
+	srcs.Push(src);
+	srcs_by_geom[geom] = src;
+	return src;
+}
+
+void ModelCombiner::TransformVertices(ByteBuf& result, RawVBuf const* raw_vbuf, SourceGeometry const* src, Urho3D::Matrix3x4 const& transf)
+{
+	unsigned src_vrt_size = src->vrt_size;
+	unsigned dest_vrt_size = raw_vbuf->vrt_size;
+	unsigned vrts_size = src->vbuf.Size() / src_vrt_size;
+	result.Resize(vrts_size * dest_vrt_size);
+
+	Urho3D::Matrix3 rot = transf.RotationMatrix();
+
+#ifdef URHO3D_SSE
+	// Columns of matrices
+	__m128 const pos_c0 = _mm_set_ps(0, transf.m20_, transf.m10_, transf.m00_);
+	__m128 const pos_c1 = _mm_set_ps(0, transf.m21_, transf.m11_, transf.m01_);
+	__m128 const pos_c2 = _mm_set_ps(0, transf.m22_, transf.m12_, transf.m02_);
+	__m128 const pos_c3 = _mm_set_ps(0, transf.m23_, transf.m13_, transf.m03_);
+	__m128 const dir_c0 = _mm_set_ps(0, rot.m20_, rot.m10_, rot.m00_);
+	__m128 const dir_c1 = _mm_set_ps(0, rot.m21_, rot.m11_, rot.m01_);
+	__m128 const dir_c2 = _mm_set_ps(0, rot.m22_, rot.m12_, rot.m02_);
+	float out[4];
+#endif
+
+	for (TransformOp const& op : raw_vbuf->plan) {
+		unsigned char const* src_ptr = src->vbuf.Buffer() + op.src_offset;
+		unsigned char* dest_ptr = result.Buffer() + op.dest_offset;
+
+		if (op.op == OP_COPY) {
+			for (unsigned i = 0; i < vrts_size; ++ i, src_ptr += src_vrt_size, dest_ptr += dest_vrt_size) {
+				memcpy(dest_ptr, src_ptr, op.size);
 			}
-			default:
-				URHO3D_LOGERRORF("Unsupported element type(%i)!", elem.type_);
-				return -1;
+		} else if (op.op == OP_POSITION) {
+			for (unsigned i = 0; i < vrts_size; ++ i, src_ptr += src_vrt_size, dest_ptr += dest_vrt_size) {
+				float const* v = (float const*)src_ptr;
+#ifdef URHO3D_SSE
+				__m128 r = _mm_add_ps(_mm_mul_ps(pos_c0, _mm_set1_ps(v[0])), _mm_mul_ps(pos_c1, _mm_set1_ps(v[1])));
+				r = _mm_add_ps(r, _mm_add_ps(_mm_mul_ps(pos_c2, _mm_set1_ps(v[2])), pos_c3));
+				_mm_storeu_ps(out, r);
+				memcpy(dest_ptr, out, sizeof(float) * 3);
+#else
+				Urho3D::Vector3 pos = transf * Urho3D::Vector3(v);
+				memcpy(dest_ptr, pos.Data(), sizeof(float) * 3);
+#endif
 			}
-			if (!all_match) {
-				break;
+		}
+#ifdef URHO3D_SSE
+		// Fast path for unpacked directions
+		else if (op.src_type == op.dest_type && op.src_type != Urho3D::TYPE_UBYTE4_NORM) {
+			for (unsigned i = 0; i < vrts_size; ++ i, src_ptr += src_vrt_size, dest_ptr += dest_vrt_size) {
+				float const* v = (float const*)src_ptr;
+				__m128 r = _mm_add_ps(_mm_mul_ps(dir_c0, _mm_set1_ps(v[0])), _mm_mul_ps(dir_c1, _mm_set1_ps(v[1])));
+				r = _mm_add_ps(r, _mm_mul_ps(dir_c2, _mm_set1_ps(v[2])));
+				_mm_storeu_ps(out, r);
+				// Possible w of tangent is kept
+				memcpy(dest_ptr, src_ptr, op.size);
+				memcpy(dest_ptr, out, sizeof(float) * 3);
 			}
 		}
-		if (all_match) {
-			assert(i % raw_vbuf->vrt_size == 0);
-			return i / raw_vbuf->vrt_size;
+#endif
+		else {
+			for (unsigned i = 0; i < vrts_size; ++ i, src_ptr += src_vrt_size, dest_ptr += dest_vrt_size) {
+				// Unpack
+				Urho3D::Vector3 dir;
+				float w = 0;
+				if (op.src_type == Urho3D::TYPE_UBYTE4_NORM) {
+					dir = Urho3D::Vector3(src_ptr[0], src_ptr[1], src_ptr[2]) * (2.0f / 255) - Urho3D::Vector3::ONE;
+					w = src_ptr[3] * (2.0f / 255) - 1;
+				} else {
+					dir = Urho3D::Vector3((float const*)src_ptr);
+					if (op.src_type == Urho3D::TYPE_VECTOR4) {
+						w = ((float const*)src_ptr)[3];
+					}
+				}
+
+				dir = rot * dir;
+
+				// Pack
+				if (op.dest_type == Urho3D::TYPE_UBYTE4_NORM) {
+					dest_ptr[0] = Urho3D::Clamp(Urho3D::RoundToInt((dir.x_ + 1) * 127.5f), 0, 255);
+					dest_ptr[1] = Urho3D::Clamp(Urho3D::RoundToInt((dir.y_ + 1) * 127.5f), 0, 255);
+					dest_ptr[2] = Urho3D::Clamp(Urho3D::RoundToInt((dir.z_ + 1) * 127.5f), 0, 255);
+					dest_ptr[3] = Urho3D::Clamp(Urho3D::RoundToInt((w + 1) * 127.5f), 0, 255);
+				} else {
+					memcpy(dest_ptr, dir.Data(), sizeof(float) * 3);
+					if (op.dest_type == Urho3D::TYPE_VECTOR4) {
+						memcpy(dest_ptr + sizeof(float) * 3, &w, sizeof(float));
+					}
+				}
+			}
 		}
 	}
+}
 
-	// No matching vertex was found, so new one needs to be created
+unsigned ModelCombiner::GetOrCreateVertexIndex(RawVBuf* raw_vbuf, unsigned char const* vrt_data)
+{
 	assert(raw_vbuf->buf.Size() % raw_vbuf->vrt_size == 0);
 	unsigned result = raw_vbuf->buf.Size() / raw_vbuf->vrt_size;
-	raw_vbuf->buf.Insert(raw_vbuf->buf.End(), vrt_data_transfd.Begin(), vrt_data_transfd.End());
+
+	if (!welding) {
+		raw_vbuf->buf.Insert(raw_vbuf->buf.End(), vrt_data, vrt_data + raw_vbuf->vrt_size);
+		return result;
+	}
+
+	// Find cells where a matching vertex might be. If vertex is closer
+	// than epsilon to the border of its cell, neighbors are checked too.
+	int cell[3] = { 0, 0, 0 };
+	int cell_min[3] = { 0, 0, 0 };
+	int cell_max[3] = { 0, 0, 0 };
+	if (raw_vbuf->pos_offset >= 0) {
+		float const* pos = (float const*)(vrt_data + raw_vbuf->pos_offset);
+		for (unsigned axis = 0; axis < 3; ++ axis) {
+			cell[axis] = Urho3D::FloorToInt(pos[axis] / WELD_CELL_SIZE);
+			cell_min[axis] = Urho3D::FloorToInt((pos[axis] - Urho3D::M_EPSILON) / WELD_CELL_SIZE);
+			cell_max[axis] = Urho3D::FloorToInt((pos[axis] + Urho3D::M_EPSILON) / WELD_CELL_SIZE);
+		}
+	}
+
+	// Go vertices in those cells through, and try to find a match
+	for (int z = cell_min[2]; z <= cell_max[2]; ++ z) {
+		for (int y = cell_min[1]; y <= cell_max[1]; ++ y) {
+			for (int x = cell_min[0]; x <= cell_max[0]; ++ x) {
+				WeldBuckets::ConstIterator bucket_find = raw_vbuf->weld_buckets.Find(GetWeldBucketKey(x, y, z));
+				if (bucket_find == raw_vbuf->weld_buckets.End()) {
+					continue;
+				}
+				for (unsigned vrt_i = bucket_find->second_; vrt_i != NO_VERTEX; vrt_i = raw_vbuf->weld_next[vrt_i]) {
+					if (VerticesMatch(raw_vbuf->elems, raw_vbuf->buf.Buffer() + vrt_i * raw_vbuf->vrt_size, vrt_data)) {
+						return vrt_i;
+					}
+				}
+			}
+		}
+	}
+
+	// No matching vertex was found, so new one needs to be created
+	raw_vbuf->buf.Insert(raw_vbuf->buf.End(), vrt_data, vrt_data + raw_vbuf->vrt_size);
+
+	// Add it to the front of the bucket of its cell
+	unsigned key = GetWeldBucketKey(cell[0], cell[1], cell[2]);
+	WeldBuckets::Iterator bucket_find = raw_vbuf->weld_buckets.Find(key);
+	if (bucket_find == raw_vbuf->weld_buckets.End()) {
+		raw_vbuf->weld_next.Push(NO_VERTEX);
+		raw_vbuf->weld_buckets[key] = result;
+	} else {
+		raw_vbuf->weld_next.Push(bucket_find->second_);
+		bucket_find->second_ = result;
+	}
+	assert(raw_vbuf->weld_next.Size() == result + 1);
+
 	return result;
 }
 
-void ModelCombiner::AddTriangle(Urho3D::Material* mat, RawVBuf* raw_vbuf, unsigned vrt1, unsigned vrt2, unsigned vrt3)
+bool ModelCombiner::VerticesMatch(Urho3D::PODVector<Urho3D::VertexElement> const& elems, unsigned char const* vrt1, unsigned char const* vrt2)
 {
-	IndexBufsByMaterial::Iterator tris_find = raw_vbuf->tris.Find(mat);
-	if (tris_find == raw_vbuf->tris.End()) {
-		tris_find = raw_vbuf->tris.Insert(Urho3D::Pair<Urho3D::Material*, IndexBuf>(mat, IndexBuf()));
+	for (Urho3D::VertexElement const& elem : elems) {
+		unsigned char const* ptr1 = vrt1 + elem.offset_;
+		unsigned char const* ptr2 = vrt2 + elem.offset_;
+		switch (elem.type_) {
+		case Urho3D::TYPE_INT:
+		{
+			int i1 = *(int*)ptr1;
+			int i2 = *(int*)ptr2;
+			if (i1 != i2) return false;
+			break;
+		}
+		case Urho3D::TYPE_FLOAT:
+		{
+			float f1 = *(float*)ptr1;
+			float f2 = *(float*)ptr2;
+			if (fabs(f1 - f2) > Urho3D::M_EPSILON) return false;
+			break;
+		}
+		case Urho3D::TYPE_VECTOR2:
+		{
+			Urho3D::Vector2 v1((float*)ptr1);
+			Urho3D::Vector2 v2((float*)ptr2);
+			if ((v1 - v2).Length() > Urho3D::M_EPSILON) return false;
+			break;
+		}
+		case Urho3D::TYPE_VECTOR3:
+		{
+			Urho3D::Vector3 v1((float*)ptr1);
+			Urho3D::Vector3 v2((float*)ptr2);
+			if ((v1 - v2).Length() > Urho3D::M_EPSILON) return false;
+			break;
+		}
+		case Urho3D::TYPE_UBYTE4:
+		case Urho3D::TYPE_UBYTE4_NORM:
+			if (memcmp(ptr1, ptr2, 4) != 0) return false;
+			break;
+		case Urho3D::TYPE_VECTOR4:
+		{
+			Urho3D::Vector4 v1((float*)ptr1);
+			Urho3D::Vector4 v2((float*)ptr2);
+			Urho3D::Vector4 diff = v1 - v2;
+			float len = sqrt(diff.x_*diff.x_ + diff.y_*diff.y_ + diff.z_*diff.z_ + diff.w_*diff.w_);
+			if (len > Urho3D::M_EPSILON) return false;
+			break;
+		}
+		default:
+			// Types are validated when vertex is transformed
+			assert(false);
+			return false;
+		}
 	}
-	IndexBuf& ibuf = tris_find->second_;
-	ibuf.Push(vrt1);
-	ibuf.Push(vrt2);
-	ibuf.Push(vrt3);
+	return true;
 }
 
-void ModelCombiner::MakeSureTaskIsRunning()
+void ModelCombiner::HashInput(void const* data, unsigned size)
 {
-	if (worker_wi.Null() || worker_wi->completed_) {
-		worker_wi = new Urho3D::WorkItem();
-		worker_wi->workFunction_ = Worker;
-		worker_wi->aux_ = this;
-		Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
-		workqueue->AddWorkItem(worker_wi);
+	// FNV-1a
+	unsigned char const* bytes = (unsigned char const*)data;
+	for (unsigned i = 0; i < size; ++ i) {
+		input_hash = (input_hash ^ bytes[i]) * 1099511628211ull;
 	}
 }
 
-void ModelCombiner::Worker(Urho3D::WorkItem const* wi, unsigned thread_i)
+bool ModelCombiner::UseCachedResult()
 {
-	(void)thread_i;
-	ModelCombiner* combiner = (ModelCombiner*)wi->aux_;
+	if (cache.Null() || cache_checked) {
+		return false;
+	}
+	cache_checked = true;
 
-	// Loop as long as there is stuff in the
-	// queue or until giving up is requested.
-	while (!combiner->give_up) {
+	// Options affect the result too
+	HashInput(&welding, sizeof(welding));
+	HashInput(&pack_normals, sizeof(pack_normals));
+	HashInput(&optimize_mesh, sizeof(optimize_mesh));
+	for (LodLevel const& lod_level : lod_levels) {
+		HashInput(&lod_level.distance, sizeof(lod_level.distance));
+		HashInput(&lod_level.tris_ratio, sizeof(lod_level.tris_ratio));
+	}
+	cache_key = input_hash;
 
-		// Pick one item from the queue,
-		// or leave if queue is empty.
-		Urho3D::SharedPtr<QueueItem> qitem;
-		{
-			Urho3D::MutexLock queue_lock(combiner->queue_mutex);
-			(void)queue_lock;
-			if (combiner->queue.Empty()) {
-				return;
+	if (!cache->Get(model, mats, cache_key)) {
+		return false;
+	}
+
+	// No workers have been started, so input can be dropped
+	blocks.Clear();
+	srcs.Clear();
+	srcs_by_geom.Clear();
+	finalized = true;
+	return true;
+}
+
+void ModelCombiner::StoreResultToCache()
+{
+	if (cache.Null()) {
+		return;
+	}
+
+	unsigned memory = 0;
+	for (RawVBuf const& raw_vbuf : raw_vbufs) {
+		memory += raw_vbuf.buf.Size() + raw_vbuf.ibuf_bytes.Size();
+	}
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Geometry> > src_geoms;
+	for (SourceGeometry const* src : srcs) {
+		if (src->geom) {
+			src_geoms.Push(src->geom);
+		}
+	}
+	cache->Store(cache_key, model, mats, src_geoms, memory);
+}
+
+void ModelCombiner::PushToQueue(Urho3D::SharedPtr<QueueItem> qitem)
+{
+	bool block_full;
+	{
+		Urho3D::MutexLock queue_lock(queue_mutex);
+		(void)queue_lock;
+		// Claimed block may be processed already, so it must not get more items
+		if (blocks.Empty() || blocks_claimed == blocks.Size() || blocks.Back()->items.Size() >= BLOCK_SIZE) {
+			blocks.Push(Urho3D::SharedPtr<Block>(new Block));
+		}
+		blocks.Back()->items.Push(qitem);
+		block_full = blocks.Back()->items.Size() == BLOCK_SIZE;
+	}
+
+	// Only full blocks can be processed before Ready() is called.
+	// With cache, nothing is processed before it has been checked.
+	if (block_full && cache.Null()) {
+		MakeSureWorkersAreRunning();
+	}
+}
+
+unsigned ModelCombiner::GetNumClaimableBlocks() const
+{
+	unsigned result = blocks.Size() - blocks_claimed;
+	if (result > 0 && !no_more_input_coming && blocks.Back()->items.Size() < BLOCK_SIZE) {
+		-- result;
+	}
+	return result;
+}
+
+ModelCombiner::Block* ModelCombiner::ClaimBlock()
+{
+	Urho3D::MutexLock queue_lock(queue_mutex);
+	(void)queue_lock;
+	if (GetNumClaimableBlocks() == 0) {
+		return NULL;
+	}
+	return blocks[blocks_claimed ++];
+}
+
+void ModelCombiner::MakeSureWorkersAreRunning()
+{
+	// Forget workers that have stopped
+	for (unsigned i = 0; i < workers.Size(); ) {
+		if (workers[i]->completed_) {
+			workers.Erase(i);
+		} else {
+			++ i;
+		}
+	}
+
+	unsigned blocks_claimable;
+	{
+		Urho3D::MutexLock queue_lock(queue_mutex);
+		(void)queue_lock;
+		blocks_claimable = GetNumClaimableBlocks();
+	}
+
+	// Use all threads, but do not start more
+	// workers than there are blocks to process.
+	Urho3D::WorkQueue* workqueue = GetSubsystem<Urho3D::WorkQueue>();
+	unsigned max_workers = Urho3D::Max(workqueue->GetNumThreads(), 1u);
+	while (workers.Size() < max_workers && workers.Size() < blocks_claimable) {
+		Urho3D::SharedPtr<Urho3D::WorkItem> worker(new Urho3D::WorkItem());
+		worker->workFunction_ = Worker;
+		worker->aux_ = this;
+		TaskStarted();
+		workqueue->AddWorkItem(worker);
+		workers.Push(worker);
+	}
+}
+
+void ModelCombiner::TaskStarted()
+{
+	std::lock_guard<std::mutex> tasks_lock(tasks_mutex);
+	++ tasks_running;
+}
+
+void ModelCombiner::TaskFinished()
+{
+	// Notify while locked, so waiting thread cannot
+	// destroy ModelCombiner before this returns.
+	std::lock_guard<std::mutex> tasks_lock(tasks_mutex);
+	assert(tasks_running > 0);
+	-- tasks_running;
+	tasks_cond.notify_all();
+}
+
+void ModelCombiner::ProcessBlocks()
+{
+	// Loop as long as there are blocks to
+	// claim or until giving up is requested.
+	while (!give_up) {
+		Block* block = ClaimBlock();
+		if (!block) {
+			return;
+		}
+		if (!ProcessBlock(block)) {
+			return;
+		}
+	}
+}
+
+bool ModelCombiner::ProcessBlock(Block* block)
+{
+	for (unsigned i = 0; i < block->items.Size(); ++ i) {
+		if (!ProcessQueueItem(block, block->items[i])) {
+			return false;
+		}
+	}
+	// Items are not cleared here, because the main thread reads
+	// them while holding the mutex. They are freed with the block.
+	return true;
+}
+
+bool ModelCombiner::ProcessQueueItem(Block* block, QueueItem const* qitem)
+{
+	SourceGeometry const* src = qitem->src;
+
+	RawVBuf* raw_vbuf = GetOrCreateVertexbuffer(block->raw_vbufs, src->vrt_size, src->elems);
+	assert(raw_vbuf->src_vrt_size == src->vrt_size);
+	if (!raw_vbuf->elems_supported) {
+		return false;
+	}
+
+	if (src->primitive_type != Urho3D::TRIANGLE_LIST) {
+		URHO3D_LOGERROR("ModelCombiner only supports TRIANGLE_LIST for now!");
+		return false;
+	}
+
+	TransformVertices(block->vrts_transfd, raw_vbuf, src, qitem->transf);
+
+	// Source vertices are mapped to target vertices when they are first used
+	unsigned vrts_size = src->vbuf.Size() / src->vrt_size;
+	block->vrts_map.Resize(vrts_size);
+	for (unsigned i = 0; i < vrts_size; ++ i) {
+		block->vrts_map[i] = NO_VERTEX;
+	}
+
+	// Make room for the case where nothing is welded
+	unsigned idxs_size = src->ibuf.Size() / src->idx_size;
+	ByteBuf& vbuf = raw_vbuf->buf;
+	unsigned vbuf_needed = vbuf.Size() + vrts_size * raw_vbuf->vrt_size;
+	if (vbuf.Capacity() < vbuf_needed) {
+		vbuf.Reserve(Urho3D::Max(vbuf_needed, vbuf.Capacity() * 2));
+	}
+	IndexBuf& ibuf = raw_vbuf->tris[qitem->mat];
+	if (ibuf.Capacity() < ibuf.Size() + idxs_size) {
+		ibuf.Reserve(Urho3D::Max(ibuf.Size() + idxs_size, ibuf.Capacity() * 2));
+	}
+
+	for (unsigned i = 0; i < idxs_size; ++ i) {
+		// Check if worker should give up
+		if (give_up) {
+			return false;
+		}
+		unsigned src_vrt_i = GetIndex(src->ibuf.Buffer(), src->idx_size, i);
+		unsigned& vrt_i = block->vrts_map[src_vrt_i];
+		if (vrt_i == NO_VERTEX) {
+			unsigned char const* vrt_data = block->vrts_transfd.Buffer() + raw_vbuf->vrt_size * src_vrt_i;
+			vrt_i = GetOrCreateVertexIndex(raw_vbuf, vrt_data);
+			if (raw_vbuf->pos_offset >= 0) {
+				block->bb.Merge(Urho3D::Vector3((float const*)(vrt_data + raw_vbuf->pos_offset)));
 			}
-			qitem = combiner->queue.Back();
-			combiner->queue.Pop();
 		}
+		ibuf.Push(vrt_i);
+	}
 
-		RawVBuf* raw_vbuf = combiner->GetOrCreateVertexbuffer(qitem->vrt_size, qitem->elems);
+	return true;
+}
 
-		if (qitem->primitive_type == Urho3D::TRIANGLE_LIST) {
-			IndexCache index_cache;
-			unsigned index_end = 0 + qitem->ibuf.Size() / qitem->idx_size;
-			for (unsigned i = 0; i < index_end; i += 3) {
-				// Check if worker should give up
-				if (combiner->give_up) {
-					return;
+void ModelCombiner::MergeBlocks()
+{
+	// Reserve final buffers first
+	for (Block* block : blocks) {
+		for (RawVBuf& src : block->raw_vbufs) {
+			RawVBuf* dest = GetOrCreateVertexbuffer(raw_vbufs, src.src_vrt_size, src.src_elems);
+			dest->buf.Reserve(dest->buf.Capacity() + src.buf.Size());
+		}
+	}
+
+	Urho3D::PODVector<unsigned> vrts_remap;
+	for (Block* block : blocks) {
+		bb.Merge(block->bb);
+		for (RawVBuf& src : block->raw_vbufs) {
+			RawVBuf* dest = GetOrCreateVertexbuffer(raw_vbufs, src.src_vrt_size, src.src_elems);
+			assert(dest->buf.Size() % dest->vrt_size == 0);
+			assert(src.buf.Size() % src.vrt_size == 0);
+			unsigned src_vrts_size = src.buf.Size() / src.vrt_size;
+			vrts_remap.Resize(src_vrts_size);
+			// Vertices of a block are already welded, but they may match
+			// vertices of earlier blocks, so weld them again. The first
+			// block can be taken as it is, together with its buckets.
+			if (welding && !dest->buf.Empty()) {
+				for (unsigned i = 0; i < src_vrts_size; ++ i) {
+					vrts_remap[i] = GetOrCreateVertexIndex(dest, src.buf.Buffer() + i * src.vrt_size);
+				}
+			} else {
+				unsigned vrts_base = dest->buf.Size() / dest->vrt_size;
+				if (welding) {
+					dest->weld_buckets.Swap(src.weld_buckets);
+					dest->weld_next.Swap(src.weld_next);
 				}
-				// Get indices in source model
-				int vrt_i1 = GetIndex(qitem->ibuf.Buffer(), qitem->idx_size, i);
-				int vrt_i2 = GetIndex(qitem->ibuf.Buffer(), qitem->idx_size, i + 1);
-				int vrt_i3 = GetIndex(qitem->ibuf.Buffer(), qitem->idx_size, i + 2);
-				// Convert to indices in target model. Use cache to speed up
-				IndexCache::ConstIterator index_cache_find = index_cache.Find(vrt_i1);
-				if (index_cache_find != index_cache.End()) vrt_i1 = index_cache_find->second_;
-				else vrt_i1 = index_cache[vrt_i1] = combiner->GetOrCreateVertexIndex(raw_vbuf, qitem->vbuf.Buffer() + qitem->vrt_size * vrt_i1, qitem->transf);
-				index_cache_find = index_cache.Find(vrt_i2);
-				if (index_cache_find != index_cache.End()) vrt_i2 = index_cache_find->second_;
-				else vrt_i2 = index_cache[vrt_i2] = combiner->GetOrCreateVertexIndex(raw_vbuf, qitem->vbuf.Buffer() + qitem->vrt_size * vrt_i2, qitem->transf);
-				index_cache_find = index_cache.Find(vrt_i3);
-				if (index_cache_find != index_cache.End()) vrt_i3 = index_cache_find->second_;
-				else vrt_i3 = index_cache[vrt_i3] = combiner->GetOrCreateVertexIndex(raw_vbuf, qitem->vbuf.Buffer() + qitem->vrt_size * vrt_i3, qitem->transf);
-				// If there was errors.
-				if (vrt_i1 < 0 || vrt_i2 < 0 || vrt_i3 < 0) {
-					return;
+				dest->buf.Insert(dest->buf.End(), src.buf.Begin(), src.buf.End());
+				for (unsigned i = 0; i < src_vrts_size; ++ i) {
+					vrts_remap[i] = vrts_base + i;
 				}
-				combiner->AddTriangle(qitem->mat, raw_vbuf, vrt_i1, vrt_i2, vrt_i3);
 			}
-		} else {
-			URHO3D_LOGERROR("ModelCombiner only supports TRIANGLE_LIST for now!");
+			for (IndexBufsByMaterial::ConstIterator tris_i = src.tris.Begin(); tris_i != src.tris.End(); ++ tris_i) {
+				IndexBuf& dest_ibuf = dest->tris[tris_i->first_];
+				dest_ibuf.Reserve(dest_ibuf.Size() + tris_i->second_.Size());
+				for (unsigned i : tris_i->second_) {
+					dest_ibuf.Push(vrts_remap[i]);
+				}
+			}
+		}
+	}
+	blocks.Clear();
+	blocks_claimed = 0;
+}
+
+void ModelCombiner::GenerateLodLevels(RawVBuf& raw_vbuf)
+{
+	unsigned vrts_size = raw_vbuf.buf.Size() / raw_vbuf.vrt_size;
+
+	raw_vbuf.lod_tris.Clear();
+	raw_vbuf.lod_tris.Resize(lod_levels.Size());
+	for (IndexBufsByMaterial::ConstIterator tris_i = raw_vbuf.tris.Begin(); tris_i != raw_vbuf.tris.End(); ++ tris_i) {
+		IndexBuf const& idxs = tris_i->second_;
+		// Every level is simplified from the previous one
+		IndexBuf const* prev_idxs = &idxs;
+		for (unsigned lod_i = 0; lod_i < lod_levels.Size(); ++ lod_i) {
+			IndexBuf& lod_idxs = raw_vbuf.lod_tris[lod_i][tris_i->first_];
+			// Without positions, full detail is used
+			if (raw_vbuf.pos_offset < 0) {
+				lod_idxs = idxs;
+				continue;
+			}
+			unsigned target_size = unsigned(idxs.Size() / 3 * lod_levels[lod_i].tris_ratio) * 3;
+			lod_idxs.Resize(prev_idxs->Size());
+			unsigned size = simplifyMesh(lod_idxs.Buffer(), prev_idxs->Buffer(), prev_idxs->Size(), raw_vbuf.buf.Buffer(), raw_vbuf.vrt_size, raw_vbuf.pos_offset, vrts_size, target_size);
+			lod_idxs.Resize(size);
+			prev_idxs = &lod_idxs;
+		}
+	}
+}
+
+void ModelCombiner::OptimizeMesh(RawVBuf& raw_vbuf)
+{
+	unsigned vrts_size = raw_vbuf.buf.Size() / raw_vbuf.vrt_size;
+
+	// Vertex fetch is optimized over all materials and
+	// levels, so gather indices to the order they are stored.
+	IndexBuf all_idxs;
+	float acmr_before = 0;
+	for (unsigned lod_i = 0; lod_i <= raw_vbuf.lod_tris.Size(); ++ lod_i) {
+		IndexBufsByMaterial& level_tris = lod_i == 0 ? raw_vbuf.tris : raw_vbuf.lod_tris[lod_i - 1];
+		for (IndexBufsByMaterial::Iterator tris_i = level_tris.Begin(); tris_i != level_tris.End(); ++ tris_i) {
+			IndexBuf& idxs = tris_i->second_;
+			acmr_before += calculateAcmr(idxs.Buffer(), idxs.Size(), vrts_size) * idxs.Size();
+			optimizeVertexCache(idxs.Buffer(), idxs.Size(), vrts_size);
+			all_idxs += idxs;
+		}
+	}
+	if (all_idxs.Empty()) {
+		return;
+	}
+	acmr_before /= all_idxs.Size();
+
+	vrts_size = optimizeVertexFetch(raw_vbuf.buf.Buffer(), raw_vbuf.vrt_size, vrts_size, all_idxs.Buffer(), all_idxs.Size());
+	raw_vbuf.buf.Resize(vrts_size * raw_vbuf.vrt_size);
+
+	unsigned const* all_idxs_it = all_idxs.Buffer();
+	for (unsigned lod_i = 0; lod_i <= raw_vbuf.lod_tris.Size(); ++ lod_i) {
+		IndexBufsByMaterial& level_tris = lod_i == 0 ? raw_vbuf.tris : raw_vbuf.lod_tris[lod_i - 1];
+		for (IndexBufsByMaterial::Iterator tris_i = level_tris.Begin(); tris_i != level_tris.End(); ++ tris_i) {
+			IndexBuf& idxs = tris_i->second_;
+			memcpy(idxs.Buffer(), all_idxs_it, sizeof(unsigned) * idxs.Size());
+			all_idxs_it += idxs.Size();
+		}
+	}
+
+	URHO3D_LOGDEBUGF("Optimized combined mesh, ACMR %.3f -> %.3f", acmr_before, calculateAcmr(all_idxs.Buffer(), all_idxs.Size(), vrts_size));
+}
+
+void ModelCombiner::ConvertIndices()
+{
+	MergeBlocks();
+
+	// Create single indexbuffer for every vertexbuffer
+	for (RawVBuf& raw_vbuf : raw_vbufs) {
+		if (give_up) {
 			return;
 		}
+		GenerateLodLevels(raw_vbuf);
+		if (optimize_mesh) {
+			OptimizeMesh(raw_vbuf);
+		}
+
+		// All levels, in the order they are stored
+		Urho3D::PODVector<IndexBufsByMaterial const*> levels_tris;
+		levels_tris.Push(&raw_vbuf.tris);
+		for (IndexBufsByMaterial const& lod_tris : raw_vbuf.lod_tris) {
+			levels_tris.Push(&lod_tris);
+		}
+
+		unsigned vrts_size = raw_vbuf.buf.Size() / raw_vbuf.vrt_size;
+		unsigned idxs_size = 0;
+		for (IndexBufsByMaterial const* level_tris : levels_tris) {
+			for (IndexBufsByMaterial::ConstIterator tris_i = level_tris->Begin(); tris_i != level_tris->End(); ++ tris_i) {
+				idxs_size += tris_i->second_.Size();
+			}
+		}
+		raw_vbuf.ibuf_bytes.Clear();
+		if (vrts_size <= 65536) {
+			raw_vbuf.idx_size = 2;
+			raw_vbuf.ibuf_bytes.Resize(2 * idxs_size);
+			unsigned short* idxs = (unsigned short*)raw_vbuf.ibuf_bytes.Buffer();
+			for (IndexBufsByMaterial const* level_tris : levels_tris) {
+				for (IndexBufsByMaterial::ConstIterator tris_i = level_tris->Begin(); tris_i != level_tris->End(); ++ tris_i) {
+					for (unsigned i : tris_i->second_) {
+						*(idxs ++) = i;
+					}
+				}
+			}
+		} else {
+			raw_vbuf.idx_size = 4;
+			raw_vbuf.ibuf_bytes.Resize(4 * idxs_size);
+			unsigned* idxs = (unsigned*)raw_vbuf.ibuf_bytes.Buffer();
+			for (IndexBufsByMaterial const* level_tris : levels_tris) {
+				for (IndexBufsByMaterial::ConstIterator tris_i = level_tris->Begin(); tris_i != level_tris->End(); ++ tris_i) {
+					for (unsigned i : tris_i->second_) {
+						*(idxs ++) = i;
+					}
+				}
+			}
+		}
 	}
 }
 
+void ModelCombiner::IndicesWorker(Urho3D::WorkItem const* wi, unsigned thread_i)
+{
+	(void)thread_i;
+	ModelCombiner* combiner = (ModelCombiner*)wi->aux_;
+	combiner->ConvertIndices();
+	combiner->TaskFinished();
+}
+
+void ModelCombiner::Worker(Urho3D::WorkItem const* wi, unsigned thread_i)
+{
+	(void)thread_i;
+	ModelCombiner* combiner = (ModelCombiner*)wi->aux_;
+	combiner->ProcessBlocks();
+	combiner->TaskFinished();
+}
+
 }
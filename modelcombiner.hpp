@@ -1,15 +1,25 @@
 #ifndef URHOEXTRAS_MODELCOMBINER_HPP
 #define URHOEXTRAS_MODELCOMBINER_HPP
 
+#include "modelcombinercache.hpp"
+
+#include <Urho3D/Container/HashMap.h>
 #include <Urho3D/Container/Vector.h>
 #include <Urho3D/Core/Mutex.h>
 #include <Urho3D/Core/WorkQueue.h>
+#include <Urho3D/Graphics/Geometry.h>
+#include <Urho3D/Graphics/IndexBuffer.h>
 #include <Urho3D/Graphics/Material.h>
 #include <Urho3D/Graphics/Model.h>
+#include <Urho3D/Graphics/VertexBuffer.h>
+#include <Urho3D/Math/Matrix3x4.h>
 #include <Urho3D/Math/Matrix4.h>
 #include <Urho3D/Math/Quaternion.h>
 #include <Urho3D/Math/Vector3.h>
 
+#include <condition_variable>
+#include <mutex>
+
 namespace UrhoExtras
 {
 
@@ -24,13 +34,10 @@ public:
 
 	inline bool AddModel(Urho3D::Model const* model, Urho3D::Material* mat, Urho3D::Vector3 const& pos, Urho3D::Quaternion const& rot)
 	{
-		Urho3D::Matrix4 transf;
-		transf.SetTranslation(pos);
-		transf.SetRotation(rot.RotationMatrix());
-		return AddModel(model, mat, transf);
+		return AddModel(model, mat, Urho3D::Matrix3x4(pos, rot, 1.0f));
 	}
 
-	inline bool AddModel(Urho3D::Model const* model, Urho3D::Material* mat, Urho3D::Matrix4 const& transf)
+	inline bool AddModel(Urho3D::Model const* model, Urho3D::Material* mat, Urho3D::Matrix3x4 const& transf)
 	{
 		Urho3D::Vector<Urho3D::Material*> mats;
 		mats.Reserve(model->GetNumGeometries());
@@ -40,7 +47,19 @@ public:
 		return AddModel(model, mats, transf);
 	}
 
-	bool AddModel(Urho3D::Model const* model, Urho3D::Vector<Urho3D::Material*> const& mats, Urho3D::Matrix4 const& transf);
+	// Matrix must not contain projection
+	inline bool AddModel(Urho3D::Model const* model, Urho3D::Material* mat, Urho3D::Matrix4 const& transf)
+	{
+		return AddModel(model, mat, Urho3D::Matrix3x4(transf));
+	}
+
+	bool AddModel(Urho3D::Model const* model, Urho3D::Vector<Urho3D::Material*> const& mats, Urho3D::Matrix3x4 const& transf);
+
+	// Matrix must not contain projection
+	inline bool AddModel(Urho3D::Model const* model, Urho3D::Vector<Urho3D::Material*> const& mats, Urho3D::Matrix4 const& transf)
+	{
+		return AddModel(model, mats, Urho3D::Matrix3x4(transf));
+	}
 
 	// Functions to add Triangle
 	bool StartAddingTriangle(Urho3D::PODVector<Urho3D::VertexElement> const& elems, Urho3D::Material* mat);
@@ -49,12 +68,54 @@ public:
 	inline bool AddTriangleData(Urho3D::Vector3 const& v) { return AddTriangleData((unsigned char const*)v.Data(), sizeof(float) * 3); }
 	bool AddTriangleData(unsigned char const* buf, unsigned buf_size);
 
+	// Vertices that are identical after transforming are merged by default.
+	// Welding can be disabled when input is separate instances that never
+	// share vertices. This must be called before adding anything.
+	inline void SetWeldingEnabled(bool enabled) { welding = enabled; }
+
+	// Stores normals, binormals and tangents of combined Model as
+	// TYPE_UBYTE4_NORM, where components are mapped from [-1, 1] to
+	// [0, 1]. Shaders must unpack them, for example using PACKEDNORMAL
+	// vertex shader define. Input may be packed or not.
+	// This must be called before adding anything.
+	inline void SetPackedNormals(bool enabled) { pack_normals = enabled; }
+
+	// Reorders triangles and vertices of combined Model, so that GPU
+	// can reuse transformed vertices better. This makes finalizing
+	// slower. This must be called before adding anything.
+	inline void SetMeshOptimizationEnabled(bool enabled) { optimize_mesh = enabled; }
+
+	// Adds simplified LOD level to combined Model. The level is used from
+	// given distance and it has about the given ratio of triangles of the
+	// full detail. Up to three levels can be added, in increasing order.
+	// Vertices are merged by position for simplification, so this works
+	// also without welding. This must be called before adding anything.
+	bool AddLodLevel(float distance, float tris_ratio);
+
+	// Uses cache to get results of identical earlier input. Input is
+	// identified by source Geometries, Materials, transforms and
+	// options. When cache is used, processing is started only when
+	// Ready() or FinalizeNow() is called. This must be called before
+	// adding anything.
+	inline void SetCache(ModelCombinerCache* cache) { this->cache = cache; }
+
+	// Limits how many bytes of vertex and index data are uploaded
+	// to GPU per call of Ready(). Zero means no limit, which is default.
+	// At least one vertex and one index are uploaded per call, so a
+	// slice smaller than that does not stall uploading.
+	inline void SetUploadSliceSize(unsigned bytes) { upload_slice_size = bytes; }
+
 	// Check if combining is ready. This should
 	// be called repeatedly until it returns true.
 	bool Ready();
 
-	// Blocks until ready.
+	// Blocks until ready. Remaining input is processed in the calling
+	// thread together with workers, and buffers are uploaded at once.
 	void FinalizeNow();
+	// Same, but gives up after timeout and returns false. Finalizing
+	// can then be continued using Ready() or by calling this again.
+	// Timeout may be exceeded by the time it takes to process a block.
+	bool FinalizeNow(unsigned timeout_msec);
 
 	Urho3D::Model* GetModel();
 	Urho3D::Material* GetMaterial(unsigned geom_i);
@@ -64,34 +125,114 @@ private:
 	typedef Urho3D::PODVector<unsigned char> ByteBuf;
 	typedef Urho3D::PODVector<unsigned> IndexBuf;
 	typedef Urho3D::HashMap<Urho3D::Material*, IndexBuf> IndexBufsByMaterial;
-	typedef Urho3D::HashMap<unsigned, unsigned> IndexCache;
+	typedef Urho3D::HashMap<unsigned, unsigned> WeldBuckets;
+
+	static unsigned char const OP_COPY = 0;
+	static unsigned char const OP_POSITION = 1;
+	static unsigned char const OP_DIRECTION = 2;
+
+	struct TransformOp
+	{
+		unsigned char op;
+		Urho3D::VertexElementType src_type;
+		Urho3D::VertexElementType dest_type;
+		unsigned src_offset;
+		unsigned dest_offset;
+		unsigned size;
+	};
+	typedef Urho3D::PODVector<TransformOp> TransformPlan;
+
+	struct LodLevel
+	{
+		float distance;
+		float tris_ratio;
+	};
+	typedef Urho3D::PODVector<LodLevel> LodLevels;
+
+	static unsigned const MAX_LOD_LEVELS = 3;
 
 	struct RawVBuf
 	{
+		// Layout of source vertices
+		unsigned src_vrt_size;
+		Urho3D::PODVector<Urho3D::VertexElement> src_elems;
+		// Layout of combined vertices
 		ByteBuf buf;
 		unsigned vrt_size;
 		Urho3D::PODVector<Urho3D::VertexElement> elems;
 		IndexBufsByMaterial tris;
+		// Triangles of simplified LOD levels, with
+		// materials in the same order as in "tris".
+		Urho3D::Vector<IndexBufsByMaterial> lod_tris;
+		// Plan for converting source vertices to combined ones
+		bool elems_supported;
+		TransformPlan plan;
+		int pos_offset;
+		// Vertices are bucketed by their quantized position for welding.
+		// Buckets are linked lists, where "weld_next" has the next vertex.
+		WeldBuckets weld_buckets;
+		Urho3D::PODVector<unsigned> weld_next;
+		// Final indices of all materials, level by level
+		ByteBuf ibuf_bytes;
+		unsigned idx_size;
 	};
 	typedef Urho3D::Vector<RawVBuf> RawVBufs;
 
-	struct QueueItem : Urho3D::RefCounted
+	// Raw data of a Geometry. Instances of the same Geometry share this.
+	struct SourceGeometry : Urho3D::RefCounted
 	{
+		// Keeps Geometry alive, so its address is not reused
+		Urho3D::SharedPtr<Urho3D::Geometry> geom;
 		unsigned vrt_size;
 		ByteBuf vbuf;
 		unsigned idx_size;
 		ByteBuf ibuf;
 		Urho3D::PODVector<Urho3D::VertexElement> elems;
 		Urho3D::PrimitiveType primitive_type;
+	};
+	typedef Urho3D::Vector<Urho3D::SharedPtr<SourceGeometry> > SourceGeometries;
+	typedef Urho3D::HashMap<Urho3D::Geometry const*, SourceGeometry*> SourceGeometriesByGeometry;
+
+	struct QueueItem : Urho3D::RefCounted
+	{
+		// Workers only read this, so it is not reference counted
+		SourceGeometry const* src;
 		Urho3D::Material* mat;
-		Urho3D::Matrix4 transf;
+		Urho3D::Matrix3x4 transf;
 	};
 	typedef Urho3D::Vector<Urho3D::SharedPtr<QueueItem> > Queue;
 
-	Queue queue;
+	// Input is divided to blocks of consecutive items. Workers process
+	// whole blocks to their own buffers, and blocks are merged in order,
+	// so result does not depend on how many workers there were.
+	struct Block : Urho3D::RefCounted
+	{
+		Queue items;
+		RawVBufs raw_vbufs;
+		Urho3D::BoundingBox bb;
+		// Temporary buffers that are reused between items
+		ByteBuf vrts_transfd;
+		Urho3D::PODVector<unsigned> vrts_map;
+	};
+	typedef Urho3D::Vector<Urho3D::SharedPtr<Block> > Blocks;
+
+	// Blocks and how many of them workers have already claimed
+	Blocks blocks;
+	unsigned blocks_claimed;
 	Urho3D::Mutex queue_mutex;
 
-	Urho3D::SharedPtr<Urho3D::WorkItem> worker_wi;
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::WorkItem> > workers;
+
+	// Number of workers and index conversions that are queued or running.
+	// FinalizeNow() uses this to wait for them without spinning.
+	unsigned tasks_running;
+	std::mutex tasks_mutex;
+	std::condition_variable tasks_cond;
+
+	// These are only used by the main thread, and
+	// they are kept until combining is finished.
+	SourceGeometries srcs;
+	SourceGeometriesByGeometry srcs_by_geom;
 
 	RawVBufs raw_vbufs;
 	Urho3D::BoundingBox bb;
@@ -102,18 +243,54 @@ private:
 	ByteBuf tri_add_buf;
 	unsigned tri_add_vrt_size;
 
+	bool welding;
+	bool pack_normals;
+	bool optimize_mesh;
+	LodLevels lod_levels;
+
+	// Hash of everything added so far, and the
+	// key of cache that is calculated from it.
+	Urho3D::SharedPtr<ModelCombinerCache> cache;
+	unsigned long long input_hash;
+	unsigned long long cache_key;
+	bool cache_checked;
+
 	// State of process
 	volatile bool no_more_input_coming;
 	volatile bool give_up;
 
+	// State of finalizing
+	Urho3D::SharedPtr<Urho3D::WorkItem> indices_wi;
+	bool indices_ready;
+	unsigned upload_slice_size;
+	unsigned upload_vbuf_i;
+	unsigned upload_vrts_done;
+	unsigned upload_idxs_done;
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::VertexBuffer> > vbufs;
+	Urho3D::Vector<Urho3D::SharedPtr<Urho3D::IndexBuffer> > ibufs;
+
 	// Results
 	bool finalized;
 	Urho3D::SharedPtr<Urho3D::Model> model;
 	Urho3D::Vector<Urho3D::Material*> mats;
 
-	RawVBuf* GetOrCreateVertexbuffer(unsigned vrt_size, Urho3D::PODVector<Urho3D::VertexElement> const& elems);
+	RawVBuf* GetOrCreateVertexbuffer(RawVBufs& raw_vbufs, unsigned src_vrt_size, Urho3D::PODVector<Urho3D::VertexElement> const& src_elems);
+
+	SourceGeometry* GetOrCreateSourceGeometry(Urho3D::Geometry const* geom);
+
+	// Transforms all vertices of source geometry to "result",
+	// using the layout of combined vertices.
+	static void TransformVertices(ByteBuf& result, RawVBuf const* raw_vbuf, SourceGeometry const* src, Urho3D::Matrix3x4 const& transf);
+
+	// Vertex data must be already transformed
+	unsigned GetOrCreateVertexIndex(RawVBuf* raw_vbuf, unsigned char const* vrt_data);
 
-	int GetOrCreateVertexIndex(RawVBuf* raw_vbuf, unsigned char const* vrt_data, Urho3D::Matrix4 const& transf);
+	static bool VerticesMatch(Urho3D::PODVector<Urho3D::VertexElement> const& elems, unsigned char const* vrt1, unsigned char const* vrt2);
+
+	inline static unsigned GetWeldBucketKey(int x, int y, int z)
+	{
+		return (unsigned(x) * 73856093u) ^ (unsigned(y) * 19349663u) ^ (unsigned(z) * 83492791u);
+	}
 
 	inline static unsigned GetIndex(unsigned char const* ibuf, unsigned idx_size, unsigned idx)
 	{
@@ -122,11 +299,51 @@ private:
 		return ((unsigned const*)ibuf)[idx];
 	}
 
-	void AddTriangle(Urho3D::Material* mat, RawVBuf* raw_vbuf, unsigned vrt1, unsigned vrt2, unsigned vrt3);
+	// Adds bytes to hash of input
+	void HashInput(void const* data, unsigned size);
+
+	// Returns true if result was found from cache
+	bool UseCachedResult();
+	void StoreResultToCache();
+
+	void PushToQueue(Urho3D::SharedPtr<QueueItem> qitem);
+
+	// Returns how many blocks could be claimed by workers. Block that
+	// is still being filled can be claimed only after Ready() is called.
+	// Mutex must be locked when calling this.
+	unsigned GetNumClaimableBlocks() const;
+	// Returns NULL if there is nothing to claim
+	Block* ClaimBlock();
+
+	void MakeSureWorkersAreRunning();
+
+	void TaskStarted();
+	void TaskFinished();
+
+	// Processes blocks until there is nothing to claim
+	void ProcessBlocks();
+	// These return false on error or when giving up
+	bool ProcessBlock(Block* block);
+	bool ProcessQueueItem(Block* block, QueueItem const* qitem);
+
+	// Merges buffers of all blocks to final buffers. When welding,
+	// vertices are welded also with the ones of earlier blocks.
+	void MergeBlocks();
+
+	// Simplifies triangles of all materials to LOD levels
+	void GenerateLodLevels(RawVBuf& raw_vbuf);
+
+	// Optimizes vertex cache and fetch of merged buffers
+	void OptimizeMesh(RawVBuf& raw_vbuf);
+
+	// Merges blocks and converts indices to final format
+	void ConvertIndices();
 
-	void MakeSureTaskIsRunning();
+	// Returns true when all buffers are uploaded
+	bool UploadBuffers();
 
 	static void Worker(Urho3D::WorkItem const* wi, unsigned thread_i);
+	static void IndicesWorker(Urho3D::WorkItem const* wi, unsigned thread_i);
 };
 
 }
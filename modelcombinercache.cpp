@@ -0,0 +1,76 @@
+#include "modelcombinercache.hpp"
+
+namespace UrhoExtras
+{
+
+ModelCombinerCache::ModelCombinerCache(unsigned max_memory) :
+max_memory(max_memory),
+memory_use(0),
+use_counter(0),
+hits(0),
+misses(0)
+{
+}
+
+void ModelCombinerCache::Clear()
+{
+	entries.Clear();
+	memory_use = 0;
+}
+
+bool ModelCombinerCache::Get(Urho3D::SharedPtr<Urho3D::Model>& result_model, Urho3D::Vector<Urho3D::Material*>& result_mats, unsigned long long key)
+{
+	Entries::Iterator entries_find = entries.Find(key);
+	if (entries_find == entries.End()) {
+		++ misses;
+		return false;
+	}
+	++ hits;
+
+	Entry& entry = entries_find->second_;
+	entry.last_use = ++ use_counter;
+
+	result_model = entry.model;
+	result_mats.Clear();
+	for (Urho3D::Material* mat : entry.mats) {
+		result_mats.Push(mat);
+	}
+	return true;
+}
+
+void ModelCombinerCache::Store(unsigned long long key, Urho3D::Model* model, Urho3D::Vector<Urho3D::Material*> const& mats, Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Geometry> > const& srcs, unsigned memory)
+{
+	if (memory > max_memory) {
+		return;
+	}
+
+	Entries::Iterator entries_find = entries.Find(key);
+	if (entries_find != entries.End()) {
+		memory_use -= entries_find->second_.memory;
+		entries.Erase(entries_find);
+	}
+
+	// Forget least recently used entries until the new one fits
+	while (memory_use + memory > max_memory) {
+		Entries::Iterator oldest = entries.Begin();
+		for (Entries::Iterator entries_it = entries.Begin(); entries_it != entries.End(); ++ entries_it) {
+			if (entries_it->second_.last_use < oldest->second_.last_use) {
+				oldest = entries_it;
+			}
+		}
+		memory_use -= oldest->second_.memory;
+		entries.Erase(oldest);
+	}
+
+	Entry& entry = entries[key];
+	entry.model = model;
+	for (Urho3D::Material* mat : mats) {
+		entry.mats.Push(Urho3D::SharedPtr<Urho3D::Material>(mat));
+	}
+	entry.srcs = srcs;
+	entry.memory = memory;
+	entry.last_use = ++ use_counter;
+	memory_use += memory;
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef URHOEXTRAS_MODELCOMBINERCACHE_HPP
+#define URHOEXTRAS_MODELCOMBINERCACHE_HPP
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/RefCounted.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Graphics/Geometry.h>
+#include <Urho3D/Graphics/Material.h>
+#include <Urho3D/Graphics/Model.h>
+
+namespace UrhoExtras
+{
+
+// Keeps finalized results of ModelCombiners, so combiners that get
+// identical input can return them without combining again. Results
+// are shared, so their Models must not be modified. Least recently
+// used results are forgotten when the memory limit is exceeded.
+// This must be used only from the main thread.
+class ModelCombinerCache : public Urho3D::RefCounted
+{
+
+public:
+
+	// Limit is in bytes of vertex and index data
+	ModelCombinerCache(unsigned max_memory);
+
+	void Clear();
+
+	inline unsigned GetMemoryUse() const { return memory_use; }
+	inline unsigned GetHits() const { return hits; }
+	inline unsigned GetMisses() const { return misses; }
+
+	// These are used by ModelCombiner. Model may be NULL, if
+	// combining resulted to nothing. Get returns false on miss.
+	bool Get(Urho3D::SharedPtr<Urho3D::Model>& result_model, Urho3D::Vector<Urho3D::Material*>& result_mats, unsigned long long key);
+	void Store(unsigned long long key, Urho3D::Model* model, Urho3D::Vector<Urho3D::Material*> const& mats, Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Geometry> > const& srcs, unsigned memory);
+
+private:
+
+	struct Entry
+	{
+		Urho3D::SharedPtr<Urho3D::Model> model;
+		Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Material> > mats;
+		// Keys contain addresses of source Geometries and Materials,
+		// so they are kept alive to prevent the addresses from being
+		// reused by something else.
+		Urho3D::Vector<Urho3D::SharedPtr<Urho3D::Geometry> > srcs;
+		unsigned memory;
+		unsigned last_use;
+	};
+	typedef Urho3D::HashMap<unsigned long long, Entry> Entries;
+
+	unsigned const max_memory;
+
+	Entries entries;
+	unsigned memory_use;
+	unsigned use_counter;
+
+	unsigned hits;
+	unsigned misses;
+};
+
+}
+
+#endif
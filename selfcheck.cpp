@@ -0,0 +1,102 @@
+#include "selfcheck.hpp"
+
+#include "../urhoextras/collisions.hpp"
+#include "../urhoextras/random.hpp"
+
+#include <Urho3D/IO/Log.h>
+
+namespace BigWorld
+{
+
+namespace
+{
+
+UrhoExtras::Triangle randomTriangle(UrhoExtras::Random& rnd)
+{
+	Urho3D::Vector3 p1 = rnd.randomVector3(4);
+	Urho3D::Vector3 p2 = p1 + rnd.randomVector3(2);
+	Urho3D::Vector3 p3 = p1 + rnd.randomVector3(2);
+	// Some triangles have no area
+	switch (rnd.randomUnsigned(8)) {
+	case 0:
+		p2 = p1;
+		break;
+	case 1:
+		p3 = p2 = p1;
+		break;
+	case 2:
+		p3 = p1 + (p2 - p1) * rnd.randomFloatRange(-1, 2);
+		break;
+	}
+	return UrhoExtras::Triangle(p1, p2, p3);
+}
+
+UrhoExtras::CollisionShape randomShape(UrhoExtras::Random& rnd)
+{
+	Urho3D::Vector3 pos = rnd.randomVector3(4);
+	float radius = rnd.randomFloatRange(0.05, 1.5);
+	if (rnd.randomBool()) {
+		return UrhoExtras::CollisionShape::createSphere(pos, radius);
+	}
+	// Some capsules have no length
+	Urho3D::Vector3 pos2 = pos;
+	if (rnd.randomUnsigned(4) != 0) {
+		pos2 += rnd.randomVector3(2);
+	}
+	return UrhoExtras::CollisionShape::createCapsule(pos, pos2, radius);
+}
+
+bool checkBatchedCollisions(UrhoExtras::Random& rnd, unsigned rounds)
+{
+	unsigned mismatches = 0;
+	unsigned collisions = 0;
+
+	UrhoExtras::TriangleBatch batch;
+	for (unsigned round = 0; round < rounds; ++ round) {
+		batch.clear();
+		// Also test sizes that do not fill the last group
+		unsigned tris_size = 1 + rnd.randomUnsigned(23);
+		for (unsigned i = 0; i < tris_size; ++ i) {
+			batch.add(randomTriangle(rnd));
+		}
+
+		UrhoExtras::CollisionShape shape = randomShape(rnd);
+		float extra_radius = rnd.randomBool() ? -1 : rnd.randomFloatRange(0, 1);
+		bool only_front = rnd.randomBool();
+		Urho3D::BoundingBox bb = shape.getBoundingBox(extra_radius < 0 ? shape.getRadius() : extra_radius);
+
+		UrhoExtras::Collisions batched;
+		shape.getCollisionsToTriangles(batched, batch, bb, extra_radius, only_front);
+
+		UrhoExtras::Collisions scalar;
+		for (unsigned i = 0; i < batch.size(); ++ i) {
+			shape.getCollisionsToTriangle(scalar, batch.getTriangle(i), bb, extra_radius, only_front);
+		}
+
+		bool match = batched.Size() == scalar.Size();
+		for (unsigned i = 0; match && i < scalar.Size(); ++ i) {
+			match = batched[i].normal == scalar[i].normal && batched[i].depth == scalar[i].depth;
+		}
+		if (!match) {
+			++ mismatches;
+			URHO3D_LOGERROR("Batched collisions differ in round " + Urho3D::String(round) + ": " + Urho3D::String(batched.Size()) + " collisions, expected " + Urho3D::String(scalar.Size()) + ".");
+		}
+		collisions += scalar.Size();
+	}
+
+	URHO3D_LOGINFO("Batched collisions: " + Urho3D::String(rounds) + " rounds, " + Urho3D::String(collisions) + " collisions, " + Urho3D::String(mismatches) + " mismatches.");
+	return mismatches == 0;
+}
+
+}
+
+bool runSelfCheck(unsigned seed, unsigned rounds)
+{
+	UrhoExtras::Random rnd(seed);
+
+	bool ok = true;
+	ok = checkBatchedCollisions(rnd, rounds) && ok;
+	return ok;
+}
+
+}
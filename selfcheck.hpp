@@ -0,0 +1,14 @@
+#ifndef BIGWORLD_SELFCHECK_HPP
+#define BIGWORLD_SELFCHECK_HPP
+
+namespace BigWorld
+{
+
+// Compares optimized code paths against the simple ones they replace,
+// using random input. Mismatches are logged as errors. Returns true if
+// everything matched.
+bool runSelfCheck(unsigned seed, unsigned rounds);
+
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef URHOEXTRAS_TRIANGLE_HPP
 #define URHOEXTRAS_TRIANGLE_HPP
 
+#include <Urho3D/Container/Vector.h>
 #include <Urho3D/Math/Matrix4.h>
 #include <Urho3D/Math/Plane.h>
 #include <Urho3D/Math/Vector3.h>
@@ -29,6 +30,8 @@ public:
 	Urho3D::Vector3 p1, p2, p3;
 };
 
+typedef Urho3D::PODVector<Triangle> Triangles;
+
 inline Triangle operator*(Urho3D::Matrix4 const& m, Triangle const& t)
 {
 	return Triangle(m * t.p1, m * t.p2, m * t.p3);
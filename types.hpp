@@ -9,10 +9,12 @@
 #include <Urho3D/IO/Serializer.h>
 #include <Urho3D/Math/Vector2.h>
 #include <Urho3D/Math/BoundingBox.h>
+#include <Urho3D/Math/Matrix3x4.h>
+#include <Urho3D/Math/Quaternion.h>
 #include <Urho3D/Resource/Image.h>
 
+#include <cassert>
 #include <cstdint>
-#include <map>
 
 namespace BigWorld
 {
@@ -189,53 +191,126 @@ public:
 		return buf[idx * 2 + 1];
 	}
 
-	inline TTypesByWeight averageOfTwo(TTypesByWeight const& other) const
+	inline unsigned getTotalWeight() const
 	{
-		// For better precision, store both first to map
-		std::map<uint8_t, uint16_t> temp;
-		for (unsigned i = 0; i < size(); ++ i) {
-			uint8_t v = getValueByte(i);
+		unsigned total_weight = 0;
+		for (unsigned i = 1; i < buf_size; i += 2) {
+			total_weight += buf[i];
+		}
+		return total_weight;
+	}
+
+private:
+
+	uint8_t* buf;
+	uint8_t buf_size;
+};
+
+// Allocation free blending of terraintype weights. Weights of multiple
+// TTypesByWeight are summed to fixed number of inline slots. Unlike in
+// TTypesByWeight, terraintypes are in the order they were first added,
+// not sorted. If there are more than CAPACITY terraintypes, a new one
+// replaces the one with the smallest weight if it has more weight itself,
+// and is dropped otherwise. Dropped weights do not count in the total.
+class TTypesBlend
+{
+
+public:
+
+	static unsigned const CAPACITY = 8;
+
+	inline TTypesBlend() :
+	slots_size(0)
+	{
+	}
+
+	inline void clear()
+	{
+		slots_size = 0;
+	}
+
+	inline void add(TTypesByWeight const& ttypes)
+	{
+		for (unsigned i = 0; i < ttypes.size(); ++ i) {
+			uint8_t v = ttypes.getValueByte(i);
 			if (v > 0) {
-				uint8_t k = getKey(i);
-				temp[k] = v;
+				addWeight(ttypes.getKey(i), v);
 			}
 		}
-		for (unsigned i = 0; i < other.size(); ++ i) {
-			uint8_t v = other.getValueByte(i);
-			if (v > 0) {
-				uint8_t k = other.getKey(i);
-				std::map<uint8_t, uint16_t>::iterator temp_find = temp.find(k);
-				if (temp_find != temp.end()) {
-					temp_find->second += v;
-				} else {
-					temp[k] = v;
-				}
+	}
+
+	inline void addWeight(uint8_t key, unsigned weight)
+	{
+		for (unsigned i = 0; i < slots_size; ++ i) {
+			if (keys[i] == key) {
+				weights[i] += weight;
+				return;
 			}
 		}
-		// Construct result
-		TTypesByWeight result;
-		for (std::map<uint8_t, uint16_t>::iterator i = temp.begin(); i != temp.end(); ++ i) {
-			uint8_t v = i->second / 2;
-			if (v > 0) {
-				result.setByte(i->first, v);
+		if (slots_size < CAPACITY) {
+			keys[slots_size] = key;
+			weights[slots_size] = weight;
+			++ slots_size;
+			return;
+		}
+		// All slots are in use, so replace the smallest one
+		unsigned smallest = 0;
+		for (unsigned i = 1; i < CAPACITY; ++ i) {
+			if (weights[i] < weights[smallest]) {
+				smallest = i;
 			}
 		}
-		return result;
+		if (weights[smallest] < weight) {
+			keys[smallest] = key;
+			weights[smallest] = weight;
+		}
+	}
+
+	inline unsigned size() const
+	{
+		return slots_size;
+	}
+
+	inline uint8_t getKey(unsigned idx) const
+	{
+		return keys[idx];
+	}
+
+	inline unsigned getWeight(unsigned idx) const
+	{
+		return weights[idx];
 	}
 
 	inline unsigned getTotalWeight() const
 	{
 		unsigned total_weight = 0;
-		for (unsigned i = 1; i < buf_size; i += 2) {
-			total_weight += buf[i];
+		for (unsigned i = 0; i < slots_size; ++ i) {
+			total_weight += weights[i];
 		}
 		return total_weight;
 	}
 
+	// Selects terraintype so that the probability of every
+	// terraintype is relative to its weight. Blend must not be
+	// empty and "random" can be any value.
+	inline uint8_t select(unsigned random) const
+	{
+		assert(slots_size > 0);
+		unsigned selection_weight = random % getTotalWeight();
+		unsigned idx = 0;
+		while (selection_weight >= weights[idx]) {
+			selection_weight -= weights[idx];
+			++ idx;
+			assert(idx < slots_size);
+		}
+		return keys[idx];
+	}
+
 private:
 
-	uint8_t* buf;
-	uint8_t buf_size;
+	uint8_t keys[CAPACITY];
+	unsigned weights[CAPACITY];
+	unsigned slots_size;
 };
 
 typedef Urho3D::HashMap<Urho3D::IntVector2, uint8_t> ViewArea;
@@ -276,17 +351,22 @@ struct LodBuildingTaskData : public Urho3D::RefCounted
 	Corners corners;
 	unsigned baseheight;
 	bool calculate_ttype_image;
+	bool texture_array_mode;
+	bool dominant_ttype_only;
 	// World options
 	unsigned chunk_width;
 	float sqr_width;
 	float heightstep;
 	unsigned terrain_texture_repeats;
+	bool optimize_mesh;
 	// Output
 	Urho3D::PODVector<char> vrts_data;
 	Urho3D::PODVector<Urho3D::VertexElement> vrts_elems;
 	Urho3D::PODVector<uint32_t> idxs_data;
 	Urho3D::BoundingBox boundingbox;
-	// Outout if ttype image is calculated
+	// Outout if ttype image is calculated. In texture array
+	// mode, used_ttypes is the palette stored to vertices and
+	// if only dominant terraintype is used, it is the only one.
 	TTypes used_ttypes;
 	Urho3D::SharedPtr<Urho3D::Image> ttype_image;
 	// Occluder shape
@@ -297,8 +377,6 @@ struct LodBuildingTaskData : public Urho3D::RefCounted
 
 typedef Urho3D::Pair<Urho3D::String, Urho3D::String> StrNStr;
 
-typedef Urho3D::PODVector<Urho3D::Matrix4> Transforms;
-
 // Undergrowth stuff
 struct UndergrowthModel
 {
@@ -310,7 +388,50 @@ struct UndergrowthModel
 };
 typedef Urho3D::Vector<UndergrowthModel> UndergrowthModels;
 typedef Urho3D::HashMap<unsigned, UndergrowthModels> UndergrowthModelsByTerraintype;
-typedef Urho3D::HashMap<StrNStr, Transforms> UndergrowthPlacements;
+// Compact representation of undergrowth instance. Rotation is stored
+// as quaternion with components packed to signed normalized shorts.
+struct UndergrowthInstance
+{
+	Urho3D::Vector3 pos;
+	int16_t rot[4];
+	float scale;
+	// Instances are thinned by dropping the ones whose rank is not below
+	// the density. This way sparser set is always a subset of denser one.
+	float rank;
+
+	inline void setRotation(Urho3D::Quaternion const& q)
+	{
+		rot[0] = Urho3D::RoundToInt(Urho3D::Clamp(q.w_, -1.0f, 1.0f) * 32767);
+		rot[1] = Urho3D::RoundToInt(Urho3D::Clamp(q.x_, -1.0f, 1.0f) * 32767);
+		rot[2] = Urho3D::RoundToInt(Urho3D::Clamp(q.y_, -1.0f, 1.0f) * 32767);
+		rot[3] = Urho3D::RoundToInt(Urho3D::Clamp(q.z_, -1.0f, 1.0f) * 32767);
+	}
+
+	inline Urho3D::Quaternion getRotation() const
+	{
+		return Urho3D::Quaternion(rot[0] / 32767.0f, rot[1] / 32767.0f, rot[2] / 32767.0f, rot[3] / 32767.0f).Normalized();
+	}
+
+	inline Urho3D::Matrix3x4 getTransform() const
+	{
+		return Urho3D::Matrix3x4(pos, getRotation(), scale);
+	}
+};
+typedef Urho3D::PODVector<UndergrowthInstance> UndergrowthInstances;
+typedef Urho3D::HashMap<StrNStr, UndergrowthInstances> UndergrowthPlacements;
+struct UndergrowthTier
+{
+	unsigned min_distance_chunks;
+	float density;
+	bool use_simplified_models;
+};
+typedef Urho3D::PODVector<UndergrowthTier> UndergrowthTiers;
+struct UndergrowthLodLevel
+{
+	float distance;
+	float tris_ratio;
+};
+typedef Urho3D::PODVector<UndergrowthLodLevel> UndergrowthLodLevels;
 
 }
 
@@ -0,0 +1,122 @@
+#include "weightmapatlas.hpp"
+
+#include <Urho3D/Graphics/Graphics.h>
+#include <Urho3D/IO/Log.h>
+
+#include <stdexcept>
+
+namespace BigWorld
+{
+
+WeightMapAtlas::WeightMapAtlas(Urho3D::Context* context, unsigned page_size, unsigned map_size) :
+Urho3D::Object(context),
+page_size(page_size),
+map_size(map_size),
+maps_per_row(page_size / map_size)
+{
+	if (maps_per_row == 0) {
+		throw std::runtime_error("Weight map atlas page is too small!");
+	}
+}
+
+bool WeightMapAtlas::store(Slot& result, Urho3D::Image const* img)
+{
+	assert(!result.isValid());
+
+	if (img->GetWidth() != int(map_size) || img->GetHeight() != int(map_size)) {
+		URHO3D_LOGERROR("Weight image has invalid size!");
+		return false;
+	}
+	unsigned components = img->GetComponents();
+	if (components != 3 && components != 4) {
+		URHO3D_LOGERROR("Weight image must have three or four components!");
+		return false;
+	}
+
+	// Find a page with free space, or create new one
+	unsigned page_i = 0;
+	while (page_i < pages.Size() && pages[page_i].free_slots.Empty()) {
+		++ page_i;
+	}
+	if (page_i == pages.Size() && !createPage()) {
+		return false;
+	}
+	Page& page = pages[page_i];
+
+	result.page = page_i;
+	result.index = page.free_slots.Back();
+	page.free_slots.Pop();
+
+	// Convert to RGBA
+	unsigned char const* img_data = img->GetData();
+	unsigned char const* upload_data;
+	if (components == 4) {
+		upload_data = img_data;
+	} else {
+		upload_buf.Resize(map_size * map_size * 4);
+		unsigned char* dest = upload_buf.Buffer();
+		for (unsigned i = 0; i < map_size * map_size; ++ i) {
+			dest[0] = img_data[0];
+			dest[1] = img_data[1];
+			dest[2] = img_data[2];
+			dest[3] = 0;
+			dest += 4;
+			img_data += 3;
+		}
+		upload_data = upload_buf.Buffer();
+	}
+
+	// Upload to slot
+	int x = (result.index % maps_per_row) * map_size;
+	int y = (result.index / maps_per_row) * map_size;
+	if (!page.tex->SetData(0, x, y, map_size, map_size, upload_data)) {
+		URHO3D_LOGERROR("Unable to upload weight image to atlas!");
+		release(result);
+		return false;
+	}
+
+	return true;
+}
+
+void WeightMapAtlas::release(Slot& slot)
+{
+	if (!slot.isValid()) {
+		return;
+	}
+	assert(slot.page < pages.Size());
+	pages[slot.page].free_slots.Push(slot.index);
+	slot = Slot();
+}
+
+Urho3D::Vector2 WeightMapAtlas::getUvOffset(Slot const& slot) const
+{
+	// Point to the center of first pixel, so filtering
+	// never reads pixels from neighbor weight images.
+	unsigned x = (slot.index % maps_per_row) * map_size;
+	unsigned y = (slot.index / maps_per_row) * map_size;
+	return Urho3D::Vector2(x + 0.5, y + 0.5) / page_size;
+}
+
+bool WeightMapAtlas::createPage()
+{
+	Page page;
+	page.tex = new Urho3D::Texture2D(context_);
+	page.tex->SetNumLevels(1);
+	page.tex->SetFilterMode(Urho3D::FILTER_BILINEAR);
+	page.tex->SetAddressMode(Urho3D::COORD_U, Urho3D::ADDRESS_CLAMP);
+	page.tex->SetAddressMode(Urho3D::COORD_V, Urho3D::ADDRESS_CLAMP);
+	if (!page.tex->SetSize(page_size, page_size, Urho3D::Graphics::GetRGBAFormat())) {
+		URHO3D_LOGERROR("Unable to create weight map atlas page!");
+		return false;
+	}
+	// Use slots in order, so pages get filled from the beginning
+	unsigned slots = maps_per_row * maps_per_row;
+	page.free_slots.Reserve(slots);
+	for (unsigned i = slots; i > 0; -- i) {
+		page.free_slots.Push(i - 1);
+	}
+	pages.Push(page);
+	return true;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef BIGWORLD_WEIGHTMAPATLAS_HPP
+#define BIGWORLD_WEIGHTMAPATLAS_HPP
+
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Core/Object.h>
+#include <Urho3D/Graphics/Texture2D.h>
+#include <Urho3D/Math/Vector2.h>
+#include <Urho3D/Resource/Image.h>
+
+namespace BigWorld
+{
+
+// Stores terraintype weight images of Chunks to few big textures, so
+// there is no need for one tiny texture per Chunk. All weight images
+// must have the same size. Mipmaps are not used, so images do not
+// bleed to each others.
+class WeightMapAtlas : public Urho3D::Object
+{
+	URHO3D_OBJECT(WeightMapAtlas, Urho3D::Object)
+
+public:
+
+	struct Slot
+	{
+		unsigned page;
+		unsigned index;
+
+		inline Slot() : page(NO_PAGE), index(0) {}
+
+		inline bool isValid() const { return page != NO_PAGE; }
+	};
+
+	WeightMapAtlas(Urho3D::Context* context, unsigned page_size, unsigned map_size);
+
+	// Reserves a slot and copies image there. Image
+	// must have three or four components.
+	bool store(Slot& result, Urho3D::Image const* img);
+
+	// Makes slot available again. Invalidates the slot.
+	void release(Slot& slot);
+
+	inline Urho3D::Texture2D* getTexture(Slot const& slot) const { return pages[slot.page].tex; }
+
+	// Shader should calculate texture coordinates using
+	// offset + uv * scale, where uv is between [0, 1].
+	Urho3D::Vector2 getUvOffset(Slot const& slot) const;
+	inline Urho3D::Vector2 getUvScale() const { return Urho3D::Vector2::ONE * float(map_size - 1) / page_size; }
+
+	inline unsigned getNumPages() const { return pages.Size(); }
+
+private:
+
+	static unsigned const NO_PAGE = unsigned(-1);
+
+	struct Page
+	{
+		Urho3D::SharedPtr<Urho3D::Texture2D> tex;
+		Urho3D::PODVector<unsigned> free_slots;
+	};
+	typedef Urho3D::Vector<Page> Pages;
+
+	unsigned const page_size;
+	unsigned const map_size;
+	unsigned const maps_per_row;
+
+	Pages pages;
+
+	// Buffer for converting images before uploading
+	Urho3D::PODVector<unsigned char> upload_buf;
+
+	bool createPage();
+};
+
+}
+
+#endif